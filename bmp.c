@@ -46,7 +46,7 @@ int bmp_close(struct sampler *sampler)
 	return 0;
 }
 
-int bmp_open(struct sampler **sampler, const char *filename)
+int bmp_open(struct sampler **sampler, const char *filename, int flags)
 {
 	struct sampler *s;
 	int ret;
@@ -55,7 +55,7 @@ int bmp_open(struct sampler **sampler, const char *filename)
 	if (!s)
 		return -ENOMEM;
 
-	ret = sampler_init(s, filename);
+	ret = sampler_init(s, filename, flags);
 	if (ret < 0) {
 		free(s);
 		return ret;
@@ -3,6 +3,6 @@
 
 #include "sampler.h"
 
-int bmp_open(struct sampler **sampler, const char *filename);
+int bmp_open(struct sampler **sampler, const char *filename, int flags);
 
 #endif
@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include "chacha.h"
+
+/*
+ * Four blocks are computed at once, one per vector lane, so the rounds run
+ * on SSE2 or NEON registers without any intrinsics.
+ */
+#define CHACHA_WAYS 4
+#define CHACHA_BLOCK 64
+
+typedef uint32_t vec_t __attribute__((vector_size(CHACHA_WAYS * sizeof(uint32_t))));
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)				\
+	do {						\
+		a += b; d ^= a; d = ROTL(d, 16);	\
+		c += d; b ^= c; b = ROTL(b, 12);	\
+		a += b; d ^= a; d = ROTL(d, 8);		\
+		c += d; b ^= c; b = ROTL(b, 7);		\
+	} while (0)
+
+static inline uint32_t load32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+void chacha_init(struct chacha *chacha, const unsigned char *key, const unsigned char *nonce)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		chacha->key[i] = load32(key + i * 4);
+
+	for (i = 0; i < 2; i++)
+		chacha->nonce[i] = load32(nonce + i * 4);
+}
+
+// chacha_blocks fills out with the keystream blocks block .. block+CHACHA_WAYS-1
+static void chacha_blocks(const struct chacha *chacha, uint64_t block, unsigned char *out)
+{
+	static const uint32_t sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+	vec_t state[16], x[16];
+	int i, j;
+
+	for (i = 0; i < 4; i++)
+		state[i] = (vec_t){} + sigma[i];
+	for (i = 0; i < 8; i++)
+		state[4 + i] = (vec_t){} + chacha->key[i];
+
+	for (j = 0; j < CHACHA_WAYS; j++) {
+		state[12][j] = block + j;
+		state[13][j] = (block + j) >> 32;
+	}
+
+	state[14] = (vec_t){} + chacha->nonce[0];
+	state[15] = (vec_t){} + chacha->nonce[1];
+
+	memcpy(x, state, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i++) {
+		x[i] += state[i];
+		for (j = 0; j < CHACHA_WAYS; j++)
+			store32(out + j * CHACHA_BLOCK + i * 4, x[i][j]);
+	}
+}
+
+void chacha_xor(const struct chacha *chacha, unsigned char *buf, size_t size, uint64_t offset)
+{
+	unsigned char stream[CHACHA_WAYS * CHACHA_BLOCK];
+	uint64_t block = offset / CHACHA_BLOCK;
+	size_t skip = offset % CHACHA_BLOCK;
+	uint64_t a, b;
+	size_t len, i;
+
+	while (size) {
+		chacha_blocks(chacha, block, stream);
+
+		len = sizeof(stream) - skip;
+		if (len > size)
+			len = size;
+
+		for (i = 0; i + sizeof(a) <= len; i += sizeof(a)) {
+			memcpy(&a, buf + i, sizeof(a));
+			memcpy(&b, stream + skip + i, sizeof(b));
+			a ^= b;
+			memcpy(buf + i, &a, sizeof(a));
+		}
+
+		for (; i < len; i++)
+			buf[i] ^= stream[skip + i];
+
+		buf += len;
+		size -= len;
+		block += CHACHA_WAYS;
+		skip = 0;
+	}
+}
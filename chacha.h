@@ -0,0 +1,21 @@
+#ifndef GHOST_CHACHA_H
+#define GHOST_CHACHA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA_KEY_SIZE 32
+#define CHACHA_NONCE_SIZE 8
+
+// ChaCha20 with a 64-bit block counter and a 64-bit nonce
+struct chacha {
+	uint32_t key[8];
+	uint32_t nonce[2];
+};
+
+void chacha_init(struct chacha *chacha, const unsigned char *key, const unsigned char *nonce);
+
+// chacha_xor xors buf with the keystream from byte offset on
+void chacha_xor(const struct chacha *chacha, unsigned char *buf, size_t size, uint64_t offset);
+
+#endif
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "chacha.h"
+#include "cipher.h"
+#include "poly1305.h"
+#include "sha256.h"
+#include "stegger.h"
+#include "util.h"
+
+/*
+ * The cipher stegger encrypts with ChaCha20, the keystream at each carrier
+ * byte offset being fixed, so any range can be read or written on its own.
+ * Rewriting a range reuses its keystream though, which is only good enough
+ * for metadata: ranges sealed with stegger_seal get the keystream of their
+ * nonce instead, from a second key, and a Poly1305 tag.
+ *
+ * The keys come from the password through PBKDF2-HMAC-SHA256 with a random
+ * salt, kept in the clear in the first CIPHER_SALT bytes of the carrier.
+ * Nothing else is stored: a wrong password just finds no filesystem.
+ */
+#define CIPHER_CHUNK 4096
+#define CIPHER_SALT 16
+#define CIPHER_ITERATIONS 100000
+
+struct cipher {
+	// keystream by offset
+	struct chacha chacha;
+	// key of sealed ranges, the nonce is set for each
+	struct chacha seal;
+
+	struct stegger *inner;
+
+	struct stegger stegger;
+};
+
+// cipher_chunk returns how much of size from offset fits the chunk offset is in
+static size_t cipher_chunk(size_t size, size_t offset)
+{
+	size_t len = CIPHER_CHUNK - offset % CIPHER_CHUNK;
+
+	return len < size ? len : size;
+}
+
+// reads are decrypted chunk by chunk, while the chunk is still in cache
+static int cipher_read(struct stegger *stegger, void *buf, size_t size, size_t offset)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+	unsigned char *bp = buf;
+	size_t len;
+	int ret;
+
+	for (; size; size -= len, bp += len, offset += len) {
+		len = cipher_chunk(size, offset);
+
+		ret = stegger_read(cipher->inner, bp, len, CIPHER_SALT + offset);
+		if (ret < 0)
+			return ret;
+
+		chacha_xor(&cipher->chacha, bp, len, offset);
+	}
+
+	return 0;
+}
+
+static int cipher_write(struct stegger *stegger, const void *buf, size_t size, size_t offset)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+	unsigned char chunk[CIPHER_CHUNK];
+	const unsigned char *bp = buf;
+	size_t len;
+	int ret;
+
+	for (; size; size -= len, bp += len, offset += len) {
+		len = cipher_chunk(size, offset);
+
+		memcpy(chunk, bp, len);
+		chacha_xor(&cipher->chacha, chunk, len, offset);
+
+		ret = stegger_write(cipher->inner, chunk, len, CIPHER_SALT + offset);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * cipher_sealer sets up the keystream of nonce in chacha and the Poly1305
+ * key from its first block, the data being encrypted from the second on
+ * (RFC 8439).
+ */
+static void cipher_sealer(struct cipher *cipher, uint64_t nonce, struct chacha *chacha,
+			  struct poly1305 *poly)
+{
+	unsigned char key[64] = { 0 };
+
+	*chacha = cipher->seal;
+	chacha->nonce[0] = nonce;
+	chacha->nonce[1] = nonce >> 32;
+
+	chacha_xor(chacha, key, sizeof(key), 0);
+	poly1305_init(poly, key);
+}
+
+/*
+ * The tag is the one of the RFC 8439 AEAD, the additional data being the
+ * offset followed by aad: a sealed range only fits where it was and along
+ * with the same aad.
+ */
+static void cipher_aad(struct poly1305 *poly, size_t offset, const void *aad, size_t aad_size)
+{
+	static const unsigned char zeros[16];
+	uint64_t where = offset;
+
+	poly1305_update(poly, &where, sizeof(where));
+	poly1305_update(poly, aad, aad_size);
+	poly1305_update(poly, zeros, (16 - (sizeof(where) + aad_size) % 16) % 16);
+}
+
+static void cipher_tag(struct poly1305 *poly, size_t aad_size, size_t size, unsigned char *tag)
+{
+	static const unsigned char zeros[16];
+	uint64_t lengths[2] = { sizeof(uint64_t) + aad_size, size };
+
+	poly1305_update(poly, zeros, (16 - size % 16) % 16);
+	poly1305_update(poly, lengths, sizeof(lengths));
+	poly1305_final(poly, tag);
+}
+
+static int cipher_seal(struct stegger *stegger, const void *buf, size_t size, size_t offset,
+		       uint64_t nonce, const void *aad, size_t aad_size, unsigned char *tag)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+	unsigned char chunk[CIPHER_CHUNK];
+	const unsigned char *bp = buf;
+	struct poly1305 poly;
+	struct chacha chacha;
+	size_t done, len;
+	int ret;
+
+	cipher_sealer(cipher, nonce, &chacha, &poly);
+	cipher_aad(&poly, offset, aad, aad_size);
+
+	for (done = 0; done < size; done += len) {
+		len = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+
+		memcpy(chunk, bp + done, len);
+		chacha_xor(&chacha, chunk, len, 64 + done);
+		poly1305_update(&poly, chunk, len);
+
+		ret = stegger_write(cipher->inner, chunk, len, CIPHER_SALT + offset + done);
+		if (ret < 0)
+			return ret;
+	}
+
+	cipher_tag(&poly, aad_size, size, tag);
+
+	return 0;
+}
+
+static int cipher_unseal(struct stegger *stegger, void *buf, size_t size, size_t offset,
+			 uint64_t nonce, const void *aad, size_t aad_size, const unsigned char *tag)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+	unsigned char expected[POLY1305_TAG_SIZE], diff = 0;
+	struct poly1305 poly;
+	struct chacha chacha;
+	int i, ret;
+
+	cipher_sealer(cipher, nonce, &chacha, &poly);
+
+	if (size) {
+		ret = stegger_read(cipher->inner, buf, size, CIPHER_SALT + offset);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (tag) {
+		cipher_aad(&poly, offset, aad, aad_size);
+		if (size)
+			poly1305_update(&poly, buf, size);
+		cipher_tag(&poly, aad_size, size, expected);
+
+		for (i = 0; i < POLY1305_TAG_SIZE; i++)
+			diff |= expected[i] ^ tag[i];
+		if (diff)
+			return -EBADMSG;
+	}
+
+	chacha_xor(&chacha, buf, size, 64);
+
+	return 0;
+}
+
+static int cipher_sync(struct stegger *stegger, size_t size, size_t offset, int flags)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+
+	return stegger_sync(cipher->inner, size, CIPHER_SALT + offset, flags);
+}
+
+static int cipher_advise(struct stegger *stegger, size_t size, size_t offset, int advice)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+
+	return stegger_advise(cipher->inner, size, CIPHER_SALT + offset, advice);
+}
+
+static int cipher_close(struct stegger *stegger)
+{
+	struct cipher *cipher = container_of(stegger, struct cipher, stegger);
+	int ret;
+
+	ret = stegger_close(cipher->inner);
+	free(cipher);
+	return ret;
+}
+
+// cipher_derive derives the two keys from password and salt
+static void cipher_derive(const char *password, const unsigned char *salt, unsigned char *key,
+			  unsigned char *seal_key)
+{
+	unsigned char master[SHA256_SIZE], tag;
+	struct sha256 ctx;
+
+	pbkdf2_sha256(password, strlen(password), salt, CIPHER_SALT, CIPHER_ITERATIONS,
+		      master, sizeof(master));
+
+	for (tag = 0; tag < 2; tag++) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, master, sizeof(master));
+		sha256_update(&ctx, &tag, sizeof(tag));
+		sha256_final(&ctx, tag ? seal_key : key);
+	}
+}
+
+static int cipher_setup(struct stegger **pstegger, struct stegger *stegger, const char *password,
+			const unsigned char *salt)
+{
+	static const unsigned char nonce[CHACHA_NONCE_SIZE];
+	unsigned char key[CHACHA_KEY_SIZE], seal_key[CHACHA_KEY_SIZE];
+	struct cipher *cipher;
+
+	cipher = malloc(sizeof(*cipher));
+	if (!cipher)
+		return -ENOMEM;
+
+	// the keys are new with each salt, the nonces can start from 0
+	cipher_derive(password, salt, key, seal_key);
+	chacha_init(&cipher->chacha, key, nonce);
+	chacha_init(&cipher->seal, seal_key, nonce);
+
+	cipher->stegger.capacity = stegger->capacity - CIPHER_SALT;
+	cipher->stegger.read = cipher_read;
+	cipher->stegger.write = cipher_write;
+	cipher->stegger.sync = cipher_sync;
+	cipher->stegger.advise = cipher_advise;
+	cipher->stegger.close = cipher_close;
+	cipher->stegger.seal = cipher_seal;
+	cipher->stegger.unseal = cipher_unseal;
+
+	cipher->inner = stegger;
+
+	*pstegger = &cipher->stegger;
+
+	return 0;
+}
+
+int cipher_open(struct stegger **pstegger, struct stegger *stegger, const char *password)
+{
+	unsigned char salt[CIPHER_SALT];
+	int ret;
+
+	if (stegger->capacity < CIPHER_SALT)
+		return -ENOSPC;
+
+	ret = stegger_read(stegger, salt, sizeof(salt), 0);
+	if (ret < 0)
+		return ret;
+
+	return cipher_setup(pstegger, stegger, password, salt);
+}
+
+int cipher_create(struct stegger **pstegger, struct stegger *stegger, const char *password)
+{
+	unsigned char salt[CIPHER_SALT];
+	int ret;
+
+	if (stegger->capacity < CIPHER_SALT)
+		return -ENOSPC;
+
+	if (getrandom(salt, sizeof(salt), 0) != sizeof(salt))
+		return -errno;
+
+	ret = stegger_write(stegger, salt, sizeof(salt), 0);
+	if (ret < 0)
+		return ret;
+
+	return cipher_setup(pstegger, stegger, password, salt);
+}
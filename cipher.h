@@ -0,0 +1,15 @@
+#ifndef GHOST_CIPHER_H
+#define GHOST_CIPHER_H
+
+struct stegger;
+
+/*
+ * cipher_open wraps stegger so that everything stored through it is
+ * encrypted with keys derived from password and the salt stored in stegger.
+ * cipher_create stores a new salt first, to format with. Closing the cipher
+ * closes stegger.
+ */
+int cipher_open(struct stegger **pstegger, struct stegger *stegger, const char *password);
+int cipher_create(struct stegger **pstegger, struct stegger *stegger, const char *password);
+
+#endif
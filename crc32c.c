@@ -0,0 +1,132 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+/*
+ * The crc32 instruction takes 3 cycles but can start one every cycle, so
+ * data is checksummed as three interleaved lanes of CRC32C_LANE bytes whose
+ * checksums are then combined. A cluster is just over three lanes.
+ */
+#define CRC32C_LANE 1360
+
+static uint32_t crc32c_table[256];
+
+// x^(8*CRC32C_LANE) and x^(16*CRC32C_LANE) modulo the polynomial
+static uint32_t crc32c_lane1, crc32c_lane2;
+
+static inline uint32_t crc32c_shift(uint32_t p)
+{
+	return p & 1 ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+}
+
+// crc32c_multiply returns a*b modulo the polynomial, bit 31 being x^0
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	for (; m && a; m >>= 1, b = crc32c_shift(b)) {
+		if (a & m) {
+			p ^= b;
+			a ^= m;
+		}
+	}
+
+	return p;
+}
+
+__attribute__((constructor)) static void crc32c_init(void)
+{
+	uint32_t crc, p = (uint32_t)1 << 31;
+	int i, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (bit = 0; bit < 8; bit++)
+			crc = crc32c_shift(crc);
+		crc32c_table[i] = crc;
+	}
+
+	for (i = 0; i < 8 * CRC32C_LANE; i++)
+		p = crc32c_shift(p);
+
+	crc32c_lane1 = p;
+	crc32c_lane2 = crc32c_multiply(p, p);
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t size)
+{
+	while (size--)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t size)
+{
+	uint64_t crc64 = crc, crc1, crc2, w;
+	size_t i;
+
+	for (; size >= 3 * CRC32C_LANE; size -= 3 * CRC32C_LANE, p += 3 * CRC32C_LANE) {
+		crc1 = crc2 = 0;
+
+		for (i = 0; i < CRC32C_LANE; i += sizeof(w)) {
+			memcpy(&w, p + i, sizeof(w));
+			crc64 = __builtin_ia32_crc32di(crc64, w);
+			memcpy(&w, p + CRC32C_LANE + i, sizeof(w));
+			crc1 = __builtin_ia32_crc32di(crc1, w);
+			memcpy(&w, p + 2 * CRC32C_LANE + i, sizeof(w));
+			crc2 = __builtin_ia32_crc32di(crc2, w);
+		}
+
+		crc64 = crc32c_multiply(crc64, crc32c_lane2) ^
+			crc32c_multiply(crc1, crc32c_lane1) ^ crc2;
+	}
+
+	for (; size >= sizeof(w); size -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		crc64 = __builtin_ia32_crc32di(crc64, w);
+	}
+
+	for (crc = crc64; size; size--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+
+	return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t size)
+{
+	uint64_t w;
+
+	for (; size >= sizeof(w); size -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		crc = __crc32cd(crc, w);
+	}
+
+	while (size--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+{
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_hw(crc, buf, size);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	return ~crc32c_hw(crc, buf, size);
+#endif
+
+	return ~crc32c_sw(crc, buf, size);
+}
@@ -0,0 +1,10 @@
+#ifndef GHOST_CRC32C_H
+#define GHOST_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// crc32c continues crc, 0 to start, with size bytes of buf (Castagnoli polynomial)
+uint32_t crc32c(uint32_t crc, const void *buf, size_t size);
+
+#endif
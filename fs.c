@@ -1,32 +1,90 @@
+// for SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
 #include <err.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <zlib.h>
 
+#include "crc32c.h"
 #include "fs.h"
 #include "lsb.h"
 #include "md5.h"
+#include "pool.h"
 #include "stegger.h"
 
 #define CLUSTER_SIZE 4096
 #define CLUSTER_DATA 4092
 #define CLUSTER_DIRENTS 66
-#define FILENAME_SIZE 56
+#define FILENAME_SIZE GHOSTFS_NAME_SIZE
 #define FILESIZE_MAX 0x7FFFFFFF
+#define WRITEBACK_BATCH 16
+#define SYNC_EXTENTS 64
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+#define READAHEAD_QUEUE 256
+#define COPY_BATCH 256
+#define PACK_MAX 16
+#define DEDUP_PROBES 8
+#define CACHE_STRIPES 64
+#define INODE_BUCKETS 4096
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /*
- * MD5(header+cluster0) | header | cluster0 .. clusterN
+ * super | header | cluster0 .. clusterN
+ *
+ * Filesystems formatted before the checksum table have MD5(header+cluster0)
+ * in place of the superblock.
  */
 struct ghostfs_header {
 	uint16_t cluster_count;
 } __attribute__((packed));
 
+/*
+ * crc is the CRC32C of the rest of the superblock, the header and cluster 0.
+ * The checksum table takes the last clusters, from sums on, and holds the
+ * CRC32C of every other cluster as last encoded, see check_cluster.
+ */
+struct ghostfs_super {
+	uint32_t crc;
+	uint32_t magic;
+	uint16_t sums;
+	uint8_t unused[6];
+} __attribute__((packed));
+
+/*
+ * Filesystems on a stegger that seals have the data of every cluster but the
+ * table's sealed, see seal_data, the table keeping the generation it was
+ * sealed with and its tag along with the checksum, and the previous ones.
+ */
+struct sealed_sum {
+	uint32_t sum;
+	uint64_t gen;
+	unsigned char tag[STEGGER_TAG_SIZE];
+	uint64_t prev_gen;
+	unsigned char prev_tag[STEGGER_TAG_SIZE];
+} __attribute__((packed));
+
+#define SUPER_MAGIC 0x53465347
+#define SUMS_PER_CLUSTER (CLUSTER_DATA / sizeof(uint32_t))
+#define SEALED_PER_CLUSTER (CLUSTER_DATA / sizeof(struct sealed_sum))
+// generations reserved by each mount, see seal_reserve
+#define SEAL_RESERVE ((uint64_t)1 << 40)
+// nonces the reserve itself is authenticated with, above any generation
+#define RESERVE_NONCE ((uint64_t)1 << 63)
+
 /*
  * Root directory '/' is stored at cluster 0.
  *
@@ -58,43 +116,336 @@ static inline bool dir_entry_used(const struct dir_entry *e)
 	return e->filename[0] != '\0';
 }
 
+/*
+ * Every directory cluster is followed in its chain by a times cluster, which
+ * holds the modification and change times of its entries at the same index
+ * and is marked TIMES_MARK on the carrier. Directories of older versions get
+ * theirs when one of their entries is first touched. Until then, and while
+ * the times are 0, the mount time stands in.
+ */
+struct entry_times {
+	uint32_t mtime;
+	uint32_t ctime;
+} __attribute__((packed));
+
+#define FILENAME_MAX_LEN (FILENAME_SIZE - 1)
+
+/*
+ * Inodes number entries for the fuse low-level API. An entry is found
+ * through its location, the index of its slot among all directory entries
+ * (see entry_loc), and keeps its inode number when renamed. Inodes are
+ * created by lookups and opens and dropped once forgotten and closed.
+ *
+ * A file removed while open is orphaned: its directory entry moves into
+ * the inode and its clusters are freed on the last release.
+ */
+#define LOC_NONE UINT32_MAX
+
+struct inode {
+	ino_t ino;
+	uint32_t loc;
+	uint64_t nlookup;
+	int open;
+	// serializes writes that go without lock taken for writing, see write_in_place
+	pthread_mutex_t write_lock;
+	bool orphaned;
+	struct dir_entry orphan;
+	// the times of orphan, which has no times cluster
+	struct entry_times orphan_times;
+	struct inode *ino_next;
+	struct inode *loc_next;
+};
+
+// gfs->cluster_flags, see pack_commit
+#define CLUSTER_LINKS 1
+#define CLUSTER_ORPHAN 2
+#define CLUSTER_TIMES 4
+
 struct ghostfs {
 	struct ghostfs_header hdr;
 	struct stegger *stegger;
 	struct cluster **clusters;
+	struct cluster_header *headers;
+	int dirty_headers;
+	time_t dirty_headers_since;
+	struct cached_cluster *dirty_first;
+	struct cached_cluster *dirty_last;
+	int dirty_count;
+	// clusters allocated but not yet on the carrier, see place_fresh
+	int fresh_count;
+	// packed[nr] is how many clusters cluster nr holds packed, 0 if plain
+	uint8_t *packed;
+	// dirty file clusters not tried for packing yet, see pack_dirty
+	int pack_count;
+	uint64_t mark_seq;
+	int compress_level;
+	// cluster_flags[nr] is CLUSTER_LINKS, CLUSTER_ORPHAN or CLUSTER_TIMES, see pack_commit
+	uint8_t *cluster_flags;
+	// refs[nr] counts the links to cluster nr
+	uint32_t *refs;
+	unsigned long linked_count;
+	unsigned long links_count;
+	// hash of file cluster data to cluster number, NULL without dedup
+	struct dedup_slot *dedup;
+	size_t dedup_mask;
+	// first cluster of the checksum table, 0 if the filesystem has none
+	uint16_t sums_start;
+	uint32_t *sums;
+	// checked[nr] is set once cluster nr matched its checksum or was encoded
+	uint8_t *checked;
+	// sums_dirty[k] is set when cluster k of the table must be written
+	uint8_t *sums_dirty;
+	int dirty_sums;
+	// seals[nr] is the generation and tag cluster nr was sealed with, NULL if not sealed
+	struct cluster_seal *seals;
+	uint64_t gen;
+	uint64_t gen_limit;
+	// mounted with GHOSTFS_REPAIR, see check_all
+	bool repair;
 	struct dir_entry root_entry;
 	uid_t uid;
 	gid_t gid;
 	time_t mount_time;
 	uint16_t free_clusters;
+
+	/*
+	 * Locking, always taken in this order:
+	 *
+	 * lock: the namespace, cluster contents, the header table and the
+	 * allocator. Taken for writing by anything that modifies them, for
+	 * reading by lookups, reads and flushes.
+	 *
+	 * inode write_lock: writes into clusters a file already has, with lock
+	 * taken for reading, see write_in_place.
+	 *
+	 * cache_lock: filling slot nr of clusters is done under
+	 * cache_lock[nr % CACHE_STRIPES]. Once filled, a slot only changes with
+	 * lock taken for writing, when place_fresh moves a cluster.
+	 *
+	 * dirty_lock: the dirty list and counters, writeback settings, and
+	 * encoding to the carrier, so flushes never write the same sample
+	 * concurrently.
+	 *
+	 * readahead_lock: the readahead queue and per-handle readahead state.
+	 *
+	 * inode_lock: the inode tables and reference counts. Inode locations
+	 * only change with lock taken for writing.
+	 */
+	pthread_rwlock_t lock;
+	pthread_mutex_t cache_lock[CACHE_STRIPES];
+	pthread_mutex_t dirty_lock;
+	pthread_mutex_t readahead_lock;
+	pthread_mutex_t inode_lock;
+
+	struct inode root_inode;
+	struct inode *inodes_by_ino[INODE_BUCKETS];
+	struct inode *inodes_by_loc[INODE_BUCKETS];
+	ino_t next_ino;
+
+	pthread_t writeback_thread;
+	pthread_cond_t writeback_cond;
+	bool writeback_running;
+	bool writeback_stop;
+	int dirty_expire;
+	int dirty_limit;
+
+	// clusters queued for readahead, decoded by readahead_thread
+	pthread_t readahead_thread;
+	pthread_cond_t readahead_cond;
+	bool readahead_running;
+	bool readahead_stop;
+	uint16_t readahead_queue[READAHEAD_QUEUE];
+	int readahead_head;
+	int readahead_count;
+
+	// decodes and encodes the clusters of large requests in parallel
+	struct pool *pool;
 };
 
+/*
+ * The header of every cluster is kept in gfs->headers, which is the
+ * authoritative copy: chains are walked and free clusters found without
+ * decoding any cluster data. The copy stored with a cluster is refreshed
+ * from the table when the cluster is written.
+ *
+ * In the table, dirty means the header must be written on its own because
+ * the cluster is not cached.
+ */
 struct cluster_header {
 	uint16_t next;
 	uint8_t used;
 	uint8_t dirty;
 } __attribute__((packed));
 
+// the generations and tags of a sealed_sum, as kept in gfs->seals
+struct cluster_seal {
+	uint64_t gen;
+	unsigned char tag[STEGGER_TAG_SIZE];
+	uint64_t prev_gen;
+	unsigned char prev_tag[STEGGER_TAG_SIZE];
+};
+
 struct cluster {
 	unsigned char data[CLUSTER_DATA];
 	struct cluster_header hdr;
 } __attribute__((packed));
 
-static inline void mark_cluster(struct cluster *c)
+/*
+ * In-memory state of a cluster held in gfs->clusters.
+ *
+ * Dirty clusters are kept in a FIFO list so that sync only has to visit the
+ * clusters that changed, oldest first. Clusters holding file data remember
+ * which file dirtied them (see entry_owner), so a file can be flushed alone.
+ * Owner 0 means metadata: directories and freed clusters.
+ *
+ * Fresh clusters were allocated for file data while free on the carrier too,
+ * and have not been written since, see place_fresh.
+ */
+struct cached_cluster {
+	struct cluster c;
+	struct cached_cluster *dirty_prev;
+	struct cached_cluster *dirty_next;
+	time_t dirty_since;
+	uint32_t owner;
+	uint16_t nr;
+	bool fresh;
+	// written since the last pack_dirty
+	bool pack;
+	// file data was written to it, it is not just allocated, see zeros_written
+	bool written;
+	// gfs->mark_seq when last marked, packing checks it was not written since
+	uint64_t seq;
+	// the cluster copy_range filled it from and its seq then, see copy_target
+	uint16_t copied_from;
+	uint64_t copied_seq;
+	// the data of a packed cluster, decompressed on first use
+	unsigned char *unpacked;
+	// hash holds cluster_hash of the data, see dedup_learn
+	bool hashed;
+	uint64_t hash;
+};
+
+static inline struct cached_cluster *cached(struct cluster *c)
+{
+	// struct cluster is packed, go through void * to silence gcc
+	void *p = c;
+
+	return container_of(p, struct cached_cluster, c);
+}
+
+static inline bool is_dirty(const struct cluster *c)
+{
+	return c->hdr.dirty != 0;
+}
+
+// cache_peek returns cluster nr if it is cached, NULL otherwise
+static inline struct cluster *cache_peek(struct ghostfs *gfs, int nr)
+{
+	return __atomic_load_n(&gfs->clusters[nr], __ATOMIC_ACQUIRE);
+}
+
+static void mark_cluster_owner(struct ghostfs *gfs, struct cluster *c, uint32_t owner)
 {
+	struct cached_cluster *cc = cached(c);
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+
+	cc->owner = owner;
+	cc->seq = ++gfs->mark_seq;
+	cc->copied_from = 0;
+	__atomic_store_n(&cc->hashed, false, __ATOMIC_RELAXED);
+
+	if (owner && (gfs->compress_level || gfs->dedup || cc->written) && !cc->pack &&
+	    !gfs->packed[cc->nr]) {
+		cc->pack = true;
+		__atomic_add_fetch(&gfs->pack_count, 1, __ATOMIC_RELAXED);
+	}
+
+	if (is_dirty(c)) {
+		pthread_mutex_unlock(&gfs->dirty_lock);
+		return;
+	}
+
 	c->hdr.dirty = 1;
+	cc->dirty_since = time(NULL);
+
+	// the header goes out along with the cluster
+	if (gfs->headers[cc->nr].dirty) {
+		gfs->headers[cc->nr].dirty = 0;
+		gfs->dirty_headers--;
+	}
+
+	cc->dirty_next = NULL;
+	cc->dirty_prev = gfs->dirty_last;
+	if (gfs->dirty_last)
+		gfs->dirty_last->dirty_next = cc;
+	else
+		gfs->dirty_first = cc;
+	gfs->dirty_last = cc;
+
+	// too much dirty data, wake up writeback
+	if (++gfs->dirty_count == gfs->dirty_limit)
+		pthread_cond_signal(&gfs->writeback_cond);
+
+	pthread_mutex_unlock(&gfs->dirty_lock);
 }
 
-static inline void unmark_cluster(struct cluster *c)
+// unmark_cluster is called with dirty_lock held
+static void unmark_cluster(struct ghostfs *gfs, struct cluster *c)
 {
-        c->hdr.dirty = 0;
+	struct cached_cluster *cc = cached(c);
+
+	if (!is_dirty(c))
+		return;
+
+	c->hdr.dirty = 0;
+	gfs->dirty_count--;
+
+	if (cc->pack) {
+		cc->pack = false;
+		__atomic_sub_fetch(&gfs->pack_count, 1, __ATOMIC_RELAXED);
+	}
+
+	if (cc->dirty_prev)
+		cc->dirty_prev->dirty_next = cc->dirty_next;
+	else
+		gfs->dirty_first = cc->dirty_next;
+	if (cc->dirty_next)
+		cc->dirty_next->dirty_prev = cc->dirty_prev;
+	else
+		gfs->dirty_last = cc->dirty_prev;
 }
 
-static inline bool is_dirty(const struct cluster *c)
+static inline void mark_cluster(struct ghostfs *gfs, struct cluster *c)
 {
-	return c->hdr.dirty != 0;
+	mark_cluster_owner(gfs, c, 0);
+}
+
+// header_changed schedules the header of cluster nr to be written back
+static void header_changed(struct ghostfs *gfs, int nr, uint32_t owner)
+{
+	struct cluster *c = cache_peek(gfs, nr);
+
+	if (c) {
+		mark_cluster_owner(gfs, c, owner);
+		return;
+	}
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+	if (!gfs->headers[nr].dirty) {
+		gfs->headers[nr].dirty = 1;
+		if (gfs->dirty_headers++ == 0 && !gfs->dirty_sums)
+			gfs->dirty_headers_since = time(NULL);
+	}
+	pthread_mutex_unlock(&gfs->dirty_lock);
 }
 
+// a cluster of a chain and its index, walks can start there instead of the head
+struct chain_pos {
+	int index;
+	int nr;
+};
+
 struct dir_iter {
 	struct ghostfs *gfs;
 	struct cluster *cluster;
@@ -104,16 +455,69 @@ struct dir_iter {
 
 struct ghostfs_entry {
 	struct dir_iter it;
+	struct inode *inode;
+	int flags;
+
+	// sequential read detection, see readahead()
+	off_t ra_next;
+	int ra_window;
+	int ra_end;
 };
 
+static uint32_t entry_loc(const struct dir_iter *it)
+{
+	return cached(it->cluster)->nr * CLUSTER_DIRENTS + it->entry_nr;
+}
+
+// entry_owner identifies a file by the location of its directory entry
+static uint32_t entry_owner(const struct dir_iter *it)
+{
+	// orphans are flushed along with metadata
+	if (!it->cluster)
+		return 0;
+
+	return entry_loc(it) + 1;
+}
+
+struct sync_range;
+
 static int cluster_get(struct ghostfs *gfs, int nr, struct cluster **pcluster);
-static int cluster_get_next(struct ghostfs *gfs, struct cluster **pcluster);
-static int cluster_at(struct ghostfs *gfs, int nr, int index, struct cluster **pcluster);
+static int cluster_get_overwrite(struct ghostfs *gfs, int nr, struct cluster **pcluster);
+static int cache_fill(struct ghostfs *gfs, int nr, struct cluster **pcluster, bool decode);
+static int alloc_clusters(struct ghostfs *gfs, int count, struct cluster **pfirst, bool zero,
+			  uint32_t owner, int goal);
 static int write_cluster(struct ghostfs *gfs, struct cluster *cluster, int nr);
+static int encode_all(struct ghostfs *gfs, struct cached_cluster **ccs, int count,
+		      struct sync_range *range);
+static int write_cluster_header(struct ghostfs *gfs, const struct cluster_header *hdr, int nr);
 static int read_cluster(struct ghostfs *gfs, struct cluster *cluster, int nr);
+static int read_cluster_locked(struct ghostfs *gfs, struct cluster *cluster, int nr);
+static int read_packed(struct ghostfs *gfs, struct cluster *cluster, int nr);
+static int check_cluster(struct ghostfs *gfs, int nr, const struct cluster *c, bool packed);
+static void sums_changed(struct ghostfs *gfs, int nr);
+static int link_targets(struct ghostfs *gfs, int nr, uint16_t *targets);
+static int unlink_targets(struct ghostfs *gfs, int nr, const uint16_t *targets);
 static int ghostfs_check(struct ghostfs *gfs);
+static int seal_reserve(struct ghostfs *gfs);
+static int reserve_tag(struct ghostfs *gfs, uint64_t limit, unsigned char *tag);
 static void ghostfs_free(struct ghostfs *gfs);
 
+// times_nr returns the times cluster following directory cluster nr, 0 if it has none
+static int times_nr(struct ghostfs *gfs, int nr)
+{
+	int next = gfs->headers[nr].next;
+
+	return next && (gfs->cluster_flags[next] & CLUSTER_TIMES) ? next : 0;
+}
+
+// dir_next returns the directory cluster after nr, 0 at the end of the chain
+static int dir_next(struct ghostfs *gfs, int nr)
+{
+	int times = times_nr(gfs, nr);
+
+	return gfs->headers[times ? times : nr].next;
+}
+
 static int dir_iter_init(struct ghostfs *gfs, struct dir_iter *it, int cluster_nr)
 {
 	int ret;
@@ -130,13 +534,14 @@ static int dir_iter_init(struct ghostfs *gfs, struct dir_iter *it, int cluster_n
 
 static int dir_iter_next(struct dir_iter *it)
 {
-	int ret;
+	int nr, ret;
 
 	if (it->entry_nr >= CLUSTER_DIRENTS - 1) {
-		if (it->cluster->hdr.next == 0)
+		nr = dir_next(it->gfs, cached(it->cluster)->nr);
+		if (nr == 0)
 			return -ENOENT;
 
-		ret = cluster_get_next(it->gfs, &it->cluster);
+		ret = cluster_get(it->gfs, nr, &it->cluster);
 		if (ret < 0)
 			return ret;
 
@@ -165,6 +570,119 @@ static int dir_iter_next_used(struct dir_iter *it)
 	return 0;
 }
 
+/*
+ * iter_times points ptimes at the times of the entry at it, NULL for the
+ * root directory and entries whose directory cluster has no times cluster.
+ * With alloc set one is added then.
+ */
+static int iter_times(struct ghostfs *gfs, const struct dir_iter *it, bool alloc,
+		      struct entry_times **ptimes)
+{
+	struct cluster *c;
+	int nr, times, ret;
+
+	*ptimes = NULL;
+
+	if (it->entry == &gfs->root_entry)
+		return 0;
+
+	if (!it->cluster) {
+		*ptimes = &container_of(it->entry, struct inode, orphan)->orphan_times;
+		return 0;
+	}
+
+	nr = cached(it->cluster)->nr;
+	times = times_nr(gfs, nr);
+	if (times) {
+		ret = cluster_get(gfs, times, &c);
+		if (ret < 0)
+			return ret;
+	} else if (alloc) {
+		times = alloc_clusters(gfs, 1, &c, true, 0, nr + 1);
+		if (times < 0)
+			return times;
+
+		gfs->cluster_flags[times] = CLUSTER_TIMES;
+		gfs->headers[times].next = gfs->headers[nr].next;
+		gfs->headers[nr].next = times;
+		mark_cluster(gfs, it->cluster);
+	} else {
+		return 0;
+	}
+
+	*ptimes = (struct entry_times *)c->data + it->entry_nr;
+	return 0;
+}
+
+// entry_times gets the times of the entry at it, the mount time if it has none
+static void entry_times(struct ghostfs *gfs, const struct dir_iter *it, uint32_t *mtime,
+			uint32_t *ctime)
+{
+	struct entry_times *t;
+
+	if (iter_times(gfs, it, false, &t) < 0 || !t || !t->mtime) {
+		*mtime = *ctime = gfs->mount_time;
+		return;
+	}
+
+	*mtime = t->mtime;
+	*ctime = t->ctime;
+}
+
+// entry_set_times stores the times of the entry at it, but for the root directory
+static int entry_set_times(struct ghostfs *gfs, const struct dir_iter *it, uint32_t mtime,
+			   uint32_t ctime)
+{
+	struct entry_times *t;
+	int ret;
+
+	ret = iter_times(gfs, it, true, &t);
+	if (ret < 0 || !t)
+		return ret;
+
+	t->mtime = mtime;
+	t->ctime = ctime;
+	if (it->cluster)
+		mark_cluster(gfs, cache_peek(gfs, times_nr(gfs, cached(it->cluster)->nr)));
+
+	return 0;
+}
+
+// entry_touched tells if entry_touch at now would change the entry at it
+static bool entry_touched(struct ghostfs *gfs, const struct dir_iter *it, bool modified,
+			  uint32_t now)
+{
+	struct entry_times *t;
+
+	// the root directory has no entry on disk
+	if (it->entry == &gfs->root_entry)
+		return false;
+
+	// a missing times cluster is added
+	if (iter_times(gfs, it, false, &t) < 0 || !t)
+		return true;
+
+	return t->ctime != now || (modified && t->mtime != now);
+}
+
+/*
+ * entry_touch sets the change time of the entry at it to now, and the
+ * modification time too if its contents changed. The root directory has no
+ * entry on disk and keeps the mount time. So do entries whose directory
+ * cluster has no times cluster yet when there is no room left for one.
+ */
+static void entry_touch(struct ghostfs *gfs, struct dir_iter *it, bool modified)
+{
+	uint32_t now = time(NULL);
+	uint32_t mtime, ctime;
+
+	if (!entry_touched(gfs, it, modified, now))
+		return;
+
+	entry_times(gfs, it, &mtime, &ctime);
+	entry_set_times(gfs, it, modified ? now : mtime, now);
+}
+
 static bool component_eq(const char *comp, const char *name, size_t n)
 {
 	while (n > 0 && *comp && *comp != '/' && *comp == *name) {
@@ -253,18 +771,25 @@ static int find_empty_entry(struct ghostfs *gfs, struct dir_iter *iter, int clus
 	return ret;
 }
 
-static int dir_contains(struct ghostfs *gfs, int cluster_nr, const char *name)
+// dir_find looks up name in the directory at cluster_nr
+static int dir_find(struct ghostfs *gfs, int cluster_nr, const char *name, struct dir_iter *found)
 {
 	struct dir_iter it;
 	int ret;
 
+	if (!name[0])
+		return -EINVAL;
+
 	ret = dir_iter_init(gfs, &it, cluster_nr);
 	if (ret < 0)
 		return ret;
 
 	for (;;) {
-		if (!strncmp(it.entry->filename, name, FILENAME_SIZE))
+		if (!strncmp(it.entry->filename, name, FILENAME_SIZE)) {
+			if (found)
+				*found = it;
 			return 0;
+		}
 
 		ret = dir_iter_next_used(&it);
 		if (ret < 0)
@@ -274,906 +799,5584 @@ static int dir_contains(struct ghostfs *gfs, int cluster_nr, const char *name)
 	return ret;
 }
 
-static int alloc_clusters(struct ghostfs *gfs, int count, struct cluster **pfirst, bool zero)
+static struct inode *inode_find(struct ghostfs *gfs, ino_t ino)
 {
-	struct cluster *prev = NULL;
-	struct cluster *c;
-	int first = 0;
-	int pos = 1;
-	int alloc = 0;
-	int ret;
+	struct inode *inode;
 
-	while (alloc < count) {
-		for (;;) {
-			if (pos >= gfs->hdr.cluster_count) {
-				ret = -ENOSPC;
-				goto undo;
-			}
+	if (ino == GHOSTFS_ROOT_INO)
+		return &gfs->root_inode;
 
-			ret = cluster_get(gfs, pos, &c);
-			if (ret < 0)
-				goto undo;
+	for (inode = gfs->inodes_by_ino[ino % INODE_BUCKETS]; inode; inode = inode->ino_next) {
+		if (inode->ino == ino)
+			return inode;
+	}
 
-			if (!c->hdr.used) {
-				if (zero)
-					memset(c->data, 0, sizeof(c->data));
+	return NULL;
+}
 
-				c->hdr.used = 1;
-				mark_cluster(c);
-				gfs->free_clusters--;
+static struct inode *inode_at(struct ghostfs *gfs, uint32_t loc)
+{
+	struct inode *inode;
 
-				if (!first) {
-					first = pos;
-					if (pfirst)
-						*pfirst = c;
-				} else {
-					prev->hdr.next = pos;
-				}
-				prev = c;
-				pos++;
-				break;
-			}
-			pos++;
-		}
-		alloc++;
+	for (inode = gfs->inodes_by_loc[loc % INODE_BUCKETS]; inode; inode = inode->loc_next) {
+		if (inode->loc == loc)
+			return inode;
 	}
 
-	prev->hdr.next = 0;
+	return NULL;
+}
 
-	return first;
-undo:
-	pos = first;
+static void inode_set_loc(struct ghostfs *gfs, struct inode *inode, uint32_t loc)
+{
+	struct inode **p;
 
-	while (alloc > 0) {
-		int r = cluster_get(gfs, pos, &c);
-		if (r < 0)
-			return r;
+	if (inode->loc != LOC_NONE) {
+		p = &gfs->inodes_by_loc[inode->loc % INODE_BUCKETS];
+		while (*p != inode)
+			p = &(*p)->loc_next;
+		*p = inode->loc_next;
+	}
 
-		c->hdr.used = 0;
-		mark_cluster(c);
-		gfs->free_clusters++;
+	inode->loc = loc;
 
-		pos = c->hdr.next;
-		alloc--;
+	if (loc != LOC_NONE) {
+		p = &gfs->inodes_by_loc[loc % INODE_BUCKETS];
+		inode->loc_next = *p;
+		*p = inode;
 	}
-
-	return ret;
 }
 
-static int free_clusters(struct ghostfs *gfs, struct cluster *c)
+static struct inode *inode_get(struct ghostfs *gfs, uint32_t loc)
 {
-	int ret;
+	struct inode *inode;
 
-	for (;;) {
-		c->hdr.used = 0;
-		mark_cluster(c);
-		gfs->free_clusters++;
+	inode = inode_at(gfs, loc);
+	if (inode)
+		return inode;
 
-		if (!c->hdr.next)
-			break;
+	inode = calloc(1, sizeof(*inode));
+	if (!inode)
+		return NULL;
+	pthread_mutex_init(&inode->write_lock, NULL);
 
-		ret = cluster_get(gfs, c->hdr.next, &c);
-		if (ret < 0) {
-			errno = -ret;
-			warn("failed to free cluster");
-			return ret;
-		}
-	}
+	// the number follows the location, unless a renamed entry still has it
+	inode->ino = loc + 2;
+	if (inode_find(gfs, inode->ino))
+		inode->ino = gfs->next_ino++;
 
-	return 0;
+	inode->ino_next = gfs->inodes_by_ino[inode->ino % INODE_BUCKETS];
+	gfs->inodes_by_ino[inode->ino % INODE_BUCKETS] = inode;
+
+	inode->loc = LOC_NONE;
+	inode_set_loc(gfs, inode, loc);
+
+	return inode;
 }
 
-static int create_entry(struct ghostfs *gfs,
-			const char *path,
-			bool is_dir,
-			struct dir_entry **entry)
+/*
+ * loc_ino returns the inode number of the entry at loc. The number an entry
+ * without inode would get may still be held by one renamed away, the entry
+ * then gets an inode of its own so that lookups return the same number.
+ */
+static ino_t loc_ino(struct ghostfs *gfs, uint32_t loc)
 {
-	struct dir_iter it;
-	struct cluster *prev = NULL, *next = NULL;
-	const char *name;
-	int cluster_nr = 0;
-	int ret;
+	struct inode *inode = inode_at(gfs, loc);
 
-	ret = dir_iter_lookup(gfs, &it, path, true);
-	if (ret < 0)
-		return ret;
-
-	if (!dir_entry_is_directory(it.entry))
-		return -ENOTDIR;
+	if (!inode && inode_find(gfs, loc + 2))
+		inode = inode_get(gfs, loc);
 
-	name = last_component(path);
-	if (strlen(name) > FILENAME_SIZE - 1)
-		return -ENAMETOOLONG;
+	return inode ? inode->ino : loc + 2;
+}
 
-	if (!name[0])
-		return -EINVAL;
+// inode_put frees inode once the kernel forgot it and no handle is left
+static void inode_put(struct ghostfs *gfs, struct inode *inode)
+{
+	struct inode **p;
 
-	if (dir_contains(gfs, it.entry->cluster, name) == 0)
-		return -EEXIST;
+	if (inode == &gfs->root_inode || inode->nlookup || inode->open)
+		return;
 
-	ret = find_empty_entry(gfs, &it, it.entry->cluster);
-	if (ret < 0) {
-		int nr;
+	inode_set_loc(gfs, inode, LOC_NONE);
 
-		if (ret != -ENOENT)
-			return ret;
+	p = &gfs->inodes_by_ino[inode->ino % INODE_BUCKETS];
+	while (*p != inode)
+		p = &(*p)->ino_next;
+	*p = inode->ino_next;
 
-		nr = alloc_clusters(gfs, 1, &next, true);
-		if (nr < 0)
-			return nr;
+	pthread_mutex_destroy(&inode->write_lock);
+	free(inode);
+}
 
-		prev = it.cluster;
-		find_empty_entry(gfs, &it, nr);
+// inode_iter points it at the entry of inode
+static int inode_iter(struct ghostfs *gfs, struct inode *inode, struct dir_iter *it)
+{
+	int ret;
 
-		prev->hdr.next = nr;
-		mark_cluster(prev);
+	if (inode->orphaned) {
+		it->gfs = gfs;
+		it->cluster = NULL;
+		it->entry = &inode->orphan;
+		it->entry_nr = 0;
+		return 0;
 	}
 
-	if (is_dir) {
-		cluster_nr = alloc_clusters(gfs, 1, NULL, true);
-		if (cluster_nr < 0) {
-			if (next) {
-				free_clusters(gfs, next);
-				prev->hdr.next = 0;
-			}
-			return cluster_nr;
-		}
+	if (inode == &gfs->root_inode) {
+		ret = dir_iter_init(gfs, it, 0);
+		it->entry = &gfs->root_entry;
+		return ret;
 	}
 
-	strcpy(it.entry->filename, name);
-	dir_entry_set_size(it.entry, 0, is_dir);
-	it.entry->cluster = cluster_nr;
-	mark_cluster(it.cluster);
+	if (inode->loc == LOC_NONE)
+		return -ENOENT;
+
+	ret = dir_iter_init(gfs, it, inode->loc / CLUSTER_DIRENTS);
+	if (ret < 0)
+		return ret;
 
-	if (entry)
-		*entry = it.entry;
+	it->entry_nr = inode->loc % CLUSTER_DIRENTS;
+	it->entry += it->entry_nr;
 
 	return 0;
 }
 
-int ghostfs_create(struct ghostfs *gfs, const char *path)
+static int ino_iter(struct ghostfs *gfs, ino_t ino, struct dir_iter *it)
 {
-	return create_entry(gfs, path, false, NULL);
+	struct inode *inode;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&gfs->inode_lock);
+	inode = inode_find(gfs, ino);
+	if (inode)
+		ret = inode_iter(gfs, inode, it);
+	pthread_mutex_unlock(&gfs->inode_lock);
+
+	return ret;
 }
 
-int ghostfs_mkdir(struct ghostfs *gfs, const char *path)
+// inode_detach unlinks the inode of a removed entry, true if it keeps the clusters
+static bool inode_detach(struct ghostfs *gfs, const struct dir_iter *it)
 {
-	return create_entry(gfs, path, true, NULL);
+	struct entry_times times = { 0, 0 }, *t;
+	struct inode *inode;
+	bool keep = false;
+
+	if (iter_times(gfs, it, false, &t) == 0 && t)
+		times = *t;
+
+	pthread_mutex_lock(&gfs->inode_lock);
+	inode = inode_at(gfs, entry_loc(it));
+	if (inode) {
+		inode_set_loc(gfs, inode, LOC_NONE);
+		if (inode->open) {
+			inode->orphan = *it->entry;
+			inode->orphan_times = times;
+			inode->orphaned = true;
+			keep = true;
+		}
+		// one only loc_ino made goes away with its entry
+		inode_put(gfs, inode);
+	}
+	pthread_mutex_unlock(&gfs->inode_lock);
+
+	return keep;
 }
 
-static int remove_entry(struct ghostfs *gfs, const char *path, bool is_dir)
+static void inode_move(struct ghostfs *gfs, const struct dir_iter *it, const struct dir_iter *newit)
 {
-	struct dir_iter link, it;
-	int ret;
+	struct inode *inode;
 
-	ret = dir_iter_lookup(gfs, &link, path, false);
-	if (ret < 0)
-		return ret;
+	pthread_mutex_lock(&gfs->inode_lock);
+	inode = inode_at(gfs, entry_loc(it));
+	if (inode)
+		inode_set_loc(gfs, inode, entry_loc(newit));
+	pthread_mutex_unlock(&gfs->inode_lock);
+}
 
-	if (link.entry == &gfs->root_entry)
-		return -EINVAL;
+static int free_clusters(struct ghostfs *gfs, int nr)
+{
+	uint16_t targets[PACK_MAX];
+	struct cluster *c;
+	int next, ret;
 
-	if (is_dir != dir_entry_is_directory(link.entry))
-		return is_dir ? -ENOTDIR : -EISDIR;
+	while (nr) {
+		if (nr >= gfs->hdr.cluster_count) {
+			warnx("fs: invalid cluster number %d", nr);
+			return -EIO;
+		}
 
-	// no clusters, we are done
-	if (!link.entry->cluster)
-		goto unlink;
+		next = gfs->headers[nr].next;
 
-	ret = dir_iter_init(gfs, &it, link.entry->cluster);
-	if (ret < 0)
-		return ret;
+		if (gfs->cluster_flags[nr] & CLUSTER_LINKS) {
+			ret = link_targets(gfs, nr, targets);
+			if (ret == 0)
+				ret = unlink_targets(gfs, nr, targets);
+			if (ret < 0)
+				return ret;
+		}
 
-	// make sure directory is empty
-	if (is_dir) {
-		if (dir_entry_used(it.entry))
-			return -ENOTEMPTY;
+		// still linked to, it only leaves the chain
+		if (gfs->refs[nr]) {
+			gfs->headers[nr].next = 0;
+			gfs->headers[nr].used = 1;
+			gfs->cluster_flags[nr] = CLUSTER_ORPHAN;
+			header_changed(gfs, nr, 0);
+			nr = next;
+			continue;
+		}
+
+		gfs->headers[nr].used = 0;
+		gfs->cluster_flags[nr] = 0;
+		gfs->free_clusters++;
+
+		// readahead may be decoding it meanwhile, see cache_fill
+		__atomic_store_n(&gfs->packed[nr], 0, __ATOMIC_RELAXED);
+
+		c = cache_peek(gfs, nr);
+		if (c && cached(c)->unpacked) {
+			free(cached(c)->unpacked);
+			cached(c)->unpacked = NULL;
+		}
+
+		// still free on the carrier, nothing to write
+		if (c && cached(c)->fresh) {
+			pthread_mutex_lock(&gfs->dirty_lock);
+			unmark_cluster(gfs, c);
+			cached(c)->fresh = false;
+			__atomic_sub_fetch(&gfs->fresh_count, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&gfs->dirty_lock);
+		} else {
+			header_changed(gfs, nr, 0);
+		}
+
+		nr = next;
+	}
+
+	return 0;
+}
+
+/*
+ * alloc_clusters links count free clusters into a new chain. The search
+ * starts at goal and wraps around, so callers can keep a file's clusters
+ * next to each other.
+ */
+static int alloc_clusters(struct ghostfs *gfs, int count, struct cluster **pfirst, bool zero,
+			  uint32_t owner, int goal)
+{
+	struct cluster *c;
+	int first = 0;
+	int prev = 0;
+	int pos = goal;
+	int alloc = 0;
+	int scanned = 0;
+	bool fresh;
+	int ret;
+
+	if (count > gfs->free_clusters)
+		return -ENOSPC;
+
+	while (alloc < count) {
+		for (; scanned < gfs->hdr.cluster_count; scanned++, pos++) {
+			if (pos < 1 || pos >= gfs->hdr.cluster_count)
+				pos = 1;
+			if (!gfs->headers[pos].used)
+				break;
+		}
+
+		if (scanned >= gfs->hdr.cluster_count) {
+			ret = -ENOSPC;
+			goto undo;
+		}
+
+		// whatever a free cluster held is of no use, new cache slots come zeroed
+		c = cache_peek(gfs, pos);
+		fresh = owner && (c ? !is_dirty(c) : !gfs->headers[pos].dirty);
+		if (!c) {
+			ret = cache_fill(gfs, pos, &c, false);
+			if (ret < 0)
+				goto undo;
+		} else if (zero) {
+			memset(c->data, 0, sizeof(c->data));
+		}
+
+		gfs->headers[pos].used = 1;
+		gfs->headers[pos].next = 0;
+		cached(c)->written = false;
+		mark_cluster_owner(gfs, c, owner);
+		gfs->free_clusters--;
+
+		if (fresh) {
+			pthread_mutex_lock(&gfs->dirty_lock);
+			cached(c)->fresh = true;
+			__atomic_add_fetch(&gfs->fresh_count, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&gfs->dirty_lock);
+		}
+
+		if (!first) {
+			first = pos;
+			if (pfirst)
+				*pfirst = c;
+		} else {
+			gfs->headers[prev].next = pos;
+		}
+		prev = pos;
+		pos++;
+		scanned++;
+		alloc++;
+	}
+
+	return first;
+undo:
+	free_clusters(gfs, first);
+
+	return ret;
+}
+
+/*
+ * free_run returns the first cluster of a run of count free clusters, or
+ * of the longest run if there is none that long. Its length goes to len.
+ */
+static int free_run(struct ghostfs *gfs, int count, int *len)
+{
+	int best = 1, best_len = 0;
+	int start, nr;
+
+	for (nr = 1; nr < gfs->hdr.cluster_count; nr++) {
+		if (gfs->headers[nr].used)
+			continue;
+
+		for (start = nr; nr < gfs->hdr.cluster_count && !gfs->headers[nr].used; nr++)
+			;
+
+		if (nr - start >= count) {
+			*len = nr - start;
+			return start;
+		}
+
+		if (nr - start > best_len) {
+			best = start;
+			best_len = nr - start;
+		}
+	}
+
+	*len = best_len;
+	return best;
+}
+
+/*
+ * Files may have holes, ranges without clusters that read as zeros. The
+ * used byte of a cluster header is 1 + the number of hole clusters between
+ * it and the next cluster of the chain, up to HOLE_MAX. Anything past the
+ * last cluster of a file is a hole as well, so growing a file allocates
+ * nothing. A chain that is not empty always starts at index 0, leading
+ * holes and longer ones get zeroed clusters in between.
+ *
+ * A chain may also go on past the end of the file, with zeroed clusters
+ * preallocated by fallocate. Truncating below them frees them.
+ */
+#define HOLE_MAX 254
+
+static inline int chain_holes(struct ghostfs *gfs, int nr)
+{
+	return gfs->headers[nr].used - 1;
+}
+
+static inline void chain_set_holes(struct ghostfs *gfs, int nr, int holes)
+{
+	gfs->headers[nr].used = 1 + holes;
+}
+
+/*
+ * A packed cluster holds the data of up to PACK_MAX clusters in a row,
+ * compressed with zlib, and is followed by holes for the others. Only its
+ * first bytes are encoded, so packing saves carrier space and encoding work
+ * alike. On the carrier the dirty byte of its header is PACKED_MARK | the
+ * number of clusters, older versions only ever wrote 0 or 1 there.
+ *
+ * Packed clusters are only read, writes unpack them first, see chain_unpack.
+ * Clusters are packed when written back, see pack_dirty.
+ */
+#define PACKED_MARK 0x80
+
+struct packed_data {
+	uint16_t size;
+	unsigned char data[CLUSTER_DATA - sizeof(uint16_t)];
+} __attribute__((packed));
+
+/*
+ * With dedup on, file clusters whose data some other cluster already has on
+ * the carrier are packed into links instead: the packed data is the numbers
+ * of those clusters, and the dirty byte LINKS_MARK | their count.
+ *
+ * A cluster has a single next, so chains cannot share clusters. The ones
+ * linked to stay in their own chain and refs counts the links to them.
+ * Writes to one copy it first, see chain_unshare. One its file lets go of
+ * is kept as an orphan, marked ORPHAN_MARK, until the last link is gone.
+ */
+#define LINKS_MARK (PACKED_MARK | 0x40)
+#define ORPHAN_MARK 0x40
+#define MARK_COUNT 0x3f
+
+// times clusters, see struct entry_times
+#define TIMES_MARK 0x20
+
+// cluster_mark returns the dirty byte cluster nr gets on the carrier
+static uint8_t cluster_mark(struct ghostfs *gfs, int nr)
+{
+	if (gfs->packed[nr])
+		return (gfs->cluster_flags[nr] & CLUSTER_LINKS ? LINKS_MARK : PACKED_MARK) |
+		       gfs->packed[nr];
+
+	if (gfs->cluster_flags[nr] & CLUSTER_TIMES)
+		return TIMES_MARK;
+
+	return gfs->cluster_flags[nr] & CLUSTER_ORPHAN ? ORPHAN_MARK : 0;
+}
+
+// chain_span returns how many indexes cluster nr covers
+static inline int chain_span(struct ghostfs *gfs, int nr)
+{
+	return gfs->packed[nr] ? gfs->packed[nr] : 1;
+}
+
+// chain_covers tells if the data at index is in the cluster at pos, see chain_seek
+static inline bool chain_covers(struct ghostfs *gfs, const struct chain_pos *pos, int index)
+{
+	return pos->nr && index < pos->index + chain_span(gfs, pos->nr);
+}
+
+/*
+ * chain_seek moves pos forward to the last cluster at or before index.
+ * pos->nr 0 stands for the start of the chain at first, index -1.
+ */
+static int chain_seek(struct ghostfs *gfs, int first, struct chain_pos *pos, int index)
+{
+	int next, next_index;
+
+	for (;;) {
+		if (pos->nr) {
+			next = gfs->headers[pos->nr].next;
+			next_index = pos->index + 1 + chain_holes(gfs, pos->nr);
+		} else {
+			next = first;
+			next_index = 0;
+		}
+
+		if (!next || next_index > index)
+			return 0;
+
+		if (next >= gfs->hdr.cluster_count || !gfs->headers[next].used) {
+			warnx("fs: invalid cluster number %d", next);
+			return -EIO;
+		}
+
+		pos->index = next_index;
+		pos->nr = next;
+	}
+}
+
+/*
+ * chain_fill allocates the cluster at index, which must be a hole after
+ * pos, and moves pos there. It returns the new cluster number.
+ */
+static int chain_fill(struct ghostfs *gfs, struct dir_iter *it, struct chain_pos *pos,
+		      int index, uint32_t owner, int goal)
+{
+	int next, next_index, nr;
+
+	// holes are at most HOLE_MAX long and chains start at index 0
+	while (index - pos->index - 1 > HOLE_MAX || (!pos->nr && index)) {
+		nr = chain_fill(gfs, it, pos, pos->nr ? pos->index + 1 + HOLE_MAX : 0, owner, goal);
+		if (nr < 0)
+			return nr;
+		goal = nr + 1;
+	}
+
+	nr = alloc_clusters(gfs, 1, NULL, true, owner, goal);
+	if (nr < 0)
+		return nr;
+
+	if (pos->nr) {
+		next = gfs->headers[pos->nr].next;
+		next_index = pos->index + 1 + chain_holes(gfs, pos->nr);
+
+		gfs->headers[pos->nr].next = nr;
+		chain_set_holes(gfs, pos->nr, index - pos->index - 1);
+		header_changed(gfs, pos->nr, owner);
+	} else {
+		next = it->entry->cluster;
+		next_index = 0;
+
+		it->entry->cluster = nr;
+		if (it->cluster)
+			mark_cluster(gfs, it->cluster);
+	}
+
+	gfs->headers[nr].next = next;
+	chain_set_holes(gfs, nr, next ? next_index - index - 1 : 0);
+
+	pos->index = index;
+	pos->nr = nr;
+
+	return nr;
+}
+
+// cluster_unpacked points data at the clusters packed into c
+static int cluster_unpacked(struct ghostfs *gfs, struct cluster *c, unsigned char **pdata)
+{
+	struct cached_cluster *cc = cached(c);
+	pthread_mutex_t *lock = &gfs->cache_lock[cc->nr % CACHE_STRIPES];
+	const struct packed_data *p = (const void *)c->data;
+	uLongf len = gfs->packed[cc->nr] * CLUSTER_DATA;
+	unsigned char *data;
+	int ret = 0;
+
+	*pdata = __atomic_load_n(&cc->unpacked, __ATOMIC_ACQUIRE);
+	if (*pdata)
+		return 0;
+
+	// readers may get here at the same time, only one decompresses
+	pthread_mutex_lock(lock);
+
+	if (!cc->unpacked) {
+		data = malloc(len);
+		if (!data) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		if (p->size > sizeof(p->data) ||
+		    uncompress(data, &len, p->data, p->size) != Z_OK ||
+		    len != (uLongf)gfs->packed[cc->nr] * CLUSTER_DATA) {
+			warnx("fs: corrupt packed cluster %d", cc->nr);
+			free(data);
+			ret = -EIO;
+			goto out;
+		}
+
+		__atomic_store_n(&cc->unpacked, data, __ATOMIC_RELEASE);
+	}
+
+	*pdata = cc->unpacked;
+out:
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+// link_targets copies the cluster numbers links cluster nr holds to targets
+static int link_targets(struct ghostfs *gfs, int nr, uint16_t *targets)
+{
+	const struct packed_data *p;
+	struct cluster *c;
+	int ret;
+
+	ret = cluster_get(gfs, nr, &c);
+	if (ret < 0)
+		return ret;
+
+	p = (const void *)c->data;
+	if (p->size != gfs->packed[nr] * sizeof(*targets)) {
+		warnx("fs: corrupt linked cluster %d", nr);
+		return -EIO;
+	}
+
+	memcpy(targets, p->data, p->size);
+
+	return 0;
+}
+
+/*
+ * unlink_targets drops the links of cluster nr to targets, orphans nothing
+ * links to any more are freed
+ */
+static int unlink_targets(struct ghostfs *gfs, int nr, const uint16_t *targets)
+{
+	int count = gfs->packed[nr];
+	int i, ret;
+
+	gfs->cluster_flags[nr] = 0;
+	gfs->links_count--;
+	gfs->linked_count -= count;
+
+	for (i = 0; i < count; i++) {
+		if (--gfs->refs[targets[i]] || !(gfs->cluster_flags[targets[i]] & CLUSTER_ORPHAN))
+			continue;
+
+		gfs->cluster_flags[targets[i]] = 0;
+		ret = free_clusters(gfs, targets[i]);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+// packed_index points data at index sub of the clusters packed or linked into c
+static int packed_index(struct ghostfs *gfs, struct cluster *c, int sub, unsigned char **pdata)
+{
+	const struct packed_data *p = (const void *)c->data;
+	struct cluster *t;
+	uint16_t target;
+	int ret;
+
+	if (gfs->cluster_flags[cached(c)->nr] & CLUSTER_LINKS) {
+		memcpy(&target, p->data + sub * sizeof(target), sizeof(target));
+		ret = cluster_get(gfs, target, &t);
+		if (ret == 0)
+			*pdata = t->data;
+		return ret;
+	}
+
+	ret = cluster_unpacked(gfs, c, pdata);
+	if (ret == 0)
+		*pdata += sub * CLUSTER_DATA;
+
+	return ret;
+}
+
+/*
+ * chain_unpack turns the packed cluster at pos back into plain clusters, the
+ * first keep of the ones packed into it, so they can be written. The others
+ * become holes.
+ */
+static int chain_unpack(struct ghostfs *gfs, struct chain_pos *pos, int keep, uint32_t owner)
+{
+	uint16_t targets[PACK_MAX];
+	struct cluster *c, *n;
+	unsigned char *data;
+	int nr = pos->nr;
+	int next = gfs->headers[nr].next;
+	int holes = chain_holes(gfs, nr);
+	bool links = gfs->cluster_flags[nr] & CLUSTER_LINKS;
+	int first = 0, last, i;
+	int ret;
+
+	ret = cluster_get(gfs, nr, &c);
+	if (ret < 0)
+		return ret;
+
+	if (links) {
+		ret = link_targets(gfs, nr, targets);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (keep > 1) {
+		first = alloc_clusters(gfs, keep - 1, NULL, false, owner, nr + 1);
+		if (first < 0)
+			return first;
+	}
+
+	// the first cluster holds what the others are made of, it goes last
+	for (i = 1, last = first; i < keep; i++) {
+		ret = cluster_get_overwrite(gfs, last, &n);
+		if (ret == 0)
+			ret = packed_index(gfs, c, i, &data);
+		if (ret < 0)
+			return ret;
+
+		memcpy(n->data, data, CLUSTER_DATA);
+		if (i < keep - 1)
+			last = gfs->headers[last].next;
+	}
+
+	ret = packed_index(gfs, c, 0, &data);
+	if (ret < 0)
+		return ret;
+
+	memcpy(c->data, data, CLUSTER_DATA);
+
+	if (links) {
+		ret = unlink_targets(gfs, nr, targets);
+		if (ret < 0)
+			return ret;
+	}
+
+	gfs->packed[nr] = 0;
+	free(cached(c)->unpacked);
+	cached(c)->unpacked = NULL;
+
+	if (first) {
+		gfs->headers[nr].next = first;
+		chain_set_holes(gfs, nr, 0);
+	} else {
+		last = nr;
+	}
+
+	gfs->headers[last].next = next;
+	chain_set_holes(gfs, last, next ? holes - (keep - 1) : 0);
+
+	mark_cluster_owner(gfs, c, owner);
+	if (last != nr)
+		header_changed(gfs, last, owner);
+
+	return 0;
+}
+
+/*
+ * chain_unshare gives the file at it a copy of the cluster at pos, which is
+ * linked to, so it can be written. The cluster itself is orphaned and pos
+ * moves to the copy.
+ */
+static int chain_unshare(struct ghostfs *gfs, struct dir_iter *it, struct chain_pos *pos,
+			 uint32_t owner)
+{
+	struct cluster *c, *n;
+	int nr = pos->nr;
+	int copy, prev;
+	int ret;
+
+	ret = cluster_get(gfs, nr, &c);
+	if (ret < 0)
+		return ret;
+
+	copy = alloc_clusters(gfs, 1, &n, false, owner, nr + 1);
+	if (copy < 0)
+		return copy;
+
+	memcpy(n->data, c->data, CLUSTER_DATA);
+	gfs->headers[copy].next = gfs->headers[nr].next;
+	gfs->headers[copy].used = gfs->headers[nr].used;
+
+	if (it->entry->cluster == nr) {
+		it->entry->cluster = copy;
+		if (it->cluster)
+			mark_cluster(gfs, it->cluster);
+	} else {
+		// chains are only walked forward, find the cluster before
+		for (prev = it->entry->cluster; prev && gfs->headers[prev].next != nr;)
+			prev = gfs->headers[prev].next;
+		if (!prev) {
+			warnx("fs: cluster %d missing from its chain", nr);
+			return -EIO;
+		}
+
+		gfs->headers[prev].next = copy;
+		header_changed(gfs, prev, owner);
+	}
+
+	gfs->headers[nr].next = 0;
+	chain_set_holes(gfs, nr, 0);
+	gfs->cluster_flags[nr] = CLUSTER_ORPHAN;
+	header_changed(gfs, nr, 0);
+
+	pos->nr = copy;
+
+	return 0;
+}
+
+/*
+ * Dedup finds clusters with the same data through a hash table of the file
+ * clusters seen clean, when read or written back. Entries are not removed,
+ * they are checked against the cluster on lookup and replaced when stale.
+ */
+struct dedup_slot {
+	uint64_t hash;
+	uint16_t nr;
+};
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// cluster_hash hashes cluster data, the way xxHash64 does
+static uint64_t cluster_hash(const unsigned char *data)
+{
+	uint64_t lanes[4] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1 };
+	uint64_t hash, w;
+	size_t i;
+	int j;
+
+	for (i = 0; i + sizeof(lanes) <= CLUSTER_DATA; i += sizeof(lanes)) {
+		for (j = 0; j < 4; j++) {
+			memcpy(&w, data + i + j * sizeof(w), sizeof(w));
+			lanes[j] = rotl64(lanes[j] + w * HASH_PRIME2, 31) * HASH_PRIME1;
+		}
+	}
+
+	hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) +
+	       rotl64(lanes[3], 18);
+
+	for (; i + sizeof(w) <= CLUSTER_DATA; i += sizeof(w)) {
+		memcpy(&w, data + i, sizeof(w));
+		hash = rotl64(hash ^ (rotl64(w * HASH_PRIME2, 31) * HASH_PRIME1), 27) * HASH_PRIME1;
+	}
+
+	for (; i < CLUSTER_DATA; i++)
+		hash = rotl64(hash ^ (data[i] * HASH_PRIME1), 11) * HASH_PRIME2;
+
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME2;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+// cluster_hashed returns the hash of the data of cc, computed once until it changes
+static uint64_t cluster_hashed(struct cached_cluster *cc)
+{
+	if (!cc->hashed) {
+		cc->hash = cluster_hash(cc->c.data);
+		__atomic_store_n(&cc->hashed, true, __ATOMIC_RELAXED);
+	}
+
+	return cc->hash;
+}
+
+// dedup_match tells if clean plain cluster nr has the given hash and data, if given
+static bool dedup_match(struct ghostfs *gfs, int nr, uint64_t hash, const unsigned char *data)
+{
+	struct cluster *c = cache_peek(gfs, nr);
+
+	if (!c || is_dirty(c) || !cached(c)->hashed || cached(c)->hash != hash ||
+	    !gfs->headers[nr].used || gfs->packed[nr])
+		return false;
+
+	return !data || memcmp(c->data, data, CLUSTER_DATA) == 0;
+}
+
+// dedup_find returns a clean file cluster holding data, 0 if none is known
+static int dedup_find(struct ghostfs *gfs, const unsigned char *data, uint64_t hash)
+{
+	struct dedup_slot *slot;
+	int i;
+
+	for (i = 0; i < DEDUP_PROBES; i++) {
+		slot = &gfs->dedup[(hash + i) & gfs->dedup_mask];
+		if (!slot->nr)
+			break;
+		if (slot->hash == hash && dedup_match(gfs, slot->nr, hash, data))
+			return slot->nr;
+	}
+
+	return 0;
+}
+
+// dedup_learn adds clean file cluster cc to the table, with dirty_lock held
+static void dedup_learn(struct ghostfs *gfs, struct cached_cluster *cc)
+{
+	struct dedup_slot *slot;
+	uint64_t hash;
+	int i;
+
+	if (is_dirty(&cc->c))
+		return;
+
+	hash = cluster_hashed(cc);
+
+	for (i = 0; i < DEDUP_PROBES; i++) {
+		slot = &gfs->dedup[(hash + i) & gfs->dedup_mask];
+		if (!slot->nr || slot->nr == cc->nr || !dedup_match(gfs, slot->nr, slot->hash, NULL))
+			break;
+	}
+
+	// all taken, the first one makes room
+	if (i == DEDUP_PROBES)
+		slot = &gfs->dedup[hash & gfs->dedup_mask];
+
+	slot->hash = hash;
+	slot->nr = cc->nr;
+}
+
+// create_in creates name in directory dir
+static int create_in(struct ghostfs *gfs,
+		     struct dir_iter *dir_it,
+		     const char *name,
+		     bool is_dir,
+		     struct dir_iter *iter)
+{
+	const struct dir_entry *dir = dir_it->entry;
+	uint32_t now = time(NULL);
+	struct dir_iter it;
+	int cluster_nr = 0;
+	int new_nr = 0;
+	int last = 0;
+	int ret;
+
+	if (!dir_entry_is_directory(dir))
+		return -ENOTDIR;
+
+	if (strlen(name) > FILENAME_MAX_LEN)
+		return -ENAMETOOLONG;
+
+	if (!name[0])
+		return -EINVAL;
+
+	if (dir_find(gfs, dir->cluster, name, NULL) == 0)
+		return -EEXIST;
+
+	ret = find_empty_entry(gfs, &it, dir->cluster);
+	if (ret < 0) {
+		if (ret != -ENOENT)
+			return ret;
+
+		new_nr = alloc_clusters(gfs, 1, NULL, true, 0, 1);
+		if (new_nr < 0)
+			return new_nr;
+
+		// the chain goes on after the times cluster of the last one, if it has one
+		last = times_nr(gfs, cached(it.cluster)->nr);
+		if (last) {
+			header_changed(gfs, last, 0);
+		} else {
+			last = cached(it.cluster)->nr;
+			mark_cluster(gfs, it.cluster);
+		}
+		gfs->headers[last].next = new_nr;
+
+		find_empty_entry(gfs, &it, new_nr);
+	}
+
+	if (is_dir) {
+		cluster_nr = alloc_clusters(gfs, 1, NULL, true, 0, 1);
+		if (cluster_nr < 0) {
+			ret = cluster_nr;
+			goto undo;
+		}
+	}
+
+	ret = entry_set_times(gfs, &it, now, now);
+	if (ret < 0) {
+		if (cluster_nr)
+			free_clusters(gfs, cluster_nr);
+		goto undo;
+	}
+
+	strcpy(it.entry->filename, name);
+	dir_entry_set_size(it.entry, 0, is_dir);
+	it.entry->cluster = cluster_nr;
+	mark_cluster(gfs, it.cluster);
+	entry_touch(gfs, dir_it, true);
+
+	if (iter)
+		*iter = it;
+
+	return 0;
+undo:
+	if (new_nr) {
+		free_clusters(gfs, new_nr);
+		gfs->headers[last].next = 0;
+	}
+	return ret;
+}
+
+static int create_entry(struct ghostfs *gfs,
+			const char *path,
+			bool is_dir,
+			struct dir_iter *iter)
+{
+	struct dir_iter it;
+	int ret;
+
+	ret = dir_iter_lookup(gfs, &it, path, true);
+	if (ret < 0)
+		return ret;
+
+	return create_in(gfs, &it, last_component(path), is_dir, iter);
+}
+
+int ghostfs_create(struct ghostfs *gfs, const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = create_entry(gfs, path, false, NULL);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_mkdir(struct ghostfs *gfs, const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = create_entry(gfs, path, true, NULL);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+// remove_in removes name from directory dir
+static int remove_in(struct ghostfs *gfs, struct dir_iter *dir_it, const char *name, bool is_dir)
+{
+	const struct dir_entry *dir = dir_it->entry;
+	struct dir_iter link, it;
+	int ret;
+
+	if (!dir_entry_is_directory(dir))
+		return -ENOTDIR;
+
+	ret = dir_find(gfs, dir->cluster, name, &link);
+	if (ret < 0)
+		return ret;
+
+	if (is_dir != dir_entry_is_directory(link.entry))
+		return is_dir ? -ENOTDIR : -EISDIR;
+
+	// make sure directory is empty
+	if (is_dir && link.entry->cluster) {
+		ret = dir_iter_init(gfs, &it, link.entry->cluster);
+		if (ret < 0)
+			return ret;
+
+		if (dir_entry_used(it.entry))
+			return -ENOTEMPTY;
+
+		ret = dir_iter_next_used(&it);
+		if (ret != -ENOENT)
+			return ret == 0 ? -ENOTEMPTY : ret;
+	}
+
+	// an open file keeps its clusters until released
+	if (!inode_detach(gfs, &link) && link.entry->cluster)
+		free_clusters(gfs, link.entry->cluster);
+
+	link.entry->filename[0] = '\0';
+	mark_cluster(gfs, link.cluster);
+	entry_touch(gfs, dir_it, true);
+
+	return 0;
+}
+
+static int remove_entry(struct ghostfs *gfs, const char *path, bool is_dir)
+{
+	struct dir_iter it;
+	int ret;
+
+	ret = dir_iter_lookup(gfs, &it, path, true);
+	if (ret < 0)
+		return ret;
+
+	return remove_in(gfs, &it, last_component(path), is_dir);
+}
+
+int ghostfs_unlink(struct ghostfs *gfs, const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = remove_entry(gfs, path, false);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_rmdir(struct ghostfs *gfs, const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = remove_entry(gfs, path, true);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int size_to_clusters(int size)
+{
+	return size / CLUSTER_DATA + (size % CLUSTER_DATA ? 1 : 0);
+}
+
+/*
+ * do_truncate resizes the file at it. If pos is given, it is set to the last
+ * cluster the file kept, so writes extending it can walk on from there.
+ * When the file grows, only the new bytes before zero_end are zeroed, a
+ * write extending the file passes its offset and fills in the rest.
+ */
+static int do_truncate(struct ghostfs *gfs, struct dir_iter *it, off_t new_size,
+		       off_t zero_end, struct chain_pos *pos)
+{
+	struct chain_pos last = { -1, 0 };
+	long used = it->entry->size % CLUSTER_DATA;
+	long end;
+	int ret;
+	int count;
+	int next;
+	bool zero;
+	uint32_t owner;
+	struct cluster *c;
+
+	if (new_size < 0)
+		return -EINVAL;
+
+	if (new_size > FILESIZE_MAX)
+		return -EFBIG;
+
+	if (dir_entry_is_directory(it->entry))
+		return -EISDIR;
+
+	owner = entry_owner(it);
+	count = size_to_clusters(MIN(it->entry->size, new_size));
+
+	// last is the last cluster kept, next the first one after it
+	ret = chain_seek(gfs, it->entry->cluster, &last, count - 1);
+	if (ret < 0)
+		return ret;
+
+	// zero remaining cluster space, the rest of the new range is a hole
+	end = MIN(zero_end - (off_t)(count - 1) * CLUSTER_DATA, CLUSTER_DATA);
+	zero = new_size > it->entry->size && used && end > used && chain_covers(gfs, &last, count - 1);
+
+	// a packed cluster the file now ends in is trimmed or zeroed unpacked
+	if (gfs->packed[last.nr] && chain_covers(gfs, &last, count - 1) &&
+	    (zero || count - last.index < gfs->packed[last.nr])) {
+		ret = chain_unpack(gfs, &last, count - last.index, owner);
+		if (ret < 0)
+			return ret;
+
+		ret = chain_seek(gfs, it->entry->cluster, &last, count - 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (zero && gfs->refs[last.nr]) {
+		ret = chain_unshare(gfs, it, &last, owner);
+		if (ret < 0)
+			return ret;
+	}
+
+	next = last.nr ? gfs->headers[last.nr].next : it->entry->cluster;
+
+	if (pos)
+		*pos = last;
+
+	if (new_size > it->entry->size) {
+		if (zero) {
+			ret = cluster_get(gfs, last.nr, &c);
+			if (ret < 0)
+				return ret;
+
+			memset(c->data + used, 0, end - used);
+			mark_cluster_owner(gfs, c, owner);
+		}
+	} else if (new_size < it->entry->size) {
+		if (next) {
+			if (last.nr) {
+				gfs->headers[last.nr].next = 0;
+				chain_set_holes(gfs, last.nr, 0);
+				header_changed(gfs, last.nr, owner);
+			} else {
+				it->entry->cluster = 0;
+			}
+
+			free_clusters(gfs, next);
+		}
+	}
+
+	dir_entry_set_size(it->entry, new_size, false);
+	if (it->cluster)
+		mark_cluster(gfs, it->cluster);
+	entry_touch(gfs, it, true);
+
+	return 0;
+}
+
+int ghostfs_truncate(struct ghostfs *gfs, const char *path, off_t new_size)
+{
+	struct dir_iter it;
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+
+	ret = dir_iter_lookup(gfs, &it, path, false);
+	if (ret == 0)
+		ret = do_truncate(gfs, &it, new_size, new_size, NULL);
+
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int rename_in(struct ghostfs *gfs,
+		     struct dir_iter *dir_it,
+		     const char *name,
+		     struct dir_iter *newdir_it,
+		     const char *newname)
+{
+	const struct dir_entry *dir = dir_it->entry;
+	const struct dir_entry *newdir = newdir_it->entry;
+	struct dir_iter it, newit;
+	struct cached_cluster *cc;
+	uint32_t owner, mtime, ctime;
+	int ret;
+
+	if (!dir_entry_is_directory(dir))
+		return -ENOTDIR;
+
+	ret = dir_find(gfs, dir->cluster, name, &it);
+	if (ret < 0)
+		return ret;
+
+	if (dir->cluster == newdir->cluster && !strncmp(name, newname, FILENAME_SIZE))
+		return 0;
+
+	remove_in(gfs, newdir_it, newname, false);
+
+	ret = create_in(gfs, newdir_it, newname, false, &newit);
+	if (ret < 0)
+		return ret;
+
+	entry_times(gfs, &it, &mtime, &ctime);
+
+	// remove old entry
+	it.entry->filename[0] = '\0';
+	mark_cluster(gfs, it.cluster);
+	entry_touch(gfs, dir_it, true);
+
+	// fix new entry
+	newit.entry->size = it.entry->size;
+	newit.entry->cluster = it.entry->cluster;
+	entry_set_times(gfs, &newit, mtime, ctime);
+	entry_touch(gfs, &newit, false);
+	inode_move(gfs, &it, &newit);
+
+	// dirty data now belongs to the new entry
+	owner = entry_owner(&it);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	for (cc = gfs->dirty_first; cc; cc = cc->dirty_next) {
+		if (cc->owner == owner)
+			cc->owner = entry_owner(&newit);
+	}
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	return 0;
+}
+
+static int do_rename(struct ghostfs *gfs, const char *path, const char *newpath)
+{
+	struct dir_iter dir, newdir;
+	int ret;
+
+	ret = dir_iter_lookup(gfs, &dir, path, true);
+	if (ret < 0)
+		return ret;
+
+	ret = dir_iter_lookup(gfs, &newdir, newpath, true);
+	if (ret < 0)
+		return ret;
+
+	return rename_in(gfs, &dir, last_component(path), &newdir, last_component(newpath));
+}
+
+int ghostfs_rename(struct ghostfs *gfs, const char *path, const char *newpath)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = do_rename(gfs, path, newpath);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+// open_iter opens the file at it, or inode if given
+static int open_iter(struct ghostfs *gfs, struct dir_iter *it, struct inode *inode,
+		     struct ghostfs_entry **pentry)
+{
+	struct ghostfs_entry *gentry;
+
+	gentry = calloc(1, sizeof(*gentry));
+	if (!gentry)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&gfs->inode_lock);
+	if (!inode)
+		inode = inode_get(gfs, entry_loc(it));
+	if (inode)
+		inode->open++;
+	pthread_mutex_unlock(&gfs->inode_lock);
+
+	if (!inode) {
+		free(gentry);
+		return -ENOMEM;
+	}
+
+	gentry->it = *it;
+	gentry->inode = inode;
+	*pentry = gentry;
+
+	return 0;
+}
+
+static int do_open(struct ghostfs *gfs, const char *filename, struct ghostfs_entry **pentry)
+{
+	struct dir_iter it;
+	int ret;
+
+	ret = dir_iter_lookup(gfs, &it, filename, false);
+	if (ret < 0)
+		return ret;
+
+	if (dir_entry_is_directory(it.entry))
+		return -EISDIR;
+
+	if (pentry)
+		return open_iter(gfs, &it, NULL, pentry);
+
+	return 0;
+}
+
+int ghostfs_open(struct ghostfs *gfs, const char *filename, struct ghostfs_entry **pentry)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_open(gfs, filename, pentry);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+void ghostfs_release(struct ghostfs_entry *entry)
+{
+	struct ghostfs *gfs = entry->it.gfs;
+	struct inode *inode = entry->inode;
+
+	// the last release of an orphan frees its clusters
+	pthread_rwlock_wrlock(&gfs->lock);
+	pthread_mutex_lock(&gfs->inode_lock);
+
+	if (--inode->open == 0 && inode->orphaned) {
+		free_clusters(gfs, inode->orphan.cluster);
+		inode->orphaned = false;
+	}
+	inode_put(gfs, inode);
+
+	pthread_mutex_unlock(&gfs->inode_lock);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	free(entry);
+}
+
+struct decode_job {
+	struct ghostfs *gfs;
+	uint16_t *nrs;
+};
+
+static void decode_task(void *arg, int i)
+{
+	struct decode_job *job = arg;
+	struct cluster *c;
+
+	// errors show up again when the request gets to the cluster
+	cluster_get(job->gfs, job->nrs[i], &c);
+}
+
+// prefetch decodes the uncached ones of count clusters in parallel
+static void prefetch(struct ghostfs *gfs, const uint16_t *nrs, int count)
+{
+	struct decode_job job = { gfs, NULL };
+	int i, n = 0;
+
+	if (!gfs->pool || count < 2)
+		return;
+
+	job.nrs = malloc(count * sizeof(*job.nrs));
+	if (!job.nrs)
+		return;
+
+	for (i = 0; i < count; i++) {
+		if (nrs[i] && !cache_peek(gfs, nrs[i]))
+			job.nrs[n++] = nrs[i];
+	}
+
+	pool_run(gfs->pool, n, decode_task, &job);
+	free(job.nrs);
+}
+
+/*
+ * chain_map sets nrs to the clusters at index first .. first+count-1 of the
+ * file at it, 0 for holes. Indexes packed into a cluster get that cluster,
+ * and their place among the ones it holds in subs, if given. It walks on
+ * from pos when that is given and not past first. With fill set holes get
+ * clusters, allocated for owner, packed clusters are unpacked and clusters
+ * linked to are copied.
+ */
+static int chain_map(struct ghostfs *gfs, struct dir_iter *it, const struct chain_pos *pos,
+		     int first, int count, bool fill, uint32_t owner, uint16_t *nrs,
+		     uint8_t *subs)
+{
+	struct chain_pos cur = { -1, 0 };
+	int ret, i;
+
+	if (pos && pos->index <= first)
+		cur = *pos;
+
+	for (i = 0; i < count; i++) {
+		ret = chain_seek(gfs, it->entry->cluster, &cur, first + i);
+		if (ret < 0)
+			return ret;
+
+		if (fill && gfs->packed[cur.nr] && chain_covers(gfs, &cur, first + i)) {
+			ret = chain_unpack(gfs, &cur, gfs->packed[cur.nr], owner);
+			if (ret < 0)
+				return ret;
+
+			ret = chain_seek(gfs, it->entry->cluster, &cur, first + i);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (fill && gfs->refs[cur.nr] && chain_covers(gfs, &cur, first + i)) {
+			ret = chain_unshare(gfs, it, &cur, owner);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (subs)
+			subs[i] = first + i - cur.index;
+
+		if (chain_covers(gfs, &cur, first + i)) {
+			nrs[i] = cur.nr;
+		} else if (!fill) {
+			nrs[i] = 0;
+		} else {
+			ret = chain_fill(gfs, it, &cur, first + i, owner, cur.nr + 1);
+			if (ret < 0)
+				return ret;
+			nrs[i] = ret;
+		}
+	}
+
+	return 0;
+}
+
+// resolve_links replaces the links among nrs from chain_map by the clusters they link to
+static int resolve_links(struct ghostfs *gfs, uint16_t *nrs, uint8_t *subs, int count)
+{
+	const struct packed_data *p;
+	struct cluster *c;
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		if (!nrs[i] || !(gfs->cluster_flags[nrs[i]] & CLUSTER_LINKS))
+			continue;
+
+		ret = cluster_get(gfs, nrs[i], &c);
+		if (ret < 0)
+			return ret;
+
+		p = (const void *)c->data;
+		memcpy(&nrs[i], p->data + subs[i] * sizeof(nrs[i]), sizeof(nrs[i]));
+		subs[i] = 0;
+	}
+
+	return 0;
+}
+
+// holes read from here
+static const unsigned char zero_data[CLUSTER_DATA];
+
+// cache_drop removes clean cluster c from the cache, with lock taken for writing
+static void cache_drop(struct ghostfs *gfs, struct cluster *c)
+{
+	int nr = cached(c)->nr;
+	pthread_mutex_t *lock = &gfs->cache_lock[nr % CACHE_STRIPES];
+
+	pthread_mutex_lock(lock);
+	if (!is_dirty(c)) {
+		__atomic_store_n(&gfs->clusters[nr], NULL, __ATOMIC_RELEASE);
+		free(cached(c));
+	}
+	pthread_mutex_unlock(lock);
+}
+
+/*
+ * drop_undecoded drops the clusters from map_range that were not decoded
+ * and the copy did not fill in full, copied being how much it did or
+ * -errno. They hold zeros the carrier does not, and are decoded again when
+ * needed. The one the copy stopped in gets the rest of its data decoded.
+ */
+static void drop_undecoded(struct ghostfs *gfs, const struct iovec *iov, const uint16_t *undecoded,
+			   int count, int copied)
+{
+	struct cluster *c, old;
+	size_t start, end = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		start = end;
+		end += iov[i].iov_len;
+		if (!undecoded[i] || (copied >= 0 && end <= (size_t)copied))
+			continue;
+
+		c = cache_peek(gfs, undecoded[i]);
+
+		if (copied > 0 && start < (size_t)copied &&
+		    read_cluster_locked(gfs, &old, undecoded[i]) == 0 &&
+		    check_cluster(gfs, undecoded[i], &old, false) == 0) {
+			memcpy(c->data + copied - start, old.data + copied - start, end - copied);
+			continue;
+		}
+
+		pthread_mutex_lock(&gfs->dirty_lock);
+		unmark_cluster(gfs, c);
+		pthread_mutex_unlock(&gfs->dirty_lock);
+
+		cache_drop(gfs, c);
+
+		// marking it took over any pending header write
+		header_changed(gfs, undecoded[i], 0);
+	}
+}
+
+/*
+ * map_range points iov at the cached cluster data holding size bytes from
+ * offset, so requests can be served straight from the cache. The pointers
+ * stay valid while gfs->lock is held. The chain is walked once, from pos
+ * when it is given and not past the range. With dirty set holes are filled
+ * and the clusters are marked for owner, the caller is about to write them.
+ * Clusters the write covers in full are then not decoded at all, those go
+ * to undecoded, if given, and the other entries are 0. It stays valid until
+ * iov is freed.
+ */
+static int map_range(struct ghostfs *gfs, struct dir_iter *it, size_t size,
+		     off_t offset, const struct chain_pos *pos, uint32_t owner, bool dirty,
+		     struct iovec **piov, uint16_t **pundecoded)
+{
+	struct iovec *iov;
+	struct cluster *c;
+	unsigned char *data;
+	uint16_t *nrs;
+	uint8_t *subs;
+	int first = offset / CLUSTER_DATA;
+	int count = (offset + size - 1) / CLUSTER_DATA - first + 1;
+	int ret, i = 0;
+
+	iov = malloc(count * (sizeof(*iov) + sizeof(*nrs) + sizeof(*subs)));
+	if (!iov)
+		return -ENOMEM;
+	nrs = (uint16_t *)(iov + count);
+	subs = (uint8_t *)(nrs + count);
+
+	ret = chain_map(gfs, it, pos, first, count, dirty, owner, nrs, subs);
+	if (ret < 0)
+		goto err;
+
+	if (!dirty) {
+		ret = resolve_links(gfs, nrs, subs, count);
+		if (ret < 0)
+			goto err;
+	}
+
+	offset %= CLUSTER_DATA;
+
+	if (dirty) {
+		// only the clusters at the edges keep some of their data
+		uint16_t edges[2] = { offset ? nrs[0] : 0,
+				      (offset + size) % CLUSTER_DATA ? nrs[count - 1] : 0 };
+
+		prefetch(gfs, edges, count > 1 ? 2 : 1);
+	} else {
+		prefetch(gfs, nrs, count);
+	}
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_len = MIN(size, CLUSTER_DATA - offset);
+		size -= iov[i].iov_len;
+
+		if (!nrs[i]) {
+			iov[i].iov_base = (void *)zero_data;
+			offset = 0;
+			continue;
+		}
+
+		if (dirty && iov[i].iov_len == CLUSTER_DATA && !cache_peek(gfs, nrs[i])) {
+			ret = cluster_get_overwrite(gfs, nrs[i], &c);
+		} else {
+			ret = cluster_get(gfs, nrs[i], &c);
+			nrs[i] = 0;
+		}
+		if (ret < 0)
+			goto err;
+
+		data = c->data;
+		if (gfs->packed[cached(c)->nr]) {
+			ret = cluster_unpacked(gfs, c, &data);
+			if (ret < 0)
+				goto err;
+			data += subs[i] * CLUSTER_DATA;
+		} else if (gfs->dedup && !dirty && !__atomic_load_n(&cached(c)->hashed, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&gfs->dirty_lock);
+			dedup_learn(gfs, cached(c));
+			pthread_mutex_unlock(&gfs->dirty_lock);
+		}
+
+		iov[i].iov_base = data + offset;
+		offset = 0;
+
+		if (dirty) {
+			cached(c)->written = true;
+			mark_cluster_owner(gfs, c, owner);
+		}
+	}
+
+	*piov = iov;
+	if (pundecoded)
+		*pundecoded = nrs;
+
+	return count;
+err:
+	if (dirty)
+		drop_undecoded(gfs, iov, nrs, i, ret);
+	free(iov);
+	return ret;
+}
+
+/*
+ * write_through encodes the clusters a direct write covered in full and
+ * drops them from the cache, the rest are written back as usual.
+ */
+static int write_through(struct ghostfs *gfs, const struct iovec *iov, int count)
+{
+	struct cached_cluster **ccs;
+	int i, n = 0;
+	int ret;
+
+	ccs = malloc(count * sizeof(*ccs));
+	if (!ccs)
+		return -ENOMEM;
+
+	// full clusters are mapped from their start, see map_range
+	for (i = 0; i < count; i++) {
+		if (iov[i].iov_len == CLUSTER_DATA)
+			ccs[n++] = cached(iov[i].iov_base);
+	}
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+	ret = encode_all(gfs, ccs, n, NULL);
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	for (i = 0; !ret && i < n; i++)
+		cache_drop(gfs, &ccs[i]->c);
+
+	free(ccs);
+
+	return ret;
+}
+
+static int do_write_iov(struct ghostfs *gfs,
+			struct ghostfs_entry *gentry,
+			size_t size,
+			off_t offset,
+			ghostfs_iov_fn fn,
+			void *arg)
+{
+	struct chain_pos pos = { -1, 0 };
+	struct dir_entry *entry;
+	struct dir_iter it;
+	struct iovec *iov;
+	uint16_t *undecoded;
+	uint32_t old_size;
+	int ret, count;
+
+	ret = inode_iter(gfs, gentry->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	entry = it.entry;
+	old_size = entry->size;
+
+	if (offset < 0)
+		return -EINVAL;
+
+	if (size + offset < size)
+		return -EOVERFLOW;
+
+	if (!size)
+		return fn(arg, NULL, 0);
+
+	if (entry->size < offset + size) {
+		ret = do_truncate(gfs, &it, offset + size, offset, &pos);
+		if (ret < 0)
+			return ret;
+	}
+
+	count = map_range(gfs, &it, size, offset, &pos, entry_owner(&it), true, &iov, &undecoded);
+	if (count < 0) {
+		// out of space filling holes, drop what the write added
+		if (entry->size != old_size)
+			do_truncate(gfs, &it, old_size, old_size, NULL);
+		return count;
+	}
+
+	entry_touch(gfs, &it, true);
+
+	ret = fn(arg, iov, count);
+	if (ret < 0 || (size_t)ret < size)
+		drop_undecoded(gfs, iov, undecoded, count, ret);
+
+	// a failed or short copy only extends the file as far as it got
+	if ((ret < 0 || (size_t)ret < size) && entry->size > old_size) {
+		off_t end = ret > 0 ? MAX((off_t)old_size, offset + ret) : old_size;
+
+		if (end < entry->size)
+			do_truncate(gfs, &it, end, end, NULL);
+	}
+
+	// what a short copy left is written back as usual
+	if ((size_t)ret == size && (gentry->flags & GHOSTFS_O_DIRECT)) {
+		int err = write_through(gfs, iov, count);
+
+		if (err < 0)
+			ret = err;
+	}
+	free(iov);
+
+	return ret;
+}
+
+/*
+ * write_in_place writes into clusters the file already has on its own, with
+ * gfs->lock taken for reading and the write_lock of the inode held. It
+ * returns -EAGAIN when the write needs lock taken for writing: when it
+ * extends the file, fills holes, goes to packed or linked clusters, covers
+ * uncached ones in full, changes the entry times or is direct. The clusters
+ * are marked after the copy, so that a flush or pack that saw part of it has
+ * them dirty again.
+ */
+static int write_in_place(struct ghostfs *gfs,
+			  struct ghostfs_entry *gentry,
+			  size_t size,
+			  off_t offset,
+			  ghostfs_iov_fn fn,
+			  void *arg)
+{
+	struct dir_iter it;
+	struct iovec *iov;
+	struct cluster *c;
+	uint16_t *nrs;
+	int first, count;
+	int ret, i;
+
+	if (!size || offset < 0 || size + offset < size || (gentry->flags & GHOSTFS_O_DIRECT))
+		return -EAGAIN;
+
+	ret = inode_iter(gfs, gentry->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	if (it.entry->size < offset + size || entry_touched(gfs, &it, true, time(NULL)))
+		return -EAGAIN;
+
+	first = offset / CLUSTER_DATA;
+	count = (offset + size - 1) / CLUSTER_DATA - first + 1;
+
+	iov = malloc(count * (sizeof(*iov) + sizeof(*nrs)));
+	if (!iov)
+		return -ENOMEM;
+	nrs = (uint16_t *)(iov + count);
+
+	ret = chain_map(gfs, &it, NULL, first, count, false, 0, nrs, NULL);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_len = MIN(size, CLUSTER_DATA - (i ? 0 : offset % CLUSTER_DATA));
+		size -= iov[i].iov_len;
+
+		// map_range does not decode uncached clusters written in full
+		if (!nrs[i] || gfs->packed[nrs[i]] || gfs->refs[nrs[i]] ||
+		    (gfs->cluster_flags[nrs[i]] & CLUSTER_LINKS) ||
+		    (iov[i].iov_len == CLUSTER_DATA && !cache_peek(gfs, nrs[i]))) {
+			ret = -EAGAIN;
+			goto out;
+		}
+	}
+
+	prefetch(gfs, nrs, count);
+
+	for (i = 0; i < count; i++) {
+		ret = cluster_get(gfs, nrs[i], &c);
+		if (ret < 0)
+			goto out;
+
+		iov[i].iov_base = c->data + (i ? 0 : offset % CLUSTER_DATA);
+	}
+
+	ret = fn(arg, iov, count);
+
+	// a failed copy may still have changed some
+	for (i = 0; i < count; i++) {
+		c = cache_peek(gfs, nrs[i]);
+		cached(c)->written = true;
+		mark_cluster_owner(gfs, c, entry_owner(&it));
+	}
+out:
+	free(iov);
+	return ret;
+}
+
+int ghostfs_write_iov(struct ghostfs *gfs,
+		      struct ghostfs_entry *gentry,
+		      size_t size,
+		      off_t offset,
+		      ghostfs_iov_fn fn,
+		      void *arg)
+{
+	struct inode *inode = gentry->inode;
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	pthread_mutex_lock(&inode->write_lock);
+	ret = write_in_place(gfs, gentry, size, offset, fn, arg);
+	pthread_mutex_unlock(&inode->write_lock);
+	pthread_rwlock_unlock(&gfs->lock);
+	if (ret != -EAGAIN)
+		return ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = do_write_iov(gfs, gentry, size, offset, fn, arg);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int copy_in(void *arg, const struct iovec *iov, int count)
+{
+	const char *buf = arg;
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		memcpy(iov[i].iov_base, buf + n, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+
+	return n;
+}
+
+int ghostfs_write(struct ghostfs *gfs,
+		  struct ghostfs_entry *gentry,
+		  const char *buf,
+		  size_t size,
+		  off_t offset)
+{
+	return ghostfs_write_iov(gfs, gentry, size, offset, copy_in, (void *)buf);
+}
+
+/*
+ * Readahead decodes the clusters following a sequential read in a
+ * background thread, so the next read finds them cached. The window starts
+ * at READAHEAD_MIN clusters and doubles on every sequential read up to
+ * READAHEAD_MAX, a read anywhere else resets it. The thread has the kernel
+ * page in each run of queued clusters with MADV_WILLNEED before decoding.
+ */
+static void *readahead_worker(void *arg)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	struct ghostfs *gfs = arg;
+	int advised = 0, advised_len = 0;
+	int nr, len;
+
+	pthread_mutex_lock(&gfs->readahead_lock);
+
+	while (!gfs->readahead_stop) {
+		if (!gfs->readahead_count) {
+			pthread_cond_wait(&gfs->readahead_cond, &gfs->readahead_lock);
+			continue;
+		}
+
+		nr = gfs->readahead_queue[gfs->readahead_head];
+		gfs->readahead_head = (gfs->readahead_head + 1) % READAHEAD_QUEUE;
+		gfs->readahead_count--;
+
+		if (cache_peek(gfs, nr))
+			continue;
+
+		// have the kernel page in the carrier of the run of queued clusters nr starts
+		len = 0;
+		if (nr < advised || nr >= advised + advised_len) {
+			for (len = 1; len <= gfs->readahead_count; len++) {
+				if (gfs->readahead_queue[(gfs->readahead_head + len - 1) % READAHEAD_QUEUE] !=
+				    nr + len)
+					break;
+			}
+			advised = nr;
+			advised_len = len;
+		}
+
+		// readers of the same cluster wait on its cache lock meanwhile
+		pthread_mutex_unlock(&gfs->readahead_lock);
+		if (len)
+			stegger_advise(gfs->stegger, len*CLUSTER_SIZE, c0_offset + nr*CLUSTER_SIZE,
+				       MADV_WILLNEED);
+		cache_fill(gfs, nr, NULL, true);
+		pthread_mutex_lock(&gfs->readahead_lock);
+	}
+
+	pthread_mutex_unlock(&gfs->readahead_lock);
+
+	return NULL;
+}
+
+// readahead_start is called with readahead_lock held
+static void readahead_start(struct ghostfs *gfs)
+{
+	int ret;
+
+	// started on first use, fuse may fork after mount
+	ret = pthread_create(&gfs->readahead_thread, NULL, readahead_worker, gfs);
+	if (ret) {
+		errno = ret;
+		warn("fs: cannot start readahead");
+		gfs->readahead_count = 0;
+		return;
+	}
+
+	gfs->readahead_running = true;
+}
+
+static void readahead_stop(struct ghostfs *gfs)
+{
+	pthread_mutex_lock(&gfs->readahead_lock);
+	if (!gfs->readahead_running) {
+		pthread_mutex_unlock(&gfs->readahead_lock);
+		return;
+	}
+	gfs->readahead_stop = true;
+	pthread_cond_signal(&gfs->readahead_cond);
+	pthread_mutex_unlock(&gfs->readahead_lock);
+
+	pthread_join(gfs->readahead_thread, NULL);
+	gfs->readahead_running = false;
+}
+
+static void queue_readahead(struct ghostfs *gfs, struct ghostfs_entry *gentry,
+			    struct dir_iter *it, off_t offset, size_t size)
+{
+	const struct dir_entry *entry = it->entry;
+	uint16_t nrs[READAHEAD_MAX];
+	int start, end, nr, i;
+	bool queued = false;
+
+	pthread_mutex_lock(&gfs->readahead_lock);
+
+	if (offset != gentry->ra_next) {
+		gentry->ra_window = 0;
+		gentry->ra_end = 0;
+	} else if (gentry->ra_window) {
+		gentry->ra_window = MIN(gentry->ra_window * 2, READAHEAD_MAX);
+	} else {
+		gentry->ra_window = READAHEAD_MIN;
+	}
+	gentry->ra_next = offset + size;
+
+	if (!gentry->ra_window)
+		goto out;
+
+	start = (offset + size - 1) / CLUSTER_DATA + 1;
+	end = MIN(start + gentry->ra_window, size_to_clusters(entry->size));
+	start = MAX(start, gentry->ra_end);
+	if (start >= end)
+		goto out;
+
+	gentry->ra_end = end;
+
+	if (chain_map(gfs, it, NULL, start, end - start, false, 0, nrs, NULL) < 0)
+		goto out;
+
+	for (i = 0; i < end - start; i++) {
+		nr = nrs[i];
+		if (!nr || cache_peek(gfs, nr) || gfs->readahead_count == READAHEAD_QUEUE)
+			continue;
+
+		// a packed cluster shows up once for every cluster it holds
+		if (i && nr == nrs[i - 1])
+			continue;
+
+		gfs->readahead_queue[(gfs->readahead_head + gfs->readahead_count) % READAHEAD_QUEUE] = nr;
+		gfs->readahead_count++;
+		queued = true;
+	}
+
+	if (!queued)
+		goto out;
+
+	if (!gfs->readahead_running)
+		readahead_start(gfs);
+
+	pthread_cond_signal(&gfs->readahead_cond);
+out:
+	pthread_mutex_unlock(&gfs->readahead_lock);
+}
+
+// read_size clamps a read of size bytes at offset to the end of the file
+static ssize_t read_size(const struct dir_entry *entry, size_t size, off_t offset)
+{
+	if (offset < 0)
+		return -EINVAL;
+
+	if (size + offset < size)
+		return -EOVERFLOW;
+
+	if (offset > entry->size)
+		return 0;
+
+	return MIN(size, entry->size - offset);
+}
+
+struct direct_read {
+	char *buf;
+	size_t len;
+	size_t pos;
+	// cluster decoded in full first to be checked or unsealed, 0 to read just the range
+	uint16_t check;
+	size_t offset;
+};
+
+struct direct_job {
+	struct ghostfs *gfs;
+	struct direct_read *reads;
+	int ret;
+};
+
+static void direct_task(void *arg, int i)
+{
+	struct direct_job *job = arg;
+	struct direct_read *rd = &job->reads[i];
+	struct cluster c;
+	int ret;
+
+	if (rd->check) {
+		ret = read_cluster_locked(job->gfs, &c, rd->check);
+		if (ret == 0)
+			ret = check_cluster(job->gfs, rd->check, &c, false);
+		if (ret == 0)
+			memcpy(rd->buf, c.data + rd->offset, rd->len);
+		else if (ret == -EBADMSG)
+			ret = -EIO;
+	} else {
+		ret = stegger_read(job->gfs->stegger, rd->buf, rd->len, rd->pos);
+	}
+	if (ret < 0)
+		__atomic_store_n(&job->ret, ret, __ATOMIC_RELAXED);
+}
+
+/*
+ * do_read_direct decodes straight from the carrier into buf, for handles
+ * opened with GHOSTFS_O_DIRECT. Cached clusters hold the latest data and
+ * are copied from there, but nothing is added to the cache or read ahead,
+ * except for packed clusters, which have to be unpacked anyway, and links.
+ */
+static ssize_t do_read_direct(struct ghostfs *gfs, struct ghostfs_entry *gentry, char *buf,
+			      size_t size, off_t offset)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	struct direct_job job = { gfs, NULL, 0 };
+	struct cluster *c;
+	struct dir_iter it;
+	unsigned char *data;
+	uint16_t *nrs;
+	uint8_t *subs;
+	size_t len, done = 0;
+	ssize_t ret;
+	int first, count, i, n = 0;
+
+	ret = inode_iter(gfs, gentry->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	ret = read_size(it.entry, size, offset);
+	if (ret <= 0)
+		return ret;
+	size = ret;
+
+	first = offset / CLUSTER_DATA;
+	count = (offset + size - 1) / CLUSTER_DATA - first + 1;
+
+	job.reads = malloc(count * (sizeof(*job.reads) + sizeof(*nrs) + sizeof(*subs)));
+	if (!job.reads)
+		return -ENOMEM;
+	nrs = (uint16_t *)(job.reads + count);
+	subs = (uint8_t *)(nrs + count);
+
+	ret = chain_map(gfs, &it, NULL, first, count, false, 0, nrs, subs);
+	if (ret == 0)
+		ret = resolve_links(gfs, nrs, subs, count);
+	if (ret < 0)
+		goto out;
+
+	offset %= CLUSTER_DATA;
+
+	for (i = 0; i < count; i++, done += len, offset = 0) {
+		len = MIN(size - done, CLUSTER_DATA - offset);
+
+		if (!nrs[i]) {
+			memset(buf + done, 0, len);
+			continue;
+		}
+
+		if (gfs->packed[nrs[i]]) {
+			ret = cluster_get(gfs, nrs[i], &c);
+			if (ret == 0)
+				ret = cluster_unpacked(gfs, c, &data);
+			if (ret < 0)
+				goto out;
+
+			memcpy(buf + done, data + subs[i] * CLUSTER_DATA + offset, len);
+			continue;
+		}
+
+		c = cache_peek(gfs, nrs[i]);
+		if (c) {
+			memcpy(buf + done, c->data + offset, len);
+			continue;
+		}
+
+		job.reads[n].buf = buf + done;
+		job.reads[n].len = len;
+		job.reads[n].pos = c0_offset + (size_t)nrs[i]*CLUSTER_SIZE + offset;
+		job.reads[n].check = gfs->sums && !__atomic_load_n(&gfs->checked[nrs[i]],
+								   __ATOMIC_RELAXED) ? nrs[i] : 0;
+		if (gfs->seals)
+			job.reads[n].check = nrs[i];
+		job.reads[n].offset = offset;
+		n++;
+	}
+
+	pool_run(gfs->pool, n, direct_task, &job);
+	ret = job.ret ? job.ret : (ssize_t)size;
+out:
+	free(job.reads);
+
+	return ret;
+}
+
+static int do_read_iov(struct ghostfs *gfs,
+		       struct ghostfs_entry *gentry,
+		       size_t size,
+		       off_t offset,
+		       ghostfs_iov_fn fn,
+		       void *arg)
+{
+	struct dir_iter it;
+	struct iovec *iov;
+	int ret, count;
+
+	ret = inode_iter(gfs, gentry->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	ret = read_size(it.entry, size, offset);
+	if (ret <= 0)
+		return ret < 0 ? ret : fn(arg, NULL, 0);
+	size = ret;
+
+	if (gentry->flags & GHOSTFS_O_DIRECT) {
+		struct iovec direct = { malloc(size), size };
+
+		if (!direct.iov_base)
+			return -ENOMEM;
+
+		ret = do_read_direct(gfs, gentry, direct.iov_base, size, offset);
+		if (ret >= 0)
+			ret = fn(arg, &direct, 1);
+		free(direct.iov_base);
+
+		return ret;
+	}
+
+	queue_readahead(gfs, gentry, &it, offset, size);
+
+	count = map_range(gfs, &it, size, offset, NULL, 0, false, &iov, NULL);
+	if (count < 0)
+		return count;
+
+	ret = fn(arg, iov, count);
+	free(iov);
+
+	return ret;
+}
+
+int ghostfs_read_iov(struct ghostfs *gfs,
+		     struct ghostfs_entry *gentry,
+		     size_t size,
+		     off_t offset,
+		     ghostfs_iov_fn fn,
+		     void *arg)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_read_iov(gfs, gentry, size, offset, fn, arg);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+struct copy_range {
+	struct ghostfs *gfs;
+	struct ghostfs_entry *src;
+	off_t offset;
+	// source and destination clusters line up
+	bool aligned;
+};
+
+/*
+ * copy_share notes which source clusters the destination clusters iov
+ * covers in full were copied from. When written back they become links to
+ * those, if they still hold the same data.
+ */
+static void copy_share(struct ghostfs *gfs, struct dir_iter *it, off_t offset,
+		       const struct iovec *iov, int count)
+{
+	struct cached_cluster *cc;
+	struct cluster *c;
+	uint16_t *nrs;
+	uint8_t *subs;
+	int i;
+
+	nrs = malloc(count * (sizeof(*nrs) + sizeof(*subs)));
+	if (!nrs)
+		return;
+	subs = (uint8_t *)(nrs + count);
+
+	if (chain_map(gfs, it, NULL, offset / CLUSTER_DATA, count, false, 0, nrs, subs) < 0 ||
+	    resolve_links(gfs, nrs, subs, count) < 0)
+		goto out;
+
+	// full clusters are mapped from their start, see map_range
+	for (i = 0; i < count; i++) {
+		c = nrs[i] && !gfs->packed[nrs[i]] ? cache_peek(gfs, nrs[i]) : NULL;
+		if (!c || iov[i].iov_len != CLUSTER_DATA)
+			continue;
+
+		cc = cached(iov[i].iov_base);
+		cc->copied_from = nrs[i];
+		cc->copied_seq = cached(c)->seq;
+	}
+out:
+	free(nrs);
+}
+
+// copy_from_src fills the destination clusters straight from the source ones
+static int copy_from_src(void *arg, const struct iovec *iov, int count)
+{
+	struct copy_range *copy = arg;
+	struct dir_iter it;
+	struct iovec *src;
+	size_t size = 0, doff = 0, soff = 0, n;
+	int ret, scount, i, j;
+
+	for (i = 0; i < count; i++)
+		size += iov[i].iov_len;
+
+	ret = inode_iter(copy->gfs, copy->src->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	scount = map_range(copy->gfs, &it, size, copy->offset, NULL, 0, false, &src, NULL);
+	if (scount < 0)
+		return scount;
+
+	for (i = 0, j = 0; i < count && j < scount;) {
+		n = MIN(iov[i].iov_len - doff, src[j].iov_len - soff);
+		memcpy((char *)iov[i].iov_base + doff, (char *)src[j].iov_base + soff, n);
+
+		doff += n;
+		if (doff == iov[i].iov_len) {
+			i++;
+			doff = 0;
+		}
+
+		soff += n;
+		if (soff == src[j].iov_len) {
+			j++;
+			soff = 0;
+		}
+	}
+
+	free(src);
+
+	if (copy->aligned)
+		copy_share(copy->gfs, &it, copy->offset, iov, count);
+
+	return size;
+}
+
+/*
+ * do_copy_range copies up to COPY_BATCH clusters worth of data between two
+ * open files, from cached cluster to cached cluster. Clusters copied in full
+ * are written back as links to the source ones, see copy_share.
+ */
+static ssize_t do_copy_range(struct ghostfs *gfs, struct ghostfs_entry *src, off_t src_offset,
+			     struct ghostfs_entry *dst, off_t dst_offset, size_t size)
+{
+	struct copy_range copy = { gfs, src, src_offset,
+				   src_offset % CLUSTER_DATA == dst_offset % CLUSTER_DATA };
+	struct dir_iter it;
+	int ret;
+
+	ret = inode_iter(gfs, src->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	if (dir_entry_is_directory(it.entry))
+		return -EISDIR;
+
+	if (src_offset < 0 || dst_offset < 0)
+		return -EINVAL;
+
+	if (src_offset >= it.entry->size)
+		return 0;
+
+	size = MIN(size, it.entry->size - src_offset);
+	size = MIN(size, (size_t)COPY_BATCH * CLUSTER_DATA);
+
+	// overlapping ranges of the same file are not supported, like on Linux
+	if (src->inode == dst->inode &&
+	    src_offset < dst_offset + (off_t)size && dst_offset < src_offset + (off_t)size)
+		return -EINVAL;
+
+	return do_write_iov(gfs, dst, size, dst_offset, copy_from_src, &copy);
+}
+
+// ghostfs_copy_range copies size bytes without going through user buffers
+ssize_t ghostfs_copy_range(struct ghostfs *gfs, struct ghostfs_entry *src, off_t src_offset,
+			   struct ghostfs_entry *dst, off_t dst_offset, size_t size)
+{
+	ssize_t ret, done = 0;
+
+	while (done < (ssize_t)size) {
+		pthread_rwlock_wrlock(&gfs->lock);
+		ret = do_copy_range(gfs, src, src_offset + done, dst, dst_offset + done,
+				    size - done);
+		pthread_rwlock_unlock(&gfs->lock);
+
+		if (ret < 0)
+			return done ? done : ret;
+		if (!ret)
+			break;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+static off_t do_lseek(struct ghostfs *gfs, struct ghostfs_entry *gentry, off_t offset,
+			int whence)
+{
+	struct chain_pos pos = { -1, 0 };
+	struct dir_iter it;
+	int index, ret;
+
+	ret = inode_iter(gfs, gentry->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;
+
+	if (offset < 0)
+		return -EINVAL;
+
+	if (offset >= it.entry->size)
+		return -ENXIO;
+
+	// find the cluster holding offset or the last one before it
+	index = offset / CLUSTER_DATA;
+	ret = chain_seek(gfs, it.entry->cluster, &pos, index);
+	if (ret < 0)
+		return ret;
+
+	if (whence == SEEK_DATA) {
+		if (chain_covers(gfs, &pos, index))
+			return offset;
+
+		// data starts at the next cluster, if there is one
+		if (pos.nr)
+			ret = gfs->headers[pos.nr].next ? pos.index + 1 + chain_holes(gfs, pos.nr) : -1;
+		else
+			ret = it.entry->cluster ? 0 : -1;
+
+		// preallocated clusters past the end do not count
+		if (ret < 0 || (off_t)ret * CLUSTER_DATA >= it.entry->size)
+			return -ENXIO;
+
+		return (off_t)ret * CLUSTER_DATA;
+	}
+
+	if (!chain_covers(gfs, &pos, index))
+		return offset;
+
+	// skip clusters that follow each other without holes
+	while (gfs->headers[pos.nr].next && chain_holes(gfs, pos.nr) == chain_span(gfs, pos.nr) - 1) {
+		pos.index += chain_span(gfs, pos.nr);
+		pos.nr = gfs->headers[pos.nr].next;
+	}
+
+	return MIN((off_t)(pos.index + chain_span(gfs, pos.nr)) * CLUSTER_DATA,
+		   (off_t)it.entry->size);
+}
+
+// ghostfs_lseek finds data or holes for SEEK_DATA and SEEK_HOLE
+off_t ghostfs_lseek(struct ghostfs *gfs, struct ghostfs_entry *gentry, off_t offset, int whence)
+{
+	off_t ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_lseek(gfs, gentry, offset, whence);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+/*
+ * do_fallocate gives every hole in the range a zeroed cluster. The missing
+ * clusters are taken from one run of free clusters where there is one, so
+ * a preallocated file is not interleaved with others growing at the same
+ * time.
+ */
+static int do_fallocate(struct ghostfs *gfs, struct ghostfs_entry *gentry, int mode,
+			off_t offset, off_t length)
+{
+	struct chain_pos pos = { -1, 0 };
+	struct dir_iter it;
+	uint32_t owner;
+	int first, last, index;
+	int missing = 0;
+	int goal, run;
+	int ret;
+
+	ret = inode_iter(gfs, gentry->inode, &it);
+	if (ret < 0)
+		return ret;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+
+	if (offset + length > FILESIZE_MAX)
+		return -EFBIG;
+
+	if (dir_entry_is_directory(it.entry))
+		return -EISDIR;
+
+	owner = entry_owner(&it);
+	first = offset / CLUSTER_DATA;
+	last = (offset + length - 1) / CLUSTER_DATA;
+
+	for (index = first; index <= last; index++) {
+		ret = chain_seek(gfs, it.entry->cluster, &pos, index);
+		if (ret < 0)
+			return ret;
+		if (!chain_covers(gfs, &pos, index))
+			missing++;
+	}
+
+	// anchors for long holes before the range are not counted, close enough
+	if (missing > gfs->free_clusters)
+		return -ENOSPC;
+
+	goal = free_run(gfs, missing, &run);
+	pos = (struct chain_pos){ -1, 0 };
+
+	for (index = first; missing && index <= last; index++) {
+		ret = chain_seek(gfs, it.entry->cluster, &pos, index);
+		if (ret < 0)
+			return ret;
+		if (chain_covers(gfs, &pos, index))
+			continue;
+
+		ret = chain_fill(gfs, &it, &pos, index, owner, goal);
+		if (ret < 0)
+			return ret;
+		goal = ret + 1;
+		missing--;
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > it.entry->size)
+		return do_truncate(gfs, &it, offset + length, offset + length, NULL);
+
+	return 0;
+}
+
+// ghostfs_fallocate allocates clusters for a range, see fallocate(2)
+int ghostfs_fallocate(struct ghostfs *gfs, struct ghostfs_entry *gentry, int mode,
+		      off_t offset, off_t length)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = do_fallocate(gfs, gentry, mode, offset, length);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int copy_out(void *arg, const struct iovec *iov, int count)
+{
+	char *buf = arg;
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		memcpy(buf + n, iov[i].iov_base, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+
+	return n;
+}
+
+int ghostfs_read(struct ghostfs *gfs,
+		 struct ghostfs_entry *gentry,
+		 char *buf,
+		 size_t size,
+		 off_t offset)
+{
+	ssize_t ret;
+
+	if (!(gentry->flags & GHOSTFS_O_DIRECT))
+		return ghostfs_read_iov(gfs, gentry, size, offset, copy_out, buf);
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_read_direct(gfs, gentry, buf, size, offset);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int do_opendir(struct ghostfs *gfs, const char *path, struct ghostfs_entry **pentry)
+{
+	struct dir_iter it;
+	int ret;
+
+	ret = dir_iter_lookup(gfs, &it, path, false);
+	if (ret < 0)
+		return ret;
+
+	if (!dir_entry_is_directory(it.entry))
+		return -ENOTDIR;
+
+	*pentry = calloc(1, sizeof(**pentry));
+	if (!*pentry)
+		return -ENOMEM;
+	(*pentry)->it.entry = it.entry;
+
+	return 0;
+}
+
+int ghostfs_opendir(struct ghostfs *gfs, const char *path, struct ghostfs_entry **pentry)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_opendir(gfs, path, pentry);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int do_next_entry(struct ghostfs *gfs, struct ghostfs_entry *entry)
+{
+	int ret;
+
+	if (!entry->it.gfs) {
+		ret = dir_iter_init(gfs, &entry->it, entry->it.entry->cluster);
+		if (ret < 0)
+			return ret;
+
+		if (dir_entry_used(entry->it.entry))
+			return 0;
+	}
+
+	return dir_iter_next_used(&entry->it);
+}
+
+int ghostfs_next_entry(struct ghostfs *gfs, struct ghostfs_entry *entry)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_next_entry(gfs, entry);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+void ghostfs_closedir(struct ghostfs_entry *entry)
+{
+	free(entry);
+}
+
+// chain_clusters counts the clusters in the chain from nr, holes take none
+static int chain_clusters(struct ghostfs *gfs, int nr)
+{
+	int n = 0;
+
+	// a broken chain may loop
+	while (nr && nr < gfs->hdr.cluster_count && n < gfs->hdr.cluster_count) {
+		nr = gfs->headers[nr].next;
+		n++;
+	}
+
+	return n;
+}
+
+static void fill_stat(struct ghostfs *gfs, const struct dir_iter *it, ino_t ino,
+		      struct stat *stat)
+{
+	const struct dir_entry *entry = it->entry;
+	uint32_t mtime, ctime;
+	int clusters;
+
+	memset(stat, 0, sizeof(*stat));
+
+	stat->st_ino = ino;
+
+	if (dir_entry_is_directory(entry)) {
+		stat->st_mode |= S_IFDIR | S_IXUSR;
+		stat->st_size = CLUSTER_SIZE;
+	} else {
+		stat->st_mode |= S_IFREG;
+		stat->st_size = entry->size;
+	}
+
+	// user that mounted filesystem owns all files
+	stat->st_uid = gfs->uid;
+	stat->st_gid = gfs->gid;
+	stat->st_mode |= S_IRUSR | S_IWUSR;
+
+	// what the carrier holds for it, packed clusters count once and holes not at all
+	if (entry == &gfs->root_entry)
+		clusters = 1 + chain_clusters(gfs, gfs->headers[0].next);
+	else
+		clusters = chain_clusters(gfs, entry->cluster);
+	stat->st_blocks = clusters * (CLUSTER_SIZE / 512);
+
+	// access times are not kept
+	entry_times(gfs, it, &mtime, &ctime);
+	stat->st_mtime = mtime;
+	stat->st_ctime = ctime;
+	stat->st_atime = stat->st_mtime;
+
+	// only one hardlink
+	stat->st_nlink = 1;
+}
+
+// iter_ino returns the inode number of the entry at it
+static ino_t iter_ino(struct ghostfs *gfs, const struct dir_iter *it)
+{
+	ino_t ino;
+
+	if (it->entry == &gfs->root_entry)
+		return GHOSTFS_ROOT_INO;
+
+	pthread_mutex_lock(&gfs->inode_lock);
+	ino = loc_ino(gfs, entry_loc(it));
+	pthread_mutex_unlock(&gfs->inode_lock);
+
+	return ino;
+}
+
+static int do_getattr(struct ghostfs *gfs, const char *filename, struct stat *stat)
+{
+	struct dir_iter it;
+	int ret;
+
+	ret = dir_iter_lookup(gfs, &it, filename, false);
+	if (ret < 0)
+		return ret;
+
+	fill_stat(gfs, &it, iter_ino(gfs, &it), stat);
+
+	return 0;
+}
+
+int ghostfs_getattr(struct ghostfs *gfs, const char *filename, struct stat *stat)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_getattr(gfs, filename, stat);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+// lookup_iter takes a lookup reference on the entry at it and fills stat
+static int lookup_iter(struct ghostfs *gfs, const struct dir_iter *it, struct stat *stat)
+{
+	struct inode *inode;
+
+	pthread_mutex_lock(&gfs->inode_lock);
+	inode = inode_get(gfs, entry_loc(it));
+	if (inode)
+		inode->nlookup++;
+	pthread_mutex_unlock(&gfs->inode_lock);
+
+	if (!inode)
+		return -ENOMEM;
+
+	fill_stat(gfs, it, inode->ino, stat);
+
+	return 0;
+}
+
+int ghostfs_lookup(struct ghostfs *gfs, ino_t parent, const char *name, struct stat *stat)
+{
+	struct dir_iter dir, it;
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+
+	ret = ino_iter(gfs, parent, &dir);
+	if (ret < 0)
+		goto out;
+
+	ret = -ENOTDIR;
+	if (!dir_entry_is_directory(dir.entry))
+		goto out;
+
+	ret = dir_find(gfs, dir.entry->cluster, name, &it);
+	if (ret < 0)
+		goto out;
+
+	ret = lookup_iter(gfs, &it, stat);
+out:
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+void ghostfs_forget(struct ghostfs *gfs, ino_t ino, uint64_t nlookup)
+{
+	struct inode *inode;
+
+	pthread_mutex_lock(&gfs->inode_lock);
+
+	inode = inode_find(gfs, ino);
+	if (inode && inode != &gfs->root_inode) {
+		inode->nlookup -= MIN(nlookup, inode->nlookup);
+		inode_put(gfs, inode);
+	}
+
+	pthread_mutex_unlock(&gfs->inode_lock);
+}
+
+int ghostfs_getattr_ino(struct ghostfs *gfs, ino_t ino, struct stat *stat)
+{
+	struct dir_iter it;
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = ino_iter(gfs, ino, &it);
+	if (ret == 0)
+		fill_stat(gfs, &it, ino, stat);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_truncate_ino(struct ghostfs *gfs, ino_t ino, off_t new_size)
+{
+	struct dir_iter it;
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = ino_iter(gfs, ino, &it);
+	if (ret == 0)
+		ret = do_truncate(gfs, &it, new_size, new_size, NULL);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_utime_ino(struct ghostfs *gfs, ino_t ino, time_t mtime)
+{
+	struct dir_iter it;
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+
+	ret = ino_iter(gfs, ino, &it);
+	if (ret == 0)
+		ret = entry_set_times(gfs, &it, mtime, time(NULL));
+
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int create_at(struct ghostfs *gfs, ino_t parent, const char *name, bool is_dir,
+		     struct stat *stat)
+{
+	struct dir_iter dir, it;
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+
+	ret = ino_iter(gfs, parent, &dir);
+	if (ret < 0)
+		goto out;
+
+	ret = create_in(gfs, &dir, name, is_dir, &it);
+	if (ret < 0)
+		goto out;
+
+	ret = lookup_iter(gfs, &it, stat);
+out:
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_create_at(struct ghostfs *gfs, ino_t parent, const char *name, struct stat *stat)
+{
+	return create_at(gfs, parent, name, false, stat);
+}
+
+int ghostfs_mkdir_at(struct ghostfs *gfs, ino_t parent, const char *name, struct stat *stat)
+{
+	return create_at(gfs, parent, name, true, stat);
+}
+
+static int remove_at(struct ghostfs *gfs, ino_t parent, const char *name, bool is_dir)
+{
+	struct dir_iter dir;
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+	ret = ino_iter(gfs, parent, &dir);
+	if (ret == 0)
+		ret = remove_in(gfs, &dir, name, is_dir);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_unlink_at(struct ghostfs *gfs, ino_t parent, const char *name)
+{
+	return remove_at(gfs, parent, name, false);
+}
+
+int ghostfs_rmdir_at(struct ghostfs *gfs, ino_t parent, const char *name)
+{
+	return remove_at(gfs, parent, name, true);
+}
+
+int ghostfs_rename_at(struct ghostfs *gfs, ino_t parent, const char *name,
+		      ino_t newparent, const char *newname)
+{
+	struct dir_iter dir, newdir;
+	int ret;
+
+	pthread_rwlock_wrlock(&gfs->lock);
+
+	ret = ino_iter(gfs, parent, &dir);
+	if (ret < 0)
+		goto out;
+
+	ret = ino_iter(gfs, newparent, &newdir);
+	if (ret < 0)
+		goto out;
+
+	ret = rename_in(gfs, &dir, name, &newdir, newname);
+out:
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_open_ino(struct ghostfs *gfs, ino_t ino, int flags, struct ghostfs_entry **pentry)
+{
+	struct inode *inode;
+	struct dir_iter it;
+	int ret = -ENOENT;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+
+	pthread_mutex_lock(&gfs->inode_lock);
+	inode = inode_find(gfs, ino);
+	if (inode)
+		ret = inode_iter(gfs, inode, &it);
+	pthread_mutex_unlock(&gfs->inode_lock);
+
+	if (ret == 0) {
+		if (dir_entry_is_directory(it.entry))
+			ret = -EISDIR;
+		else
+			ret = open_iter(gfs, &it, inode, pentry);
+	}
+
+	if (ret == 0)
+		(*pentry)->flags = flags;
+
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+/*
+ * Directory offsets are entry positions in the cluster chain plus one, so a
+ * listing resumes where it stopped even if entries were added or removed in
+ * the meantime, and each batch costs a single pass over its clusters.
+ */
+static int do_readdir(struct ghostfs *gfs, ino_t ino, off_t off,
+		      struct ghostfs_dirent *ents, int count, int flags)
+{
+	struct inode *inode;
+	struct dir_iter dir, it;
+	ino_t entry_ino = 0;
+	int ret, nr, i;
+	int n = 0;
+
+	ret = ino_iter(gfs, ino, &dir);
+	if (ret < 0)
+		return ret;
+
+	if (!dir_entry_is_directory(dir.entry))
+		return -ENOTDIR;
+
+	if (off < 0)
+		return -EINVAL;
+
+	// directories have at least one cluster, the root one is cluster 0
+	nr = dir.entry->cluster;
+	for (i = 0; i < off / CLUSTER_DIRENTS; i++) {
+		nr = dir_next(gfs, nr);
+		if (!nr)
+			return 0;
+	}
+
+	ret = dir_iter_init(gfs, &it, nr);
+	if (ret < 0)
+		return ret;
+
+	it.entry_nr = off % CLUSTER_DIRENTS;
+	it.entry += it.entry_nr;
+
+	while (n < count) {
+		if (dir_entry_used(it.entry)) {
+			pthread_mutex_lock(&gfs->inode_lock);
+			if (flags & GHOSTFS_READDIR_LOOKUP) {
+				inode = inode_get(gfs, entry_loc(&it));
+				if (inode) {
+					inode->nlookup++;
+					entry_ino = inode->ino;
+				}
+			} else {
+				inode = NULL;
+				entry_ino = loc_ino(gfs, entry_loc(&it));
+			}
+			pthread_mutex_unlock(&gfs->inode_lock);
+
+			if ((flags & GHOSTFS_READDIR_LOOKUP) && !inode)
+				return n ? n : -ENOMEM;
+
+			memcpy(ents[n].name, it.entry->filename, FILENAME_SIZE);
+			ents[n].name[FILENAME_SIZE - 1] = '\0';
+			fill_stat(gfs, &it, entry_ino, &ents[n].stat);
+			ents[n].off = off + 1;
+			n++;
+		}
+
+		ret = dir_iter_next(&it);
+		if (ret < 0)
+			return n || ret == -ENOENT ? n : ret;
+		off++;
+	}
+
+	return n;
+}
+
+int ghostfs_readdir(struct ghostfs *gfs, ino_t ino, off_t off,
+		    struct ghostfs_dirent *ents, int count, int flags)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = do_readdir(gfs, ino, off, ents, count, flags);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+int ghostfs_statvfs(struct ghostfs *gfs, struct statvfs *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+
+	pthread_rwlock_rdlock(&gfs->lock);
+
+	stat->f_bsize = CLUSTER_SIZE;
+	stat->f_frsize = CLUSTER_SIZE;
+	// the checksum table is not room for files
+	stat->f_blocks = gfs->sums_start ? gfs->sums_start : gfs->hdr.cluster_count;
+	stat->f_bfree = gfs->free_clusters;
+	stat->f_bavail = stat->f_bfree;
+
+	pthread_rwlock_unlock(&gfs->lock);
+
+	stat->f_files = 0; // FIXME: keep track of how many files we have
+	stat->f_ffree = 0; // FIXME: ?
+	stat->f_namemax = FILENAME_MAX_LEN;
+
+	return 0;
+}
+
+/*
+ * cache_fill decodes cluster nr into the cache, unless it is there already.
+ * Without decode the data is zeroed instead and the header taken from the
+ * header table, for clusters that are about to be overwritten in full.
+ *
+ * With GHOSTFS_REPAIR, a sealed cluster in use that fails authentication is
+ * zeroed the same way, and dirtied so that it is sealed again.
+ */
+static int cache_fill(struct ghostfs *gfs, int nr, struct cluster **pcluster, bool decode)
+{
+	pthread_mutex_t *lock = &gfs->cache_lock[nr % CACHE_STRIPES];
+	struct cached_cluster *cc;
+	bool repaired = false;
+	int ret = 0;
+
+	pthread_mutex_lock(lock);
+
+	if (!gfs->clusters[nr]) {
+		cc = malloc(sizeof(*cc));
+		if (!cc) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		if (decode) {
+			// readahead fills the cache without lock, packed may be changing
+			bool packed = __atomic_load_n(&gfs->packed[nr], __ATOMIC_RELAXED);
+
+			if (packed)
+				ret = read_packed(gfs, &cc->c, nr);
+			else
+				ret = read_cluster(gfs, &cc->c, nr);
+			if (ret == 0)
+				ret = check_cluster(gfs, nr, &cc->c, packed);
+			if (ret == -EBADMSG && gfs->repair &&
+			    __atomic_load_n(&gfs->headers[nr].used, __ATOMIC_RELAXED)) {
+				warnx("fs: cluster %d zeroed", nr);
+				decode = false;
+				repaired = true;
+				ret = 0;
+			}
+			if (ret < 0) {
+				free(cc);
+				ret = ret == -EBADMSG ? -EIO : ret;
+				goto out;
+			}
+		}
+
+		if (!decode) {
+			memset(cc->c.data, 0, sizeof(cc->c.data));
+			cc->c.hdr = gfs->headers[nr];
+			cc->c.hdr.dirty = 0;
+		}
+
+		cc->nr = nr;
+		cc->fresh = false;
+		cc->pack = false;
+		cc->written = false;
+		cc->seq = 0;
+		cc->copied_from = 0;
+		cc->unpacked = NULL;
+		cc->hashed = false;
+		__atomic_store_n(&gfs->clusters[nr], &cc->c, __ATOMIC_RELEASE);
+
+		// packed data or links are lost, what is left is a plain cluster of zeros
+		if (repaired) {
+			__atomic_store_n(&gfs->packed[nr], 0, __ATOMIC_RELAXED);
+			gfs->cluster_flags[nr] &= ~CLUSTER_LINKS;
+			mark_cluster(gfs, &cc->c);
+		}
+	}
+
+	if (pcluster)
+		*pcluster = gfs->clusters[nr];
+out:
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+static int cluster_get(struct ghostfs *gfs, int nr, struct cluster **pcluster)
+{
+	if (nr >= gfs->hdr.cluster_count) {
+		warnx("fs: invalid cluster number %d", nr);
+		return -ERANGE;
+	}
+
+	*pcluster = cache_peek(gfs, nr);
+	if (*pcluster)
+		return 0;
+
+	return cache_fill(gfs, nr, pcluster, true);
+}
+
+// cluster_get_overwrite is cluster_get for callers that replace all the data
+static int cluster_get_overwrite(struct ghostfs *gfs, int nr, struct cluster **pcluster)
+{
+	if (nr >= gfs->hdr.cluster_count) {
+		warnx("fs: invalid cluster number %d", nr);
+		return -ERANGE;
+	}
+
+	*pcluster = cache_peek(gfs, nr);
+	if (*pcluster)
+		return 0;
+
+	return cache_fill(gfs, nr, pcluster, false);
+}
+
+// clusters of sealed filesystems are, but for those of the checksum table
+static inline bool cluster_sealed(struct ghostfs *gfs, int nr)
+{
+	return gfs->seals && nr < gfs->sums_start;
+}
+
+/*
+ * seal_data seals the first size bytes of cluster nr under the next
+ * generation, along with hdr, the header it is written with, so that
+ * neither can be changed nor the cluster moved to another chain. The table
+ * keeps the generation and the tag, and the previous ones.
+ */
+static int seal_data(struct ghostfs *gfs, const void *data, size_t size, int nr,
+		     const struct cluster_header *hdr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	struct cluster_seal *seal = &gfs->seals[nr];
+	unsigned char tag[STEGGER_TAG_SIZE];
+	uint64_t gen;
+	int ret;
+
+	gen = __atomic_fetch_add(&gfs->gen, 1, __ATOMIC_RELAXED);
+	if (gen >= gfs->gen_limit) {
+		warnx("fs: out of cluster generations, remount");
+		return -EIO;
+	}
+
+	ret = stegger_seal(gfs->stegger, data, size, c0_offset + nr*CLUSTER_SIZE, gen,
+			   hdr, sizeof(*hdr), tag);
+	if (ret < 0)
+		return ret;
+
+	seal->prev_gen = seal->gen;
+	memcpy(seal->prev_tag, seal->tag, STEGGER_TAG_SIZE);
+	seal->gen = gen;
+	memcpy(seal->tag, tag, STEGGER_TAG_SIZE);
+
+	return 0;
+}
+
+/*
+ * unseal_data decodes what seal_data sealed into cluster nr, hdr being the
+ * header read along. Only the used part of a packed cluster is sealed, its
+ * size is decoded first.
+ *
+ * The table is written before the clusters are synced, see sync_range_end,
+ * so after a crash it may be newer than a cluster: the previous generation
+ * is tried too. The kernel writes mmap'ed pages back in no particular order
+ * though, and a cluster newer than the table matches neither; it fails with
+ * -EBADMSG until the filesystem is mounted with GHOSTFS_REPAIR, as does one
+ * never sealed: generation 0 is not used.
+ */
+static int unseal_data(struct ghostfs *gfs, void *data, int nr, const struct cluster_header *hdr,
+		       bool packed)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	const size_t offset = c0_offset + nr*CLUSTER_SIZE;
+	const struct cluster_seal *seal = &gfs->seals[nr];
+	const uint64_t gens[2] = { seal->gen, seal->prev_gen };
+	const unsigned char *tags[2] = { seal->tag, seal->prev_tag };
+	const struct packed_data *p = data;
+	size_t size = CLUSTER_DATA;
+	int i, ret;
+
+	for (i = 0; i < 2; i++) {
+		if (!gens[i])
+			continue;
+
+		// the size is checked with the rest, it may be garbage until then
+		if (packed) {
+			ret = stegger_unseal(gfs->stegger, data, offsetof(struct packed_data, data),
+					     offset, gens[i], NULL, 0, NULL);
+			if (ret < 0)
+				return ret;
+			if (p->size > sizeof(p->data))
+				continue;
+			size = offsetof(struct packed_data, data) + p->size;
+		}
+
+		ret = stegger_unseal(gfs->stegger, data, size, offset, gens[i], hdr, sizeof(*hdr),
+				     tags[i]);
+		if (ret != -EBADMSG)
+			return ret;
+	}
+
+	// free clusters hold leftovers, readahead may get to one as it is freed
+	if (!gfs->headers || __atomic_load_n(&gfs->headers[nr].used, __ATOMIC_RELAXED))
+		warnx("fs: cluster %d fails authentication", nr);
+
+	return -EBADMSG;
+}
+
+static int write_cluster(struct ghostfs *gfs, struct cluster *cluster, int nr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	int ret;
+
+	if (!cluster_sealed(gfs, nr))
+		return stegger_write(gfs->stegger, cluster, CLUSTER_SIZE, c0_offset + nr*CLUSTER_SIZE);
+
+	ret = seal_data(gfs, cluster->data, CLUSTER_DATA, nr, &cluster->hdr);
+	if (ret < 0)
+		return ret;
+
+	return write_cluster_header(gfs, &cluster->hdr, nr);
+}
+
+// write_packed encodes the used part of a packed cluster and its header
+static int write_packed(struct ghostfs *gfs, struct cluster *cluster, int nr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	const struct packed_data *p = (const void *)cluster->data;
+	struct cluster_header hdr = cluster->hdr;
+	int ret;
+
+	hdr.dirty = cluster_mark(gfs, nr);
+
+	if (cluster_sealed(gfs, nr))
+		ret = seal_data(gfs, p, offsetof(struct packed_data, data) + p->size, nr, &hdr);
+	else
+		ret = stegger_write(gfs->stegger, p, offsetof(struct packed_data, data) + p->size,
+				    c0_offset + nr*CLUSTER_SIZE);
+	if (ret < 0)
+		return ret;
+
+	return write_cluster_header(gfs, &hdr, nr);
+}
+
+static int write_cluster_header(struct ghostfs *gfs, const struct cluster_header *hdr, int nr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+
+	return stegger_write(gfs->stegger, hdr, sizeof(*hdr),
+			     c0_offset + nr*CLUSTER_SIZE + offsetof(struct cluster, hdr));
+}
+
+static int read_cluster_header(struct ghostfs *gfs, struct cluster_header *hdr, int nr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	int ret;
+
+	ret = stegger_read(gfs->stegger, hdr, sizeof(*hdr),
+			   c0_offset + nr*CLUSTER_SIZE + offsetof(struct cluster, hdr));
+	if (ret < 0)
+		return ret;
+
+	// the dirty byte may hold PACKED_MARK, see ghostfs_mount
+	return 0;
+}
+
+// read_cluster decodes cluster nr, sealed ones that fail authentication with -EBADMSG
+static int read_cluster(struct ghostfs *gfs, struct cluster *cluster, int nr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	int ret;
+
+	if (cluster_sealed(gfs, nr)) {
+		ret = read_cluster_header(gfs, &cluster->hdr, nr);
+		if (ret == 0)
+			ret = unseal_data(gfs, cluster->data, nr, &cluster->hdr, false);
+	} else {
+		ret = stegger_read(gfs->stegger, cluster, CLUSTER_SIZE, c0_offset + nr*CLUSTER_SIZE);
+	}
+	if (ret < 0)
+		return ret;
+
+	cluster->hdr.dirty = 0;
+	return 0;
+}
+
+/*
+ * read_cluster_locked is read_cluster for callers that decode a cluster
+ * outside of the cache, under its cache lock all the same: flush_headers
+ * may be writing its header meanwhile, see reseal_header.
+ */
+static int read_cluster_locked(struct ghostfs *gfs, struct cluster *cluster, int nr)
+{
+	pthread_mutex_t *lock = &gfs->cache_lock[nr % CACHE_STRIPES];
+	int ret;
+
+	pthread_mutex_lock(lock);
+	ret = read_cluster(gfs, cluster, nr);
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+// read_packed decodes the used part of packed cluster nr, the header comes from the table
+static int read_packed(struct ghostfs *gfs, struct cluster *cluster, int nr)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	struct packed_data *p = (void *)cluster->data;
+	struct cluster_header hdr;
+	int ret;
+
+	if (cluster_sealed(gfs, nr)) {
+		ret = read_cluster_header(gfs, &hdr, nr);
+		if (ret == 0)
+			ret = unseal_data(gfs, p, nr, &hdr, true);
+		if (ret < 0)
+			return ret;
+	} else {
+		ret = stegger_read(gfs->stegger, p, offsetof(struct packed_data, data),
+				   c0_offset + nr*CLUSTER_SIZE);
+		if (ret < 0)
+			return ret;
+
+		if (p->size > sizeof(p->data)) {
+			warnx("fs: corrupt packed cluster %d", nr);
+			return -EIO;
+		}
+
+		ret = stegger_read(gfs->stegger, p->data, p->size,
+				   c0_offset + nr*CLUSTER_SIZE + offsetof(struct packed_data, data));
+		if (ret < 0)
+			return ret;
+	}
+
+	memset(p->data + p->size, 0, sizeof(p->data) - p->size);
+	cluster->hdr = gfs->headers[nr];
+	cluster->hdr.dirty = 0;
+	return 0;
+}
+
+// header_sum covers next and used, the dirty byte only holds marks, see cluster_mark
+static uint32_t header_sum(const struct cluster_header *hdr)
+{
+	return crc32c(0, hdr, offsetof(struct cluster_header, dirty));
+}
+
+/*
+ * cluster_sum returns the CRC32C of the part of c that gets encoded, see
+ * write_packed, xored with the one of its header. Headers are also written
+ * alone, see flush_headers, which swaps the part of the old one for the new.
+ */
+static uint32_t cluster_sum(const struct cluster *c, bool packed)
+{
+	const struct packed_data *p = (const void *)c->data;
+
+	if (packed)
+		return crc32c(0, p, offsetof(struct packed_data, data) + p->size) ^ header_sum(&c->hdr);
+
+	return crc32c(0, c->data, CLUSTER_DATA) ^ header_sum(&c->hdr);
+}
+
+/*
+ * check_cluster verifies cluster nr, just decoded into c, against its
+ * checksum. Only the first decode is checked, clusters encoded since are
+ * known to match.
+ *
+ * The checksums of the clusters a flush writes are in the carrier before it
+ * is msync'ed, see sync_range_end, but the kernel writes mmap'ed pages back
+ * whenever it sees fit, in no particular order. After a crash a cluster may
+ * be newer or older than its checksum, and fails to read until the
+ * filesystem is mounted with GHOSTFS_REPAIR, which takes it as it is.
+ */
+static int check_cluster(struct ghostfs *gfs, int nr, const struct cluster *c, bool packed)
+{
+	struct cluster_header hdr = c->hdr;
+	uint32_t sum;
+	int ret;
+
+	if (!gfs->sums || __atomic_load_n(&gfs->checked[nr], __ATOMIC_RELAXED))
+		return 0;
+
+	// free clusters hold leftovers, readahead may get to one as it is freed
+	if (!__atomic_load_n(&gfs->headers[nr].used, __ATOMIC_RELAXED))
+		return 0;
+
+	// read_packed takes the header from the table, the one in the carrier is checked
+	if (packed) {
+		ret = read_cluster_header(gfs, &hdr, nr);
+		if (ret < 0)
+			return ret;
+	}
+
+	sum = cluster_sum(c, packed) ^ header_sum(&c->hdr) ^ header_sum(&hdr);
+	if (sum != gfs->sums[nr]) {
+		warnx("fs: checksum mismatch in cluster %d", nr);
+		if (!gfs->repair)
+			return -EIO;
+
+		pthread_mutex_lock(&gfs->dirty_lock);
+		gfs->sums[nr] = sum;
+		sums_changed(gfs, nr);
+		pthread_mutex_unlock(&gfs->dirty_lock);
+	}
+
+	__atomic_store_n(&gfs->checked[nr], 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static inline int sums_per_cluster(struct ghostfs *gfs)
+{
+	return gfs->stegger->seal ? SEALED_PER_CLUSTER : SUMS_PER_CLUSTER;
+}
+
+static inline int sums_clusters(struct ghostfs *gfs, int count)
+{
+	return (count + sums_per_cluster(gfs) - 1) / sums_per_cluster(gfs);
+}
+
+// sums_pack fills c with cluster k of the checksum table
+static void sums_pack(struct ghostfs *gfs, int k, struct cluster *c)
+{
+	struct sealed_sum *e = (void *)c->data;
+	int first = k * sums_per_cluster(gfs);
+	int i, n = MIN(sums_per_cluster(gfs), gfs->hdr.cluster_count - first);
+
+	memset(c->data, 0, CLUSTER_DATA);
+
+	if (!gfs->seals) {
+		memcpy(c->data, gfs->sums + first, n * sizeof(*gfs->sums));
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		e[i].sum = gfs->sums[first + i];
+		e[i].gen = gfs->seals[first + i].gen;
+		memcpy(e[i].tag, gfs->seals[first + i].tag, STEGGER_TAG_SIZE);
+		e[i].prev_gen = gfs->seals[first + i].prev_gen;
+		memcpy(e[i].prev_tag, gfs->seals[first + i].prev_tag, STEGGER_TAG_SIZE);
+	}
+}
+
+static void sums_unpack(struct ghostfs *gfs, int k, const struct cluster *c)
+{
+	const struct sealed_sum *e = (const void *)c->data;
+	int first = k * sums_per_cluster(gfs);
+	int i, n = MIN(sums_per_cluster(gfs), gfs->hdr.cluster_count - first);
+
+	if (!gfs->seals) {
+		memcpy(gfs->sums + first, c->data, n * sizeof(*gfs->sums));
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		gfs->sums[first + i] = e[i].sum;
+		gfs->seals[first + i].gen = e[i].gen;
+		memcpy(gfs->seals[first + i].tag, e[i].tag, STEGGER_TAG_SIZE);
+		gfs->seals[first + i].prev_gen = e[i].prev_gen;
+		memcpy(gfs->seals[first + i].prev_tag, e[i].prev_tag, STEGGER_TAG_SIZE);
+	}
+}
+
+static uint32_t super_sum(const struct ghostfs_super *super, const struct ghostfs_header *hdr,
+			  const struct cluster *cluster0)
+{
+	uint32_t crc;
+
+	crc = crc32c(0, &super->magic, sizeof(*super) - offsetof(struct ghostfs_super, magic));
+	crc = crc32c(crc, hdr, sizeof(*hdr));
+
+	return crc32c(crc, cluster0, sizeof(*cluster0));
+}
+
+static int load_sums(struct ghostfs *gfs);
+
+static int ghostfs_check(struct ghostfs *gfs)
+{
+	struct ghostfs_super super;
+	MD5_CTX md5_ctx;
+	unsigned char md5[16];
+	struct cluster root;
+	int ret;
+
+	ret = stegger_read(gfs->stegger, &super, sizeof(super), 0);
+	if (ret < 0)
+		return ret;
+
+	ret = stegger_read(gfs->stegger, &gfs->hdr, sizeof(struct ghostfs_header), 16);
+	if (ret < 0)
+		return ret;
+
+	// a carrier without a filesystem, or read with the wrong key, holds garbage
+	if (16 + sizeof(gfs->hdr) + (size_t)gfs->hdr.cluster_count * CLUSTER_SIZE >
+	    (size_t)gfs->stegger->capacity)
+		return -EIO;
+
+	// the table comes first, the root directory may be sealed
+	if (super.magic == SUPER_MAGIC) {
+		if (super.sums + sums_clusters(gfs, gfs->hdr.cluster_count) != gfs->hdr.cluster_count) {
+			warnx("fs: bad checksum table at cluster %d", super.sums);
+			return -EIO;
+		}
+
+		gfs->sums_start = super.sums;
+
+		ret = load_sums(gfs);
+		if (ret < 0)
+			return ret;
+	}
+
+	// the superblock covers the header as written, dirty byte included
+	ret = read_cluster(gfs, &root, 0);
+	if (ret == 0)
+		ret = read_cluster_header(gfs, &root.hdr, 0);
+	if (ret < 0)
+		return ret == -EBADMSG ? -EIO : ret;
+
+	if (super.magic == SUPER_MAGIC) {
+		if (super.crc == super_sum(&super, &gfs->hdr, &root))
+			return 0;
+
+		// the root directory is written again, see ghostfs_mount
+		warnx("fs: superblock checksum mismatch");
+		return gfs->repair ? 0 : -EIO;
+	}
+
+	MD5_Init(&md5_ctx);
+	MD5_Update(&md5_ctx, &gfs->hdr, sizeof(gfs->hdr));
+	MD5_Update(&md5_ctx, &root, sizeof(root));
+	MD5_Final(md5, &md5_ctx);
+
+	if (memcmp(md5, &super, 16) == 0) {
+		return 0;
+	}
+
+	return -EIO;
+}
+
+static int write_header(struct ghostfs *gfs, struct cluster *cluster0)
+{
+	struct ghostfs_super super = { 0, SUPER_MAGIC, gfs->sums_start };
+	MD5_CTX md5_ctx;
+	int ret;
+
+	if (gfs->sums_start) {
+		super.crc = super_sum(&super, &gfs->hdr, cluster0);
+	} else {
+		MD5_Init(&md5_ctx);
+		MD5_Update(&md5_ctx, &gfs->hdr, sizeof(gfs->hdr));
+		MD5_Update(&md5_ctx, cluster0, sizeof(*cluster0));
+		MD5_Final((unsigned char *)&super, &md5_ctx);
+	}
+
+	// write the superblock, or md5 of header+root
+	ret = stegger_write(gfs->stegger, &super, sizeof(super), 0);
+	if (ret < 0)
+		return ret;
+
+	// write header
+	ret = stegger_write(gfs->stegger, &gfs->hdr, sizeof(gfs->hdr), 16);
+	if (ret < 0)
+		return ret;
+
+	// write first cluster
+	ret = write_cluster(gfs, cluster0, 0);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+// create a new filesystem
+int ghostfs_format(struct stegger *stegger)
+{
+	struct ghostfs gfs;
+	size_t count;
+	struct cluster cluster;
+	int ret, i, k, sums;
+	const int HEADER_SIZE = 16 + sizeof(struct ghostfs_header);
+
+	memset(&gfs, 0, sizeof(gfs));
+	gfs.stegger = stegger;
+
+	if (gfs.stegger->capacity < HEADER_SIZE + CLUSTER_SIZE)
+		return -ENOSPC;
+
+	count = (gfs.stegger->capacity - HEADER_SIZE) / CLUSTER_SIZE;
+	if (count > 0xFFFF) {
+		warnx("fs: %lu clusters available, using only %d", count, 0xFFFF);
+		count = 0xFFFF;
+	}
+
+	gfs.hdr.cluster_count = count;
+
+	// the checksum table takes the last clusters, tiny carriers go without
+	sums = sums_clusters(&gfs, count);
+	gfs.sums_start = count > sums + 1 ? count - sums : 0;
+
+	ret = read_cluster(&gfs, &cluster, 0);
+	if (ret < 0)
+		return ret;
+
+	if (gfs.sums_start) {
+		gfs.sums = calloc(count, sizeof(*gfs.sums));
+		if (stegger->seal)
+			gfs.seals = calloc(count, sizeof(*gfs.seals));
+		if (!gfs.sums || (stegger->seal && !gfs.seals)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		// generation 0 is never sealed with, see unseal_data
+		gfs.gen = 1;
+		gfs.gen_limit = SEAL_RESERVE;
+	}
+
+	cluster.hdr.next = 0;
+
+	for (i = 0; i < CLUSTER_DATA; i += sizeof(struct dir_entry)) {
+		struct dir_entry *e = (struct dir_entry *)&cluster.data[i];
+		e->filename[0] = '\0';
+	}
+
+	ret = write_header(&gfs, &cluster);
+	if (ret < 0)
+		goto out;
+
+	if (gfs.seals) {
+		gfs.seals[gfs.sums_start].gen = gfs.gen;
+		ret = reserve_tag(&gfs, gfs.gen, gfs.seals[gfs.sums_start].tag);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (k = 0; gfs.sums_start && k < sums; k++) {
+		i = gfs.sums_start + k;
+
+		sums_pack(&gfs, k, &cluster);
+		cluster.hdr.next = i + 1 < count ? i + 1 : 0;
+		cluster.hdr.used = 1;
+		cluster.hdr.dirty = 0;
+
+		ret = write_cluster(&gfs, &cluster, i);
+		if (ret < 0)
+			goto out;
+	}
+
+	// free clusters are told apart by their header alone, leave the data as is
+	memset(&cluster.hdr, 0, sizeof(cluster.hdr));
+
+	for (i = 1; i < (gfs.sums_start ? gfs.sums_start : count); i++) {
+		ret = write_cluster_header(&gfs, &cluster.hdr, i);
+		if (ret < 0)
+			goto out;
+	}
+
+out:
+	free(gfs.sums);
+	free(gfs.seals);
+
+	return ret;
+}
+
+static int print_dir_entries(struct ghostfs *gfs, int cluster_nr, const char *parent)
+{
+	struct dir_iter it;
+	char buf[256] = "";
+	int ret;
+
+	ret = dir_iter_init(gfs, &it, cluster_nr);
+	if (ret < 0)
+		return ret;
+
+	do {
+		if (dir_entry_used(it.entry)) {
+			snprintf(buf, sizeof(buf), "%s/%s", parent, it.entry->filename);
+			printf("%s", buf);
+			if (dir_entry_is_directory(it.entry)) {
+				printf("/\n");
+				ret = print_dir_entries(gfs, it.entry->cluster, buf);
+				if (ret < 0)
+					return ret;
+			} else {
+				printf(" {%d}\n", it.entry->size);
+			}
+		}
+	} while ((ret = dir_iter_next_used(&it)) == 0);
+
+	if (ret != -ENOENT)
+		return ret;
+
+	return 0;
+}
+
+int ghostfs_debug(struct ghostfs *gfs)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	ret = print_dir_entries(gfs, 0, "");
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+// count_links counts the links to every cluster and frees orphans nothing links to
+static int count_links(struct ghostfs *gfs)
+{
+	uint16_t targets[PACK_MAX];
+	int nr, target, i, ret;
+
+	for (nr = 1; nr < gfs->hdr.cluster_count; nr++) {
+		if (!(gfs->cluster_flags[nr] & CLUSTER_LINKS))
+			continue;
+
+		ret = link_targets(gfs, nr, targets);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < gfs->packed[nr]; i++) {
+			target = targets[i];
+			if (!target || target >= gfs->hdr.cluster_count || gfs->packed[target] ||
+			    (gfs->sums_start && target >= gfs->sums_start)) {
+				warnx("fs: corrupt linked cluster %d", nr);
+				return -EIO;
+			}
+
+			// freed on the carrier before the links were gone from it, take it back
+			if (!gfs->headers[target].used) {
+				gfs->headers[target].used = 1;
+				gfs->headers[target].next = 0;
+				gfs->cluster_flags[target] = CLUSTER_ORPHAN;
+				gfs->free_clusters--;
+				header_changed(gfs, target, 0);
+			}
+
+			gfs->refs[target]++;
+		}
+
+		gfs->linked_count += gfs->packed[nr];
+		gfs->links_count++;
+	}
+
+	for (nr = 1; nr < gfs->hdr.cluster_count; nr++) {
+		if (!(gfs->cluster_flags[nr] & CLUSTER_ORPHAN) || gfs->refs[nr])
+			continue;
+
+		gfs->cluster_flags[nr] = 0;
+		ret = free_clusters(gfs, nr);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+// load_sums reads the checksum table, cluster 0 is checked along with the superblock
+static int load_sums(struct ghostfs *gfs)
+{
+	int count = gfs->hdr.cluster_count;
+	struct cluster c;
+	int k, ret;
+
+	if (!gfs->sums_start)
+		return 0;
+
+	gfs->sums = calloc(count, sizeof(*gfs->sums));
+	gfs->checked = calloc(1, count);
+	gfs->sums_dirty = calloc(1, sums_clusters(gfs, count));
+	if (gfs->stegger->seal)
+		gfs->seals = calloc(count, sizeof(*gfs->seals));
+	if (!gfs->sums || !gfs->checked || !gfs->sums_dirty || (gfs->stegger->seal && !gfs->seals))
+		return -ENOMEM;
+
+	for (k = 0; k < sums_clusters(gfs, count); k++) {
+		ret = read_cluster(gfs, &c, gfs->sums_start + k);
+		if (ret < 0)
+			return ret;
+
+		sums_unpack(gfs, k, &c);
+	}
+
+	gfs->checked[0] = 1;
+
+	return 0;
+}
+
+/*
+ * check_all decodes every cluster in use, for GHOSTFS_REPAIR: the ones that
+ * do not match their checksum or fail authentication are reported, and
+ * fixed by the next sync, see check_cluster and cache_fill.
+ */
+static int check_all(struct ghostfs *gfs)
+{
+	struct cluster *c;
+	int nr, ret;
+
+	for (nr = 1; nr < gfs->sums_start; nr++) {
+		if (!gfs->headers[nr].used || cache_peek(gfs, nr))
+			continue;
+
+		// the ones that cannot be fixed are left as they are
+		ret = cluster_get(gfs, nr, &c);
+		if (ret == -EIO)
+			continue;
+		if (ret < 0)
+			return ret;
+
+		// repaired clusters are dirty, they stay until written
+		cache_drop(gfs, c);
+	}
+
+	return 0;
+}
+
+int ghostfs_mount(struct ghostfs **pgfs, struct stegger *stegger, int flags)
+{
+	struct ghostfs *gfs;
+	struct cluster *root;
+	pthread_rwlockattr_t attr;
+	int i, ret;
+
+	gfs = calloc(1, sizeof(*gfs));
+	if (!gfs)
+		return -ENOMEM;
+
+	gfs->stegger = stegger;
+	gfs->repair = flags & GHOSTFS_REPAIR;
+	gfs->root_entry.size = 0x80000000;
+	gfs->root_inode.ino = GHOSTFS_ROOT_INO;
+	gfs->root_inode.loc = LOC_NONE;
+	// numbers past every location, for entries whose number is taken
+	gfs->next_ino = (ino_t)0x10000 * CLUSTER_DIRENTS + 2;
+
+	// prefer writers, so a stream of reads cannot starve them
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&gfs->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	for (i = 0; i < CACHE_STRIPES; i++)
+		pthread_mutex_init(&gfs->cache_lock[i], NULL);
+	pthread_mutex_init(&gfs->dirty_lock, NULL);
+	pthread_mutex_init(&gfs->readahead_lock, NULL);
+	pthread_mutex_init(&gfs->inode_lock, NULL);
+	pthread_mutex_init(&gfs->root_inode.write_lock, NULL);
+	pthread_cond_init(&gfs->writeback_cond, NULL);
+	pthread_cond_init(&gfs->readahead_cond, NULL);
+
+	ret = ghostfs_check(gfs);
+	if (ret < 0) {
+		ghostfs_free(gfs);
+		return ret;
+	}
+
+	gfs->clusters = calloc(1, sizeof(struct cluster *) * gfs->hdr.cluster_count);
+	gfs->headers = calloc(1, sizeof(struct cluster_header) * gfs->hdr.cluster_count);
+	gfs->packed = calloc(1, gfs->hdr.cluster_count);
+	gfs->cluster_flags = calloc(1, gfs->hdr.cluster_count);
+	gfs->refs = calloc(gfs->hdr.cluster_count, sizeof(*gfs->refs));
+	if (!gfs->clusters || !gfs->headers || !gfs->packed || !gfs->cluster_flags || !gfs->refs) {
+		ghostfs_free(gfs);
+		return -ENOMEM;
+	}
+
+	gfs->uid = getuid();
+	gfs->gid = getgid();
+	time(&gfs->mount_time);
+
+	// load the header table and count free clusters, cluster data is decoded on demand
+	stegger_advise(stegger, (size_t)gfs->hdr.cluster_count * CLUSTER_SIZE, 0, MADV_SEQUENTIAL);
+
+	for (i = 0; i < gfs->hdr.cluster_count; i++) {
+		ret = read_cluster_header(gfs, &gfs->headers[i], i);
+		if (ret < 0) {
+			ghostfs_free(gfs);
+			return ret;
+		}
+
+		if (i && gfs->headers[i].used && (gfs->headers[i].dirty & PACKED_MARK)) {
+			gfs->packed[i] = MIN(gfs->headers[i].dirty & MARK_COUNT, PACK_MAX);
+			if ((gfs->headers[i].dirty & LINKS_MARK) == LINKS_MARK)
+				gfs->cluster_flags[i] = CLUSTER_LINKS;
+		} else if (i && gfs->headers[i].used && gfs->headers[i].dirty == ORPHAN_MARK) {
+			gfs->cluster_flags[i] = CLUSTER_ORPHAN;
+		} else if (i && gfs->headers[i].used && gfs->headers[i].dirty == TIMES_MARK) {
+			gfs->cluster_flags[i] = CLUSTER_TIMES;
+		}
+		gfs->headers[i].dirty = 0;
+
+		if (i && !gfs->headers[i].used)
+			gfs->free_clusters++;
+	}
 
-		ret = dir_iter_next_used(&it);
-		if (ret != -ENOENT)
-			return ret == 0 ? -ENOTEMPTY : ret;
+	stegger_advise(stegger, (size_t)gfs->hdr.cluster_count * CLUSTER_SIZE, 0, MADV_NORMAL);
+
+	ret = 0;
+	if (gfs->repair && gfs->sums)
+		ret = check_all(gfs);
+	if (ret == 0)
+		ret = count_links(gfs);
+	if (ret == 0 && gfs->seals)
+		ret = seal_reserve(gfs);
+	if (ret < 0) {
+		ghostfs_free(gfs);
+		return ret;
 	}
 
-	free_clusters(gfs, it.cluster);
-unlink:
-	link.entry->filename[0] = '\0';
-	mark_cluster(link.cluster);
+	// the superblock is written along with cluster 0, see ghostfs_check
+	if (gfs->repair && gfs->sums) {
+		ret = cluster_get(gfs, 0, &root);
+		if (ret < 0) {
+			ghostfs_free(gfs);
+			return ret;
+		}
+
+		mark_cluster(gfs, root);
+	}
+
+	*pgfs = gfs;
 
 	return 0;
 }
 
-int ghostfs_unlink(struct ghostfs *gfs, const char *path)
+/*
+ * Writes allocate clusters wherever the allocator finds room, so files
+ * growing at the same time end up interleaved. Placement is only settled at
+ * writeback instead: before anything is encoded, the fresh clusters of each
+ * file are moved to one run of free clusters, in file order. Fresh clusters
+ * freed before that never reach the carrier, see free_clusters.
+ */
+
+// move_cluster moves fresh cluster from to the free slot to
+static void move_cluster(struct ghostfs *gfs, int from, int to)
 {
-	return remove_entry(gfs, path, false);
+	pthread_mutex_t *from_lock = &gfs->cache_lock[from % CACHE_STRIPES];
+	pthread_mutex_t *to_lock = &gfs->cache_lock[to % CACHE_STRIPES];
+	struct cached_cluster *cc = cached(gfs->clusters[from]);
+	struct cluster *old;
+
+	pthread_mutex_lock(from_lock < to_lock ? from_lock : to_lock);
+	if (from_lock != to_lock)
+		pthread_mutex_lock(from_lock < to_lock ? to_lock : from_lock);
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+
+	// the carrier may not know yet that to is free, then it must be written
+	old = gfs->clusters[to];
+	if ((old && is_dirty(old)) || gfs->headers[to].dirty) {
+		cc->fresh = false;
+		__atomic_sub_fetch(&gfs->fresh_count, 1, __ATOMIC_RELAXED);
+	}
+
+	// a free cluster may still be cached, its contents are of no use
+	if (old) {
+		unmark_cluster(gfs, old);
+		free(cached(old));
+	}
+
+	// the header goes out along with the cluster
+	if (gfs->headers[to].dirty)
+		gfs->dirty_headers--;
+
+	gfs->headers[to] = gfs->headers[from];
+	memset(&gfs->headers[from], 0, sizeof(gfs->headers[from]));
+	gfs->packed[to] = gfs->packed[from];
+	gfs->packed[from] = 0;
+	gfs->cluster_flags[to] = gfs->cluster_flags[from];
+	gfs->cluster_flags[from] = 0;
+
+	cc->nr = to;
+	__atomic_store_n(&gfs->clusters[to], &cc->c, __ATOMIC_RELEASE);
+	__atomic_store_n(&gfs->clusters[from], NULL, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	pthread_mutex_unlock(from_lock);
+	if (from_lock != to_lock)
+		pthread_mutex_unlock(to_lock);
 }
 
-int ghostfs_rmdir(struct ghostfs *gfs, const char *path)
+static bool is_fresh(struct ghostfs *gfs, int nr)
 {
-	return remove_entry(gfs, path, true);
+	struct cluster *c = cache_peek(gfs, nr);
+
+	return c && cached(c)->fresh;
 }
 
-static int size_to_clusters(int size)
+// owner_iter points it at the file owner names, see entry_owner
+static int owner_iter(struct ghostfs *gfs, uint32_t owner, struct dir_iter *it)
 {
-	return size / CLUSTER_DATA + (size % CLUSTER_DATA ? 1 : 0);
+	uint32_t loc = owner - 1;
+	int ret;
+
+	ret = dir_iter_init(gfs, it, loc / CLUSTER_DIRENTS);
+	if (ret < 0)
+		return ret;
+
+	it->entry_nr = loc % CLUSTER_DIRENTS;
+	it->entry += it->entry_nr;
+
+	// the file may be gone or renamed since
+	if (!dir_entry_used(it->entry) || dir_entry_is_directory(it->entry))
+		return -ENOENT;
+
+	return 0;
 }
 
-static int do_truncate(struct ghostfs *gfs, struct dir_iter *it, off_t new_size)
+// place_file moves the fresh clusters of the file owner names next to each other
+static int place_file(struct ghostfs *gfs, uint32_t owner)
 {
+	struct dir_iter it;
+	int count = 0, prev_fresh = 0;
+	bool placed = true;
+	int nr, prev, next, to, len;
 	int ret;
+
+	ret = owner_iter(gfs, owner, &it);
+	if (ret < 0)
+		return ret == -ENOENT ? 0 : ret;
+
+	for (nr = it.entry->cluster; nr; nr = gfs->headers[nr].next) {
+		if (!is_fresh(gfs, nr))
+			continue;
+		if (prev_fresh && nr != prev_fresh + 1)
+			placed = false;
+		prev_fresh = nr;
+		count++;
+	}
+
+	if (placed)
+		return 0;
+
+	to = free_run(gfs, count, &len);
+	if (len < count)
+		return 0;
+
+	for (prev = 0, nr = it.entry->cluster; nr; prev = nr, nr = next) {
+		next = gfs->headers[nr].next;
+		if (!is_fresh(gfs, nr))
+			continue;
+
+		move_cluster(gfs, nr, to);
+		nr = to++;
+
+		if (prev) {
+			gfs->headers[prev].next = nr;
+			header_changed(gfs, prev, owner);
+		} else {
+			it.entry->cluster = nr;
+			mark_cluster(gfs, it.cluster);
+		}
+	}
+
+	return 0;
+}
+
+static int owner_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// place_fresh places the fresh clusters of every file, with lock taken for writing
+static int place_fresh(struct ghostfs *gfs)
+{
+	struct cached_cluster *cc;
+	uint32_t *owners;
+	int i, n = 0, ret = 0;
+
+	if (!gfs->fresh_count)
+		return 0;
+
+	owners = malloc(gfs->fresh_count * sizeof(*owners));
+	if (!owners)
+		return -ENOMEM;
+
+	// fresh clusters are dirty until written
+	pthread_mutex_lock(&gfs->dirty_lock);
+	for (cc = gfs->dirty_first; cc && n < gfs->fresh_count; cc = cc->dirty_next) {
+		if (cc->fresh && cc->owner)
+			owners[n++] = cc->owner;
+	}
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	qsort(owners, n, sizeof(*owners), owner_cmp);
+
+	for (i = 0; !ret && i < n; i++) {
+		if (!i || owners[i] != owners[i - 1])
+			ret = place_file(gfs, owners[i]);
+	}
+
+	free(owners);
+
+	return ret;
+}
+
+/*
+ * With compression on, runs of dirty file clusters are packed before they
+ * are written back, as many of them as fit compressed into the first one.
+ * With dedup on, the ones found elsewhere are packed into links first.
+ * Clusters are tried once after they were written, a run that does not
+ * compress well enough stays plain. Written clusters left all zeros become
+ * holes of the cluster before them whether packing is on or not.
+ *
+ * zlib never runs with lock taken for writing: pack_collect picks the runs
+ * with lock taken for reading and copies their data, compress_task packs the
+ * copies without lock, and pack_commit applies the results whose clusters
+ * were not written meanwhile with lock taken for writing.
+ */
+#define PACK_JOBS 16
+
+struct pack_job {
+	uint32_t owner;
+	uint16_t run[PACK_MAX];
+	// seq of the clusters of run when collected, see mark_cluster_owner
+	uint64_t seq[PACK_MAX];
+	int len;
+	// how many clusters of run to fold into holes of prev, see zero_commit
+	int zeros;
+	uint16_t prev;
+	// how many clusters of run to link to targets, 0 to compress them
+	int links;
+	uint16_t targets[PACK_MAX];
+	// how many clusters compressed into out, 0 if they do not compress well
 	int count;
-	int next;
-	struct cluster *c = NULL;
+	uLongf size;
+	unsigned char *in;
+	unsigned char *out;
+};
 
-	if (new_size < 0)
-		return -EINVAL;
+struct pack_batch {
+	struct pack_job jobs[PACK_JOBS];
+	int n;
+	int level;
+	uLongf out_size;
+};
 
-	if (new_size > FILESIZE_MAX)
-		return -EFBIG;
+/*
+ * pack_run collects up to max dirty clusters that follow each other from nr
+ * on into run. It tells if any of them was written since last tried.
+ */
+static int pack_run(struct ghostfs *gfs, int nr, int max, uint16_t *run, bool *pending)
+{
+	struct cluster *c;
+	int len = 0;
 
-	if (dir_entry_is_directory(it->entry))
-		return -EISDIR;
+	*pending = false;
 
-	next = it->entry->cluster;
-	count = size_to_clusters(MIN(it->entry->size, new_size));
+	pthread_mutex_lock(&gfs->dirty_lock);
+
+	while (nr && len < max && !gfs->packed[nr] && !gfs->refs[nr]) {
+		c = cache_peek(gfs, nr);
+		if (!c || !is_dirty(c))
+			break;
+
+		if (cached(c)->pack) {
+			cached(c)->pack = false;
+			__atomic_sub_fetch(&gfs->pack_count, 1, __ATOMIC_RELAXED);
+			*pending = true;
+		}
+
+		run[len++] = nr;
+		if (chain_holes(gfs, nr))
+			break;
+		nr = gfs->headers[nr].next;
+	}
+
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	return len;
+}
+
+// pack_again has the clusters of run that are still dirty tried in the next round
+static void pack_again(struct ghostfs *gfs, const uint16_t *run, int len)
+{
+	struct cluster *c;
+	int i;
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+
+	for (i = 0; i < len; i++) {
+		c = cache_peek(gfs, run[i]);
+		if (!c || !is_dirty(c) || cached(c)->pack || gfs->packed[run[i]])
+			continue;
+
+		cached(c)->pack = true;
+		__atomic_add_fetch(&gfs->pack_count, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&gfs->dirty_lock);
+}
+
+// pack_chain frees the clusters of run after the first one, which now holds count of them
+static void pack_chain(struct ghostfs *gfs, const uint16_t *run, int count)
+{
+	struct cluster *c;
+	int next, holes, i;
+
+	// the others are freed, the carrier only needs their headers if it has them
+	for (i = 1; i < count; i++) {
+		c = cache_peek(gfs, run[i]);
+		if (cached(c)->fresh)
+			continue;
+
+		pthread_mutex_lock(&gfs->dirty_lock);
+		unmark_cluster(gfs, c);
+		pthread_mutex_unlock(&gfs->dirty_lock);
+		cache_drop(gfs, c);
+	}
+
+	holes = chain_holes(gfs, run[count - 1]);
+	next = gfs->headers[run[count - 1]].next;
+	if (count > 1) {
+		gfs->headers[run[count - 1]].next = 0;
+		free_clusters(gfs, run[1]);
+	}
+
+	gfs->headers[run[0]].next = next;
+	chain_set_holes(gfs, run[0], count - 1 + holes);
+	gfs->packed[run[0]] = count;
+}
+
+/*
+ * copy_target returns the cluster copy_range filled cc from if it is clean
+ * and was not written since, 0 otherwise. With dirty_lock held.
+ */
+static int copy_target(struct ghostfs *gfs, struct cached_cluster *cc)
+{
+	struct cluster *t;
+
+	if (!cc->copied_from)
+		return 0;
+
+	t = cache_peek(gfs, cc->copied_from);
+	if (!t || is_dirty(t) || cached(t)->seq != cc->copied_seq)
+		return 0;
+
+	cluster_hashed(cached(t));
+	if (!dedup_match(gfs, cc->copied_from, cluster_hashed(cc), cc->c.data))
+		return 0;
+
+	return cc->copied_from;
+}
+
+/*
+ * link_find looks the clusters of run up in the dedup table, or the clusters
+ * they were copied from, and returns how many at its start could be packed
+ * into links, 0 if none are worth it.
+ * Then plain is set to how many come before the ones that are.
+ *
+ * A single link saves encoding the cluster but not the cluster itself, so
+ * with compression on it is only worth it if the run has no other clusters
+ * to pack it with.
+ */
+static int link_find(struct ghostfs *gfs, const uint16_t *run, int len, uint16_t *targets,
+		     int *plain)
+{
+	bool single = !gfs->compress_level || len == 1;
+	struct cluster *c;
+	int count, i;
+
+	*plain = len;
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+	for (i = 0; i < len; i++) {
+		c = cache_peek(gfs, run[i]);
+		targets[i] = copy_target(gfs, cached(c));
+		if (!targets[i] && gfs->dedup)
+			targets[i] = dedup_find(gfs, c->data, cluster_hashed(cached(c)));
+	}
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	for (count = 0; count < len && targets[count];)
+		count++;
+
+	if (count < (single ? 1 : 2)) {
+		for (i = 1; i < len; i++) {
+			if (targets[i] && (single || (i + 1 < len && targets[i + 1]))) {
+				*plain = i;
+				break;
+			}
+		}
+		return 0;
+	}
+
+	if (count - 1 + chain_holes(gfs, run[count - 1]) > HOLE_MAX)
+		return 0;
+
+	return count;
+}
+
+// zeros_written tells if cluster nr holds file data that is all zeros
+static bool zeros_written(struct ghostfs *gfs, int nr)
+{
+	struct cluster *c = cache_peek(gfs, nr);
+
+	return cached(c)->written && memcmp(c->data, zero_data, CLUSTER_DATA) == 0;
+}
+
+/*
+ * zeros_find returns how many clusters at the start of run can become
+ * holes of cluster prev. The first cluster of a chain cannot.
+ */
+static int zeros_find(struct ghostfs *gfs, int prev, const uint16_t *run, int len)
+{
+	int count = 0, holes = 0;
+
+	while (prev && count < len && zeros_written(gfs, run[count])) {
+		holes += 1 + chain_holes(gfs, run[count]);
+		count++;
+	}
+
+	// the holes after the last cluster need no count
+	if (count == len && !gfs->headers[run[len - 1]].next)
+		return count;
+
+	while (count && chain_holes(gfs, prev) + holes > HOLE_MAX)
+		holes -= 1 + chain_holes(gfs, run[--count]);
+
+	return count;
+}
+
+/*
+ * pack_collect adds the runs of dirty clusters of the file owner names that
+ * are worth packing to batch, with lock taken for reading. It returns false
+ * once batch is full, the clusters left are collected in the next round.
+ */
+static bool pack_collect(struct ghostfs *gfs, struct pack_batch *batch, uint32_t owner)
+{
+	uint16_t run[PACK_MAX], targets[PACK_MAX];
+	struct pack_job *job;
+	struct dir_iter it;
+	bool pending, retry = false;
+	int nr, prev, index, count, len, zeros, links, plain, skip, i;
+
+	// errors show up again when the clusters are written
+	if (owner_iter(gfs, owner, &it) < 0)
+		return true;
+
+	// preallocated clusters past the end are left alone
+	count = size_to_clusters(it.entry->size);
+
+	for (nr = it.entry->cluster, prev = 0, index = 0; nr && index < count;) {
+		if (batch->n == PACK_JOBS)
+			return false;
+
+		len = pack_run(gfs, nr, MIN(PACK_MAX, count - index), run, &pending);
+		pending |= retry;
+
+		// the plain clusters of a run are done
+		skip = 1;
+		retry = false;
+		if (len && pending) {
+			zeros = zeros_find(gfs, prev, run, len);
+			links = 0;
+			plain = len;
+
+			// zeros after the first cluster end the run, they are tried on their own
+			for (i = 1; !zeros && i < len; i++) {
+				if (zeros_written(gfs, run[i])) {
+					plain = i;
+					break;
+				}
+			}
+			if (!zeros)
+				links = link_find(gfs, run, plain, targets, &plain);
+			skip = zeros ? zeros : links ? links : plain;
+
+			if (zeros || links || (plain > 1 && batch->level)) {
+				job = &batch->jobs[batch->n++];
+				job->owner = owner;
+				job->len = skip;
+				job->zeros = zeros;
+				job->prev = prev;
+				job->links = links;
+				job->count = 0;
+				for (i = 0; i < skip; i++) {
+					job->run[i] = run[i];
+					job->seq[i] = cached(cache_peek(gfs, run[i]))->seq;
+					if (links)
+						job->targets[i] = targets[i];
+					else if (!zeros)
+						memcpy(job->in + i * CLUSTER_DATA,
+						       cache_peek(gfs, run[i])->data, CLUSTER_DATA);
+				}
+			}
+
+			// what the run has left still needs a try
+			retry = skip < len;
+			if (retry && batch->n == PACK_JOBS) {
+				pack_again(gfs, run + skip, len - skip);
+				return false;
+			}
+		}
+
+		while (nr && skip--) {
+			index += 1 + chain_holes(gfs, nr);
+			prev = nr;
+			nr = gfs->headers[nr].next;
+		}
+	}
+
+	return true;
+}
+
+// compress_task compresses as many clusters of job i as fit into one
+static void compress_task(void *arg, int i)
+{
+	struct pack_batch *batch = arg;
+	struct pack_job *job = &batch->jobs[i];
+	const size_t room = sizeof(((struct packed_data *)NULL)->data);
+	int count = job->len;
+	uLongf size;
+
+	if (job->links)
+		return;
+
+	for (;;) {
+		size = batch->out_size;
+		if (compress2(job->out, &size, job->in, count * CLUSTER_DATA, batch->level) != Z_OK)
+			return;
+
+		if (size <= room)
+			break;
+
+		// try as many clusters as should fit at this ratio
+		count = count * room / size;
+		if (count < 2)
+			return;
+	}
+
+	job->count = count;
+	job->size = size;
+}
+
+// pack_valid tells if the first count clusters of job are still as collected
+static bool pack_valid(struct ghostfs *gfs, const struct pack_job *job, int count)
+{
+	struct cluster *c;
+	int nr, i;
+
+	for (i = 0; i < count; i++) {
+		nr = job->run[i];
+		c = cache_peek(gfs, nr);
+		if (!c || !is_dirty(c) || cached(c)->seq != job->seq[i] ||
+		    cached(c)->owner != job->owner || !gfs->headers[nr].used ||
+		    gfs->packed[nr] || gfs->refs[nr])
+			return false;
+
+		if (i + 1 < count && (gfs->headers[nr].next != job->run[i + 1] || chain_holes(gfs, nr)))
+			return false;
+	}
+
+	return count - 1 + chain_holes(gfs, job->run[count - 1]) <= HOLE_MAX;
+}
+
+// job_valid tells if the first count clusters of job can still be packed as planned
+static bool job_valid(struct ghostfs *gfs, const struct pack_job *job, int count)
+{
+	int last = job->run[count - 1];
+	struct cluster *c;
+	int i;
+
+	if (!pack_valid(gfs, job, count))
+		return false;
+
+	if (job->zeros)
+		return gfs->headers[job->prev].used && gfs->headers[job->prev].next == job->run[0] &&
+		       (!gfs->headers[last].next ||
+			chain_holes(gfs, job->prev) + count + chain_holes(gfs, last) <= HOLE_MAX);
+
+	for (i = 0; i < job->links; i++) {
+		c = cache_peek(gfs, job->run[i]);
+		if (!dedup_match(gfs, job->targets[i], cluster_hashed(cached(c)), c->data))
+			return false;
+	}
+
+	return true;
+}
+
+// zero_commit frees the clusters of job, which become holes of job->prev
+static void zero_commit(struct ghostfs *gfs, struct pack_job *job)
+{
+	int last = job->run[job->zeros - 1];
+	int prev = job->prev;
+	int next = gfs->headers[last].next;
+	int holes = chain_holes(gfs, prev) + job->zeros + chain_holes(gfs, last);
+	struct cluster *c;
+	int i;
+
+	// as in pack_chain, the carrier only needs their headers if it has them
+	for (i = 0; i < job->zeros; i++) {
+		c = cache_peek(gfs, job->run[i]);
+		if (cached(c)->fresh)
+			continue;
+
+		pthread_mutex_lock(&gfs->dirty_lock);
+		unmark_cluster(gfs, c);
+		pthread_mutex_unlock(&gfs->dirty_lock);
+		cache_drop(gfs, c);
+	}
+
+	gfs->headers[last].next = 0;
+	free_clusters(gfs, job->run[0]);
+
+	gfs->headers[prev].next = next;
+	chain_set_holes(gfs, prev, next ? holes : 0);
+	header_changed(gfs, prev, job->owner);
+}
+
+/*
+ * pack_commit packs the clusters of job into links or into the first one,
+ * or folds them into holes, with lock taken for writing. It returns 1 if it
+ * did, 0 if they changed since they were collected and are tried again.
+ */
+static int pack_commit(struct ghostfs *gfs, struct pack_job *job)
+{
+	int count = job->zeros ? job->zeros : job->links ? job->links : job->count;
+	unsigned char *unpacked = NULL;
+	struct packed_data *p;
+	struct cluster *c;
+	int i;
+
+	// the run does not compress well enough
+	if (!count)
+		return 0;
+
+	// some other writer got there first, or a link target changed
+	if (!job_valid(gfs, job, count)) {
+		pack_again(gfs, job->run, job->len);
+		return 0;
+	}
+
+	if (job->zeros) {
+		zero_commit(gfs, job);
+		return 1;
+	}
+
+	if (!job->links) {
+		unpacked = malloc(count * CLUSTER_DATA);
+		if (!unpacked)
+			return -ENOMEM;
+		memcpy(unpacked, job->in, count * CLUSTER_DATA);
+	} else {
+		for (i = 0; i < count; i++)
+			gfs->refs[job->targets[i]]++;
+		gfs->linked_count += count;
+		gfs->links_count++;
+	}
+
+	pack_chain(gfs, job->run, count);
+
+	c = cache_peek(gfs, job->run[0]);
+	p = (void *)c->data;
+	if (job->links) {
+		p->size = count * sizeof(*job->targets);
+		memcpy(p->data, job->targets, p->size);
+		gfs->cluster_flags[job->run[0]] = CLUSTER_LINKS;
+	} else {
+		p->size = job->size;
+		memcpy(p->data, job->out, job->size);
+		cached(c)->unpacked = unpacked;
+	}
+	mark_cluster_owner(gfs, c, job->owner);
+
+	// the ones that did not fit are tried on their own
+	if (count < job->len)
+		pack_again(gfs, job->run + count, job->len - count);
+
+	return 1;
+}
+
+/*
+ * pack_dirty packs the dirty clusters of every file, or of the file owner
+ * names only. It takes lock itself, for reading or writing as needed.
+ */
+static int pack_dirty(struct ghostfs *gfs, bool all, uint32_t owner)
+{
+	struct pack_batch *batch;
+	struct cached_cluster *cc;
+	uint32_t *owners = NULL;
+	unsigned char *in, *out;
+	uLongf out_size;
+	int i, n, ret = 0;
+	bool done = false;
+
+	if (!__atomic_load_n(&gfs->pack_count, __ATOMIC_RELAXED) || (!all && !owner))
+		return 0;
 
-	if (count) {
-		ret = cluster_at(gfs, next, count - 1, &c);
-		if (ret < 0)
-			return ret;
+	out_size = compressBound(PACK_MAX * CLUSTER_DATA);
+	batch = malloc(sizeof(*batch));
+	in = malloc(PACK_JOBS * PACK_MAX * CLUSTER_DATA);
+	out = malloc(PACK_JOBS * out_size);
+	if (!batch || !in || !out) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-		next = c->hdr.next;
+	batch->out_size = out_size;
+	for (i = 0; i < PACK_JOBS; i++) {
+		batch->jobs[i].in = in + i * PACK_MAX * CLUSTER_DATA;
+		batch->jobs[i].out = out + i * out_size;
 	}
 
-	if (new_size > it->entry->size) {
-		int alloc;
-		long used = it->entry->size % CLUSTER_DATA;
+	while (!done && !ret) {
+		batch->n = 0;
+		n = 0;
 
-		// zero remaining cluster space
-		if (used) {
-			memset(c->data + used, 0, CLUSTER_DATA - used);
-			mark_cluster(c);
-		}
+		pthread_rwlock_rdlock(&gfs->lock);
 
-		alloc = size_to_clusters(new_size) - count;
-		if (alloc) {
-			ret = alloc_clusters(gfs, alloc, NULL, true);
-			if (ret < 0)
-				return ret;
+		batch->level = gfs->compress_level;
 
-			if (c) {
-				c->hdr.next = ret;
-				mark_cluster(c);
-			} else {
-				it->entry->cluster = ret;
+		if (all) {
+			pthread_mutex_lock(&gfs->dirty_lock);
+			owners = realloc(owners, MAX(gfs->pack_count, 1) * sizeof(*owners));
+			for (cc = gfs->dirty_first; owners && cc && n < gfs->pack_count; cc = cc->dirty_next) {
+				if (cc->pack && cc->owner)
+					owners[n++] = cc->owner;
 			}
+			pthread_mutex_unlock(&gfs->dirty_lock);
+
+			if (!owners)
+				ret = -ENOMEM;
+			else
+				qsort(owners, n, sizeof(*owners), owner_cmp);
 		}
-	} else if (new_size < it->entry->size) {
-		if (next) {
-			if (c) {
-				c->hdr.next = 0;
-				mark_cluster(c);
-			}
 
-			ret = cluster_get(gfs, next, &c);
-			if (ret < 0)
-				return ret;
+		done = true;
+		if (!all)
+			done = pack_collect(gfs, batch, owner);
+		for (i = 0; all && i < n; i++) {
+			if (i && owners[i] == owners[i - 1])
+				continue;
+			done = pack_collect(gfs, batch, owners[i]);
+			if (!done)
+				break;
+		}
+
+		pthread_rwlock_unlock(&gfs->lock);
 
-			free_clusters(gfs, c);
+		if (!batch->n)
+			break;
+
+		pool_run(gfs->pool, batch->n, compress_task, batch);
+
+		// a round that packs nothing, say with writes going on, is the last
+		n = 0;
+		pthread_rwlock_wrlock(&gfs->lock);
+		for (i = 0; ret >= 0 && i < batch->n; i++) {
+			ret = pack_commit(gfs, &batch->jobs[i]);
+			n += ret > 0;
 		}
+		pthread_rwlock_unlock(&gfs->lock);
+
+		if (ret > 0)
+			ret = 0;
+		if (!n)
+			break;
+		done = false;
 	}
 
-	dir_entry_set_size(it->entry, new_size, false);
-	mark_cluster(it->cluster);
+	// the rest is not part of a file any more, or not at the same place
+	pthread_mutex_lock(&gfs->dirty_lock);
+	for (cc = gfs->dirty_first; !ret && cc && gfs->pack_count; cc = cc->dirty_next) {
+		if (cc->pack && (all || cc->owner == owner)) {
+			cc->pack = false;
+			__atomic_sub_fetch(&gfs->pack_count, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&gfs->dirty_lock);
+out:
+	free(out);
+	free(in);
+	free(batch);
+	free(owners);
 
-	return 0;
+	return ret;
 }
 
-int ghostfs_truncate(struct ghostfs *gfs, const char *path, off_t new_size)
+/*
+ * place_delayed runs pack_dirty and place_fresh before a flush, which only
+ * takes lock for reading. A flush of one file only does its own clusters.
+ */
+static void place_delayed(struct ghostfs *gfs, bool all, uint32_t owner)
 {
-	struct dir_iter it;
 	int ret;
 
-	ret = dir_iter_lookup(gfs, &it, path, false);
-	if (ret < 0)
-		return ret;
+	if (!__atomic_load_n(&gfs->fresh_count, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&gfs->pack_count, __ATOMIC_RELAXED))
+		return;
+
+	ret = pack_dirty(gfs, all, owner);
+	if (ret == 0 && __atomic_load_n(&gfs->fresh_count, __ATOMIC_RELAXED)) {
+		pthread_rwlock_wrlock(&gfs->lock);
+		ret = all ? place_fresh(gfs) : owner ? place_file(gfs, owner) : 0;
+		pthread_rwlock_unlock(&gfs->lock);
+	}
 
-	return do_truncate(gfs, &it, new_size);
+	// the clusters stay as they are, which is still correct
+	if (ret < 0) {
+		errno = -ret;
+		warn("fs: cannot pack or place new clusters");
+	}
 }
 
-int ghostfs_rename(struct ghostfs *gfs, const char *path, const char *newpath)
-{
-	struct dir_iter it;
-	struct dir_entry *entry;
-	int ret;
+/*
+ * Carrier byte ranges written by a flush, to be msync'ed with the given
+ * MS_ASYNC/MS_SYNC flags. Adjacent clusters are merged so the ranges can be
+ * msync'ed in as few calls as possible.
+ */
+struct sync_extent {
+	size_t start;
+	size_t end;
+};
 
-	ret = dir_iter_lookup(gfs, &it, path, false);
-	if (ret < 0)
-		return ret;
+struct sync_range {
+	int flags;
+	int count;
+	struct sync_extent extents[SYNC_EXTENTS];
+};
 
-	if (it.entry == &gfs->root_entry)
-		return -EINVAL;
+static int flush_sums(struct ghostfs *gfs, struct sync_extent *span);
 
-	remove_entry(gfs, newpath, false);
+/*
+ * sync_range_end msyncs the ranges, after writing and msyncing the checksum
+ * table. Clusters in the carrier never wait on their checksums for longer
+ * than it takes to fill the ranges, see check_cluster, and the table keeps
+ * the previous generations for sealed ones that have yet to follow, see
+ * unseal_data.
+ */
+static int sync_range_end(struct ghostfs *gfs, struct sync_range *range)
+{
+	struct sync_extent span = { 0, 0 };
+	int i, ret;
 
-	ret = create_entry(gfs, newpath, false, &entry);
-	if (ret < 0)
-		return ret;
+	ret = flush_sums(gfs, &span);
 
-	// remove old entry
-	it.entry->filename[0] = '\0';
-	mark_cluster(it.cluster);
+	if (ret == 0 && span.end > span.start)
+		ret = stegger_sync(gfs->stegger, span.end - span.start, span.start, range->flags);
 
-	// fix new entry
-	entry->size = it.entry->size;
-	entry->cluster = it.entry->cluster;
+	for (i = 0; ret == 0 && i < range->count; i++) {
+		ret = stegger_sync(gfs->stegger, range->extents[i].end - range->extents[i].start,
+				   range->extents[i].start, range->flags);
+	}
 
-	return 0;
+	range->count = 0;
+
+	return ret;
 }
 
-int ghostfs_open(struct ghostfs *gfs, const char *filename, struct ghostfs_entry **pentry)
+static int sync_range_add(struct ghostfs *gfs, struct sync_range *range, size_t start, size_t end)
 {
-	struct dir_iter it;
-	int ret;
-
-	ret = dir_iter_lookup(gfs, &it, filename, false);
-	if (ret < 0)
-		return ret;
+	struct sync_extent *e;
+	int i, ret;
 
-	if (dir_entry_is_directory(it.entry))
-		return -EISDIR;
+	for (i = 0; i < range->count; i++) {
+		e = &range->extents[i];
+		if (start <= e->end && end >= e->start) {
+			e->start = MIN(e->start, start);
+			e->end = MAX(e->end, end);
+			return 0;
+		}
+	}
 
-	if (pentry) {
-		*pentry = malloc(sizeof(**pentry));
-		if (!*pentry)
-			return -ENOMEM;
-		(*pentry)->it = it;
+	if (range->count == SYNC_EXTENTS) {
+		ret = sync_range_end(gfs, range);
+		if (ret < 0)
+			return ret;
 	}
 
-	return 0;
-}
+	e = &range->extents[range->count++];
+	e->start = start;
+	e->end = end;
 
-void ghostfs_release(struct ghostfs_entry *entry)
-{
-	free(entry);
+	return 0;
 }
 
-int ghostfs_write(struct ghostfs *gfs,
-		  struct ghostfs_entry *gentry,
-		  const char *buf,
-		  size_t size,
-		  off_t offset)
+static int encode_cluster(struct ghostfs *gfs, struct cached_cluster *cc)
 {
-	struct dir_entry *entry = gentry->it.entry;
-	struct cluster *c;
+	bool packed = gfs->packed[cc->nr];
 	int ret;
-	int written = 0;
 
-	if (offset < 0)
-		return -EINVAL;
+	cc->c.hdr.next = gfs->headers[cc->nr].next;
+	cc->c.hdr.used = gfs->headers[cc->nr].used;
 
-	if (size + offset < size)
-		return -EOVERFLOW;
+	// the header only changes along with the root directory (cluster 0)
+	if (cc->nr == 0)
+		return write_header(gfs, &cc->c);
 
-	if (entry->size < offset + size) {
-		ret = do_truncate(gfs, &gentry->it, offset + size);
-		if (ret < 0)
-			return ret;
+	if (packed) {
+		ret = write_packed(gfs, &cc->c, cc->nr);
+	} else {
+		// the dirty byte goes out with the cluster, it only has to stay set
+		cc->c.hdr.dirty = cluster_mark(gfs, cc->nr);
+		if (!cc->c.hdr.dirty)
+			cc->c.hdr.dirty = 1;
+		ret = write_cluster(gfs, &cc->c, cc->nr);
 	}
 
-	ret = cluster_at(gfs, entry->cluster, offset/CLUSTER_DATA, &c);
-	if (ret < 0)
-		return ret;
+	// the table is written later, see sums_changed
+	if (ret == 0 && gfs->sums) {
+		gfs->sums[cc->nr] = cluster_sum(&cc->c, packed);
+		__atomic_store_n(&gfs->checked[cc->nr], 1, __ATOMIC_RELAXED);
+	}
 
-	offset %= CLUSTER_DATA;
+	return ret;
+}
 
-	for (;;) {
-		int w = MIN(size, CLUSTER_DATA);
-		if (offset + w > CLUSTER_DATA)
-			w -= (offset + w) - CLUSTER_DATA;
+// sums_changed schedules the table cluster holding the checksum of cluster nr
+static void sums_changed(struct ghostfs *gfs, int nr)
+{
+	int k = nr / sums_per_cluster(gfs);
 
-		memcpy(c->data + offset, buf, w);
-		mark_cluster(c);
+	if (gfs->sums_dirty[k])
+		return;
 
-		size -= w;
-		buf += w;
-		written += w;
-		offset = 0;
+	gfs->sums_dirty[k] = 1;
+	if (gfs->dirty_sums++ == 0 && !gfs->dirty_headers)
+		gfs->dirty_headers_since = time(NULL);
+}
 
-		if (!size)
-			break;
+// flushed marks an encoded cluster clean and adds it to range
+static int flushed(struct ghostfs *gfs, struct cached_cluster *cc, struct sync_range *range)
+{
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
 
-		ret = cluster_get_next(gfs, &c);
-		if (ret < 0)
-			return ret;
+	unmark_cluster(gfs, &cc->c);
+
+	if (cc->fresh) {
+		cc->fresh = false;
+		__atomic_sub_fetch(&gfs->fresh_count, 1, __ATOMIC_RELAXED);
 	}
 
-	return written;
+	if (gfs->dedup && cc->owner && !gfs->packed[cc->nr])
+		dedup_learn(gfs, cc);
+
+	// cluster 0 is checked along with the superblock, but may be sealed
+	if (gfs->sums && (cc->nr || gfs->seals))
+		sums_changed(gfs, cc->nr);
+
+	if (!range)
+		return 0;
+
+	return sync_range_add(gfs, range, cc->nr ? c0_offset + cc->nr*CLUSTER_SIZE : 0,
+			      c0_offset + (cc->nr + 1)*CLUSTER_SIZE);
 }
 
-int ghostfs_read(struct ghostfs *gfs,
-		 struct ghostfs_entry *gentry,
-		 char *buf,
-		 size_t size,
-		 off_t offset)
+static int flush_cluster(struct ghostfs *gfs, struct cached_cluster *cc, struct sync_range *range)
 {
-	struct dir_entry *entry = gentry->it.entry;
-	struct cluster *c;
 	int ret;
-	int read = 0;
-
-	if (offset < 0)
-		return -EINVAL;
 
-	if (size + offset < size)
-		return -EOVERFLOW;
+	ret = encode_cluster(gfs, cc);
+	if (ret < 0)
+		return ret;
 
-	if (offset > entry->size)
-		return 0;
+	return flushed(gfs, cc, range);
+}
 
-	if (offset + size > entry->size)
-		size = entry->size - offset;
+struct encode_job {
+	struct ghostfs *gfs;
+	struct cached_cluster **ccs;
+	int ret;
+};
 
-	if (!size)
-		return 0;
+static void encode_task(void *arg, int i)
+{
+	struct encode_job *job = arg;
+	int ret;
 
-	ret = cluster_at(gfs, entry->cluster, offset/CLUSTER_DATA, &c);
+	ret = encode_cluster(job->gfs, job->ccs[i]);
 	if (ret < 0)
-		return ret;
+		__atomic_store_n(&job->ret, ret, __ATOMIC_RELAXED);
+}
 
-	offset %= CLUSTER_DATA;
+/*
+ * encode_all encodes count clusters and marks them clean. With a pool they
+ * are encoded in parallel, even and odd cluster numbers apart since
+ * neighbouring clusters may share a sample. ccs is reordered.
+ */
+static int encode_all(struct ghostfs *gfs, struct cached_cluster **ccs, int count,
+		      struct sync_range *range)
+{
+	struct encode_job job = { gfs, NULL, 0 };
+	struct cached_cluster *cc;
+	int even = 0;
+	int i, ret;
 
-	for (;;) {
-		int r = MIN(size, CLUSTER_DATA);
-		if (offset + r > CLUSTER_DATA)
-			r -= (offset + r) - CLUSTER_DATA;
+	if (!gfs->pool || count < 2) {
+		for (i = 0; i < count; i++) {
+			ret = flush_cluster(gfs, ccs[i], range);
+			if (ret < 0)
+				return ret;
+		}
 
-		memcpy(buf, c->data + offset, r);
+		return 0;
+	}
 
-		size -= r;
-		buf += r;
-		read += r;
-		offset = 0;
+	for (i = 0; i < count; i++) {
+		if (ccs[i]->nr % 2 == 0) {
+			cc = ccs[i];
+			ccs[i] = ccs[even];
+			ccs[even++] = cc;
+		}
+	}
 
-		if (!size)
-			break;
+	job.ccs = ccs;
+	pool_run(gfs->pool, even, encode_task, &job);
+	job.ccs = ccs + even;
+	pool_run(gfs->pool, count - even, encode_task, &job);
 
-		ret = cluster_get_next(gfs, &c);
-		if (ret < 0)
-			return ret;
-	}
+	ret = job.ret;
+	for (i = 0; !ret && i < count; i++)
+		ret = flushed(gfs, ccs[i], range);
 
-	return read;
+	return ret;
 }
 
-int ghostfs_opendir(struct ghostfs *gfs, const char *path, struct ghostfs_entry **pentry)
+// flush_dirty writes the clusters dirtied by owner plus all dirty metadata, or all of them
+static int flush_dirty(struct ghostfs *gfs, bool all, uint32_t owner, struct sync_range *range)
 {
-	struct dir_iter it;
+	struct cached_cluster *cc, *next, **ccs = NULL;
+	int n = 0;
 	int ret;
 
-	ret = dir_iter_lookup(gfs, &it, path, false);
-	if (ret < 0)
-		return ret;
-
-	if (!dir_entry_is_directory(it.entry))
-		return -ENOTDIR;
+	if (gfs->pool && gfs->dirty_count > 1)
+		ccs = malloc(gfs->dirty_count * sizeof(*ccs));
 
-	*pentry = calloc(1, sizeof(**pentry));
-	if (!*pentry)
-		return -ENOMEM;
-	(*pentry)->it.entry = it.entry;
+	for (cc = gfs->dirty_first; cc; cc = next) {
+		next = cc->dirty_next;
 
-	return 0;
-}
+		if (!all && cc->owner && cc->owner != owner)
+			continue;
 
-int ghostfs_next_entry(struct ghostfs *gfs, struct ghostfs_entry *entry)
-{
-	int ret;
+		if (ccs) {
+			ccs[n++] = cc;
+			continue;
+		}
 
-	if (!entry->it.gfs) {
-		ret = dir_iter_init(gfs, &entry->it, entry->it.entry->cluster);
+		ret = flush_cluster(gfs, cc, range);
 		if (ret < 0)
 			return ret;
-
-		if (dir_entry_used(entry->it.entry))
-			return 0;
 	}
 
-	return dir_iter_next_used(&entry->it);
-}
+	if (!ccs)
+		return 0;
 
-void ghostfs_closedir(struct ghostfs_entry *entry)
-{
-	free(entry);
+	ret = encode_all(gfs, ccs, n, range);
+	free(ccs);
+
+	return ret;
 }
 
-int ghostfs_getattr(struct ghostfs *gfs, const char *filename, struct stat *stat)
+/*
+ * reseal_header writes hdr as the header of sealed cluster nr, in place of
+ * old. The tag covers the header, see seal_data, so the data is sealed
+ * again along with it. A cluster that fails authentication just gets the
+ * new header, and keeps failing.
+ */
+static int reseal_header(struct ghostfs *gfs, const struct cluster_header *old,
+			 const struct cluster_header *hdr, int nr)
 {
-	struct dir_iter it;
+	struct packed_data *p;
+	struct cluster c;
+	bool packed = gfs->packed[nr];
 	int ret;
 
-	ret = dir_iter_lookup(gfs, &it, filename, false);
-	if (ret < 0)
+	ret = unseal_data(gfs, c.data, nr, old, packed);
+	if (ret == 0) {
+		p = (void *)c.data;
+		ret = seal_data(gfs, c.data, packed ? offsetof(struct packed_data, data) + p->size :
+				CLUSTER_DATA, nr, hdr);
+	}
+	if (ret < 0 && ret != -EBADMSG)
 		return ret;
 
-	memset(stat, 0, sizeof(*stat));
+	return write_cluster_header(gfs, hdr, nr);
+}
 
-	if (dir_entry_is_directory(it.entry)) {
-		stat->st_mode |= S_IFDIR | S_IXUSR;
-		stat->st_size = CLUSTER_SIZE;
-	} else {
-		stat->st_mode |= S_IFREG;
-		stat->st_size = it.entry->size;
-	}
+// flush_header writes the header of cluster nr alone, see flush_headers
+static int flush_header(struct ghostfs *gfs, int nr)
+{
+	struct cluster_header old, hdr;
+	int ret;
 
-	// user that mounted filesystem owns all files
-	stat->st_uid = gfs->uid;
-	stat->st_gid = gfs->gid;
-	stat->st_mode |= S_IRUSR | S_IWUSR;
+	hdr = gfs->headers[nr];
+	hdr.dirty = cluster_mark(gfs, nr);
 
-	stat->st_blocks = stat->st_size / 512 + (stat->st_size % 512 ? 1 : 0);
+	if (!gfs->sums || nr >= gfs->sums_start)
+		return write_cluster_header(gfs, &hdr, nr);
 
-	// all time fields use the mount time
-	memcpy(&stat->st_atime, &gfs->mount_time, sizeof(time_t));
-	memcpy(&stat->st_mtime, &gfs->mount_time, sizeof(time_t));
-	memcpy(&stat->st_ctime, &gfs->mount_time, sizeof(time_t));
+	// the checksum covers the header, swap in the new one, see cluster_sum
+	ret = read_cluster_header(gfs, &old, nr);
+	if (ret < 0)
+		return ret;
 
-	// only one hardlink
-	stat->st_nlink = 1;
+	gfs->sums[nr] ^= header_sum(&old) ^ header_sum(&hdr);
+	sums_changed(gfs, nr);
 
-	return 0;
+	// free clusters are not read, their data can stay sealed with the old header
+	if (cluster_sealed(gfs, nr) && hdr.used)
+		return reseal_header(gfs, &old, &hdr, nr);
+
+	return write_cluster_header(gfs, &hdr, nr);
 }
 
-int ghostfs_statvfs(struct ghostfs *gfs, struct statvfs *stat)
+/*
+ * flush_headers writes the headers changed on clusters that are not cached.
+ *
+ * With a checksum table a header is written under the cache lock of its
+ * cluster, so that readers decoding it meanwhile do not get it half
+ * written, see read_cluster_locked. The cache lock comes first, dirty_lock
+ * is dropped to wait for it, and the header may be written along with its
+ * cluster in the meantime.
+ */
+static int flush_headers(struct ghostfs *gfs, struct sync_range *range)
 {
-	memset(stat, 0, sizeof(*stat));
-
-	stat->f_bsize = CLUSTER_SIZE;
-	stat->f_frsize = CLUSTER_SIZE;
-	stat->f_blocks = gfs->hdr.cluster_count;
-	stat->f_bfree = gfs->free_clusters;
-	stat->f_bavail = stat->f_bfree;
-	stat->f_files = 0; // FIXME: keep track of how many files we have
-	stat->f_ffree = 0; // FIXME: ?
-	stat->f_namemax = FILESIZE_MAX;
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	pthread_mutex_t *lock;
+	int i, ret;
 
-	return 0;
-}
+	for (i = 1; gfs->dirty_headers && i < gfs->hdr.cluster_count; i++) {
+		if (!gfs->headers[i].dirty)
+			continue;
 
-static int cluster_get(struct ghostfs *gfs, int nr, struct cluster **pcluster)
-{
-	int ret;
+		lock = &gfs->cache_lock[i % CACHE_STRIPES];
+		if (gfs->sums && pthread_mutex_trylock(lock) != 0) {
+			pthread_mutex_unlock(&gfs->dirty_lock);
+			pthread_mutex_lock(lock);
+			pthread_mutex_lock(&gfs->dirty_lock);
 
-	if (nr >= gfs->hdr.cluster_count) {
-		warnx("fs: invalid cluster number %d", nr);
-		return -ERANGE;
-	}
+			if (!gfs->headers[i].dirty) {
+				pthread_mutex_unlock(lock);
+				continue;
+			}
+		}
 
-	if (!gfs->clusters[nr]) {
-		struct cluster *c;
+		ret = flush_header(gfs, i);
+		if (gfs->sums)
+			pthread_mutex_unlock(lock);
+		if (ret < 0)
+			return ret;
 
-		c = malloc(CLUSTER_SIZE);
-		if (!c)
-			return -ENOMEM;
+		gfs->headers[i].dirty = 0;
+		gfs->dirty_headers--;
 
-		ret = read_cluster(gfs, c, nr);
-		if (ret < 0) {
-			free(c);
-			return ret;
+		if (range) {
+			ret = sync_range_add(gfs, range, c0_offset + i*CLUSTER_SIZE,
+					     c0_offset + (i + 1)*CLUSTER_SIZE);
+			if (ret < 0)
+				return ret;
 		}
-
-		gfs->clusters[nr] = c;
 	}
 
-	*pcluster = gfs->clusters[nr];
-
 	return 0;
 }
 
-static int cluster_get_next(struct ghostfs *gfs, struct cluster **cluster)
+// flush_sums writes the clusters of the checksum table that changed, span gets their range
+static int flush_sums(struct ghostfs *gfs, struct sync_extent *span)
 {
-        struct cluster *c = *cluster;
-
-	if (!c->hdr.next) {
-		warnx("fs: cluster missing, bad filesystem");
-		return -EIO;
-	}
+	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
+	int count = gfs->hdr.cluster_count;
+	struct cluster c;
+	int k, nr, ret;
 
-	return cluster_get(gfs, c->hdr.next, cluster);
-}
+	for (k = 0; gfs->dirty_sums && k < sums_clusters(gfs, count); k++) {
+		if (!gfs->sums_dirty[k])
+			continue;
 
-// cluster_at returns the cluster at the given index starting from cluster nr
-static int cluster_at(struct ghostfs *gfs, int nr, int index, struct cluster **cluster)
-{
-	struct cluster *c = NULL;
-	int ret, i;
+		nr = gfs->sums_start + k;
 
-	for (i = 0; i <= index; i++) {
-		if (!nr) {
-			warnx("fs: cluster missing, bad filesystem");
-			return -EIO;
-		}
+		sums_pack(gfs, k, &c);
+		c.hdr = gfs->headers[nr];
 
-		ret = cluster_get(gfs, nr, &c);
+		ret = write_cluster(gfs, &c, nr);
 		if (ret < 0)
 			return ret;
 
-		nr = c->hdr.next;
-	}
+		gfs->sums_dirty[k] = 0;
+		gfs->dirty_sums--;
 
-	*cluster = c;
+		if (span) {
+			if (span->end == span->start)
+				span->start = c0_offset + nr*CLUSTER_SIZE;
+			span->end = c0_offset + (nr + 1)*CLUSTER_SIZE;
+		}
+	}
 
 	return 0;
 }
 
-static int write_cluster(struct ghostfs *gfs, struct cluster *cluster, int nr)
+// reserve_tag sets tag to authenticate limit in the reserve slot, see seal_reserve
+static int reserve_tag(struct ghostfs *gfs, uint64_t limit, unsigned char *tag)
 {
 	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
-	int ret;
-
-	ret = stegger_write(gfs->stegger, cluster, CLUSTER_SIZE, c0_offset + nr*CLUSTER_SIZE);
-	if (ret < 0)
-		return ret;
 
-	unmark_cluster(cluster);
-	return 0;
+	return stegger_seal(gfs->stegger, NULL, 0, c0_offset + gfs->sums_start*CLUSTER_SIZE,
+			    RESERVE_NONCE | limit, &limit, sizeof(limit), tag);
 }
 
-static int read_cluster(struct ghostfs *gfs, struct cluster *cluster, int nr)
+/*
+ * Table clusters are not sealed, the entry of the first one holds the
+ * generation to start from instead, with a tag of its own. Each mount moves
+ * it SEAL_RESERVE past and syncs it before sealing anything, so even if
+ * later table writes are lost no generation is ever sealed with twice.
+ *
+ * The rest of the table is only covered by its checksums: an entry that
+ * was tampered with makes its cluster fail authentication, short of putting
+ * back an older entry along with the data it was sealed with.
+ */
+static int seal_reserve(struct ghostfs *gfs)
 {
 	const size_t c0_offset = 16 + sizeof(struct ghostfs_header);
-	int ret;
+	struct cluster_seal *slot = &gfs->seals[gfs->sums_start];
+	struct sync_extent span = { 0, 0 };
+	uint64_t gen = slot->gen;
+	int i, ret;
+
+	ret = stegger_unseal(gfs->stegger, NULL, 0, c0_offset + gfs->sums_start*CLUSTER_SIZE,
+			     RESERVE_NONCE | gen, &gen, sizeof(gen), slot->tag);
+	if (ret == -EBADMSG) {
+		warnx("fs: generation reserve fails authentication");
+		if (!gfs->repair)
+			return -EIO;
+	} else if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < gfs->sums_start; i++)
+		gen = MAX(gen, MAX(gfs->seals[i].gen, gfs->seals[i].prev_gen) + 1);
 
-	ret = stegger_read(gfs->stegger, cluster, CLUSTER_SIZE, c0_offset + nr*CLUSTER_SIZE);
+	gfs->gen = gen;
+	gfs->gen_limit = gen + SEAL_RESERVE;
+	slot->gen = gfs->gen_limit;
+
+	ret = reserve_tag(gfs, slot->gen, slot->tag);
 	if (ret < 0)
 		return ret;
 
-	unmark_cluster(cluster);
-	return 0;
+	sums_changed(gfs, gfs->sums_start);
+
+	ret = flush_sums(gfs, &span);
+	if (ret < 0)
+		return ret;
+
+	return stegger_sync(gfs->stegger, span.end - span.start, span.start, MS_SYNC);
 }
 
-static int ghostfs_check(struct ghostfs *gfs)
+// flush_owner writes the clusters dirtied by owner plus all dirty metadata
+static int flush_owner(struct ghostfs *gfs, uint32_t owner, int flags)
 {
-	MD5_CTX md5_ctx;
-	unsigned char md5_fs[16];
-	unsigned char md5[16];
-	struct cluster root;
+	struct sync_range range = { flags, 0 };
 	int ret;
 
-	ret = stegger_read(gfs->stegger, md5_fs, sizeof(md5_fs), 0);
+	ret = flush_headers(gfs, &range);
 	if (ret < 0)
 		return ret;
 
-	ret = stegger_read(gfs->stegger, &gfs->hdr, sizeof(struct ghostfs_header), 16);
+	ret = flush_dirty(gfs, false, owner, &range);
 	if (ret < 0)
 		return ret;
 
-	ret = stegger_read(gfs->stegger, &root, sizeof(root), 16 + sizeof(struct ghostfs_header));
-	if (ret < 0)
-		return ret;
+	return sync_range_end(gfs, &range);
+}
 
-	MD5_Init(&md5_ctx);
-	MD5_Update(&md5_ctx, &gfs->hdr, sizeof(gfs->hdr));
-	MD5_Update(&md5_ctx, &root, sizeof(root));
-	MD5_Final(md5, &md5_ctx);
+// handle_owner returns the owner of the file open as gentry, see entry_owner
+static uint32_t handle_owner(struct ghostfs *gfs, struct ghostfs_entry *gentry)
+{
+	struct dir_iter it;
 
-	if (memcmp(md5, md5_fs, 16) == 0) {
+	if (inode_iter(gfs, gentry->inode, &it) < 0)
 		return 0;
-	}
 
-	return -EIO;
+	return entry_owner(&it);
 }
 
-static int write_header(struct ghostfs *gfs, struct cluster *cluster0)
+// place_handle runs place_delayed for the file open as gentry only
+static void place_handle(struct ghostfs *gfs, struct ghostfs_entry *gentry)
+{
+	uint32_t owner;
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	owner = handle_owner(gfs, gentry);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	place_delayed(gfs, false, owner);
+}
+
+int ghostfs_flush(struct ghostfs *gfs, struct ghostfs_entry *gentry)
 {
-	MD5_CTX md5_ctx;
-	unsigned char md5[16];
 	int ret;
 
-	MD5_Init(&md5_ctx);
-	MD5_Update(&md5_ctx, &gfs->hdr, sizeof(gfs->hdr));
-	MD5_Update(&md5_ctx, cluster0, sizeof(*cluster0));
-	MD5_Final(md5, &md5_ctx);
+	place_handle(gfs, gentry);
 
-	// write md5 of header+root
-	ret = stegger_write(gfs->stegger, md5, sizeof(md5), 0);
-	if (ret < 0)
-		return ret;
+	pthread_rwlock_rdlock(&gfs->lock);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	// start writing out the carrier, but don't wait for it
+	ret = flush_owner(gfs, handle_owner(gfs, gentry), MS_ASYNC);
+	pthread_mutex_unlock(&gfs->dirty_lock);
+	pthread_rwlock_unlock(&gfs->lock);
 
-	// write header
-	ret = stegger_write(gfs->stegger, &gfs->hdr, sizeof(gfs->hdr), 16);
+	return ret;
+}
+
+int ghostfs_fsync(struct ghostfs *gfs, struct ghostfs_entry *gentry)
+{
+	int ret;
+
+	if (gentry)
+		place_handle(gfs, gentry);
+	else
+		place_delayed(gfs, true, 0);
+
+	pthread_rwlock_rdlock(&gfs->lock);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	ret = flush_owner(gfs, gentry ? handle_owner(gfs, gentry) : 0, MS_SYNC);
+	pthread_mutex_unlock(&gfs->dirty_lock);
+	pthread_rwlock_unlock(&gfs->lock);
+
+	return ret;
+}
+
+static int sync_all(struct ghostfs *gfs)
+{
+	int ret;
+
+	ret = flush_dirty(gfs, true, 0, NULL);
 	if (ret < 0)
 		return ret;
 
-	// write first cluster
-	ret = write_cluster(gfs, cluster0, 0);
+	ret = flush_headers(gfs, NULL);
 	if (ret < 0)
 		return ret;
 
-	return 0;
+	return flush_sums(gfs, NULL);
 }
 
-// create a new filesystem
-int ghostfs_format(struct stegger *stegger)
+int ghostfs_sync(struct ghostfs *gfs)
 {
-	struct ghostfs gfs;
-	size_t count;
-	struct cluster cluster;
-	int ret, i;
-	const int HEADER_SIZE = 16 + sizeof(struct ghostfs_header);
+	int ret;
 
-	gfs.stegger = stegger;
+	place_delayed(gfs, true, 0);
 
-	if (gfs.stegger->capacity < HEADER_SIZE + CLUSTER_SIZE)
-		return -ENOSPC;
+	pthread_rwlock_rdlock(&gfs->lock);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	ret = sync_all(gfs);
+	pthread_mutex_unlock(&gfs->dirty_lock);
+	pthread_rwlock_unlock(&gfs->lock);
 
-	count = (gfs.stegger->capacity - HEADER_SIZE) / CLUSTER_SIZE;
-	if (count > 0xFFFF) {
-		warnx("fs: %lu clusters available, using only %d", count, 0xFFFF);
-		count = 0xFFFF;
-	}
+	return ret;
+}
 
-	gfs.hdr.cluster_count = count;
+static bool writeback_due(struct ghostfs *gfs, time_t now)
+{
+	struct cached_cluster *cc = gfs->dirty_first;
 
-	ret = read_cluster(&gfs, &cluster, 0);
-	if (ret < 0)
-		return ret;
+	if (!cc)
+		return false;
 
-	cluster.hdr.next = 0;
+	return gfs->dirty_count >= gfs->dirty_limit || now - cc->dirty_since >= gfs->dirty_expire;
+}
 
-	for (i = 0; i < CLUSTER_DATA; i += sizeof(struct dir_entry)) {
-		struct dir_entry *e = (struct dir_entry *)&cluster.data[i];
-		e->filename[0] = '\0';
-	}
+static bool writeback_headers_due(struct ghostfs *gfs, time_t now)
+{
+	return (gfs->dirty_headers || gfs->dirty_sums) &&
+	       now - gfs->dirty_headers_since >= gfs->dirty_expire;
+}
 
-	ret = write_header(&gfs, &cluster);
-	if (ret < 0)
-		return ret;
+/*
+ * Writeback encodes the oldest dirty clusters once they are older than
+ * dirty_expire seconds, or as soon as dirty_limit clusters are dirty.
+ *
+ * It works in batches of WRITEBACK_BATCH clusters and drops the lock in
+ * between, so foreground requests never wait for more than one batch.
+ */
+static void *writeback_thread(void *arg)
+{
+	struct ghostfs *gfs = arg;
+	struct sync_range range = { MS_ASYNC, 0 };
+	bool backoff = false;
+	int i, ret;
 
-	for (i = 1; i < count; i++) {
-		ret = read_cluster(&gfs, &cluster, i);
-		if (ret < 0)
-			return ret;
+	pthread_mutex_lock(&gfs->dirty_lock);
 
-		cluster.hdr.used = 0;
+	while (!gfs->writeback_stop) {
+		time_t now = time(NULL);
 
-		ret = write_cluster(&gfs, &cluster, i);
-		if (ret < 0)
-			return ret;
+		if (backoff || (!writeback_due(gfs, now) && !writeback_headers_due(gfs, now))) {
+			struct timespec ts = { now + gfs->dirty_expire, 0 };
+
+			if (!backoff && gfs->dirty_first)
+				ts.tv_sec = gfs->dirty_first->dirty_since + gfs->dirty_expire;
+			if (!backoff && (gfs->dirty_headers || gfs->dirty_sums))
+				ts.tv_sec = MIN(ts.tv_sec, gfs->dirty_headers_since + gfs->dirty_expire);
+
+			pthread_cond_timedwait(&gfs->writeback_cond, &gfs->dirty_lock, &ts);
+			backoff = false;
+			continue;
+		}
+
+		// keep out writers while encoding, the namespace lock comes first
+		pthread_mutex_unlock(&gfs->dirty_lock);
+		place_delayed(gfs, true, 0);
+		pthread_rwlock_rdlock(&gfs->lock);
+		pthread_mutex_lock(&gfs->dirty_lock);
+
+		// headers are 4 bytes each, write them all at once
+		if (writeback_headers_due(gfs, now)) {
+			ret = flush_headers(gfs, &range);
+			if (ret < 0) {
+				errno = -ret;
+				warn("fs: writeback failed");
+				backoff = true;
+			}
+		}
+
+		for (i = 0; !backoff && i < WRITEBACK_BATCH && writeback_due(gfs, now); i++) {
+			ret = flush_cluster(gfs, gfs->dirty_first, &range);
+			if (ret < 0) {
+				errno = -ret;
+				warn("fs: writeback failed");
+				backoff = true;
+				break;
+			}
+		}
+
+		// let the kernel start writing the carrier pages too, the checksum table first
+		ret = sync_range_end(gfs, &range);
+		if (ret < 0) {
+			errno = -ret;
+			warn("fs: writeback msync failed");
+		}
+
+		pthread_mutex_unlock(&gfs->dirty_lock);
+		pthread_rwlock_unlock(&gfs->lock);
+		sched_yield();
+		pthread_mutex_lock(&gfs->dirty_lock);
 	}
 
-	return 0;
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	return NULL;
 }
 
-static int print_dir_entries(struct ghostfs *gfs, int cluster_nr, const char *parent)
+int ghostfs_writeback_start(struct ghostfs *gfs, int expire, size_t dirty_limit)
 {
-	struct dir_iter it;
-	char buf[256] = "";
 	int ret;
 
-	ret = dir_iter_init(gfs, &it, cluster_nr);
-	if (ret < 0)
-		return ret;
+	if (gfs->writeback_running)
+		return -EBUSY;
 
-	do {
-		if (dir_entry_used(it.entry)) {
-			snprintf(buf, sizeof(buf), "%s/%s", parent, it.entry->filename);
-			printf("%s", buf);
-			if (dir_entry_is_directory(it.entry)) {
-				printf("/\n");
-				ret = print_dir_entries(gfs, it.entry->cluster, buf);
-				if (ret < 0)
-					return ret;
-			} else {
-				printf(" {%d}\n", it.entry->size);
-			}
-		}
-	} while ((ret = dir_iter_next_used(&it)) == 0);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	gfs->dirty_expire = expire;
+	gfs->dirty_limit = dirty_limit / CLUSTER_SIZE ? dirty_limit / CLUSTER_SIZE : 1;
+	gfs->writeback_stop = false;
+	pthread_mutex_unlock(&gfs->dirty_lock);
 
-	if (ret != -ENOENT)
-		return ret;
+	ret = pthread_create(&gfs->writeback_thread, NULL, writeback_thread, gfs);
+	if (ret)
+		return -ret;
+
+	gfs->writeback_running = true;
 
 	return 0;
 }
 
-int ghostfs_debug(struct ghostfs *gfs)
+int ghostfs_pool_start(struct ghostfs *gfs, int threads)
 {
-	return print_dir_entries(gfs, 0, "");
+	if (gfs->pool)
+		return -EBUSY;
+
+	// the calling thread works too
+	if (threads < 2)
+		return 0;
+
+	return pool_create(&gfs->pool, threads - 1);
 }
 
-int ghostfs_mount(struct ghostfs **pgfs, struct stegger *stegger)
+/*
+ * ghostfs_compress_start has file clusters packed on writeback, compressed
+ * at zlib level 1 to 9. Packed clusters are read whether it is on or not.
+ */
+int ghostfs_compress_start(struct ghostfs *gfs, int level)
 {
-	struct ghostfs *gfs;
-	int i, ret;
+	if (level < 1 || level > 9)
+		return -EINVAL;
 
-	gfs = calloc(1, sizeof(*gfs));
-	if (!gfs)
-		return -ENOMEM;
+	pthread_rwlock_wrlock(&gfs->lock);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	gfs->compress_level = level;
+	pthread_mutex_unlock(&gfs->dirty_lock);
+	pthread_rwlock_unlock(&gfs->lock);
 
-	gfs->stegger = stegger;
-	gfs->root_entry.size = 0x80000000;
+	return 0;
+}
 
-	ret = ghostfs_check(gfs);
-	if (ret < 0) {
-		ghostfs_free(gfs);
-		return ret;
-	}
+// dedup_seed adds the clusters links point to already to the dedup table
+static void dedup_seed(struct ghostfs *gfs)
+{
+	struct cluster *c;
+	uint16_t *nrs;
+	int nr, n = 0;
 
-	gfs->clusters = calloc(1, sizeof(struct cluster *) * gfs->hdr.cluster_count);
-	if (!gfs->clusters) {
-		ghostfs_free(gfs);
-		return -ENOMEM;
-	}
+	nrs = malloc(gfs->hdr.cluster_count * sizeof(*nrs));
+	if (!nrs)
+		return;
 
-	gfs->uid = getuid();
-	gfs->gid = getgid();
-	time(&gfs->mount_time);
+	pthread_rwlock_rdlock(&gfs->lock);
 
-	// check free clusters
-	for (i = 1; i < gfs->hdr.cluster_count; i++) {
-		struct cluster *c;
+	for (nr = 1; nr < gfs->hdr.cluster_count; nr++) {
+		if (gfs->refs[nr])
+			nrs[n++] = nr;
+	}
 
-		ret = cluster_get(gfs, i, &c);
-		if (ret < 0) {
-			ghostfs_free(gfs);
-			return ret;
-		}
+	if (n)
+		prefetch(gfs, nrs, n);
 
-		if (!c->hdr.used)
-			gfs->free_clusters++;
+	// errors show up again when the files get to them
+	while (n--) {
+		if (cluster_get(gfs, nrs[n], &c) < 0)
+			continue;
+
+		pthread_mutex_lock(&gfs->dirty_lock);
+		dedup_learn(gfs, cached(c));
+		pthread_mutex_unlock(&gfs->dirty_lock);
 	}
 
-	*pgfs = gfs;
+	pthread_rwlock_unlock(&gfs->lock);
 
-	return 0;
+	free(nrs);
 }
 
-int ghostfs_sync(struct ghostfs *gfs)
+/*
+ * ghostfs_dedup_start has file clusters whose data is on the carrier
+ * already written back as links to it. Links are read whether it is on or
+ * not. The data links point to at mount is looked for from the start, the
+ * rest once read or written.
+ */
+int ghostfs_dedup_start(struct ghostfs *gfs)
 {
-	struct cluster *c;
-	int ret, i;
+	struct dedup_slot *dedup;
+	size_t size = 1;
 
-	ret = cluster_get(gfs, 0, &c);
-	if (ret < 0)
-		return ret;
+	while (size < 2 * (size_t)gfs->hdr.cluster_count)
+		size <<= 1;
 
-	ret = write_header(gfs, c);
-	if (ret < 0)
-		return ret;
+	dedup = calloc(size, sizeof(*dedup));
+	if (!dedup)
+		return -ENOMEM;
 
-	if (!gfs->clusters)
-		return 0;
+	pthread_rwlock_wrlock(&gfs->lock);
+	pthread_mutex_lock(&gfs->dirty_lock);
+	if (gfs->dedup) {
+		free(dedup);
+		dedup = NULL;
+	} else {
+		gfs->dedup = dedup;
+		gfs->dedup_mask = size - 1;
+	}
+	pthread_mutex_unlock(&gfs->dirty_lock);
+	pthread_rwlock_unlock(&gfs->lock);
 
-	for (i = 1; i < gfs->hdr.cluster_count; i++) {
-		c = gfs->clusters[i];
+	if (!dedup)
+		return -EBUSY;
 
-		if (!c || !is_dirty(c))
-			continue;
+	dedup_seed(gfs);
 
-		ret = write_cluster(gfs, c, i);
-		if (ret < 0)
-			return ret;
-	}
+	return 0;
+}
+
+int ghostfs_dedup_stats(struct ghostfs *gfs, struct ghostfs_dedup_stats *stats)
+{
+	pthread_rwlock_rdlock(&gfs->lock);
+	stats->linked = gfs->linked_count;
+	stats->links = gfs->links_count;
+	stats->saved = gfs->linked_count - gfs->links_count;
+	// clusters in use, see ghostfs_statvfs, plus the ones links stand for
+	stats->logical = (gfs->sums_start ? gfs->sums_start : gfs->hdr.cluster_count) -
+			 gfs->free_clusters + stats->saved;
+	stats->ratio = stats->logical ? (double)stats->saved / stats->logical : 0;
+	pthread_rwlock_unlock(&gfs->lock);
 
 	return 0;
 }
 
+static void writeback_stop(struct ghostfs *gfs)
+{
+	if (!gfs->writeback_running)
+		return;
+
+	pthread_mutex_lock(&gfs->dirty_lock);
+	gfs->writeback_stop = true;
+	pthread_cond_signal(&gfs->writeback_cond);
+	pthread_mutex_unlock(&gfs->dirty_lock);
+
+	pthread_join(gfs->writeback_thread, NULL);
+	gfs->writeback_running = false;
+}
+
 static void ghostfs_free(struct ghostfs *gfs)
 {
+	int i;
+
 	if (gfs->clusters) {
-		int i;
+		for (i = 0; i < gfs->hdr.cluster_count; i++) {
+			if (!gfs->clusters[i])
+				continue;
 
-		for (i = 0; i < gfs->hdr.cluster_count; i++)
-			free(gfs->clusters[i]);
+			free(cached(gfs->clusters[i])->unpacked);
+			free(cached(gfs->clusters[i]));
+		}
 
 		free(gfs->clusters);
 	}
 
+	free(gfs->headers);
+	free(gfs->packed);
+	free(gfs->cluster_flags);
+	free(gfs->refs);
+	free(gfs->dedup);
+	free(gfs->sums);
+	free(gfs->checked);
+	free(gfs->sums_dirty);
+	free(gfs->seals);
+
+	for (i = 0; i < INODE_BUCKETS; i++) {
+		struct inode *inode, *next;
+
+		for (inode = gfs->inodes_by_ino[i]; inode; inode = next) {
+			next = inode->ino_next;
+			pthread_mutex_destroy(&inode->write_lock);
+			free(inode);
+		}
+	}
+
+	pthread_mutex_destroy(&gfs->root_inode.write_lock);
+	pthread_mutex_destroy(&gfs->inode_lock);
+	pthread_cond_destroy(&gfs->readahead_cond);
+	pthread_cond_destroy(&gfs->writeback_cond);
+	pthread_mutex_destroy(&gfs->readahead_lock);
+	pthread_mutex_destroy(&gfs->dirty_lock);
+	for (i = 0; i < CACHE_STRIPES; i++)
+		pthread_mutex_destroy(&gfs->cache_lock[i]);
+	pthread_rwlock_destroy(&gfs->lock);
 	free(gfs);
 }
 
 int ghostfs_umount(struct ghostfs *gfs)
 {
-	int ret = ghostfs_sync(gfs);
+	int ret;
+
+	readahead_stop(gfs);
+	writeback_stop(gfs);
+
+	ret = pack_dirty(gfs, true, 0);
+	if (ret == 0)
+		ret = place_fresh(gfs);
+	if (ret == 0)
+		ret = sync_all(gfs);
+
+	if (gfs->pool)
+		pool_destroy(gfs->pool);
 
         ghostfs_free(gfs);
 
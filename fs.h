@@ -2,6 +2,8 @@
 #define GHOST_FS_H
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -12,8 +14,61 @@
 
 struct ghostfs;
 struct ghostfs_entry;
+struct iovec;
 
-int ghostfs_mount(struct ghostfs **pgfs, struct stegger *stegger);
+/*
+ * An iov callback gets the cluster memory backing a read or write request
+ * and returns the number of bytes it consumed or filled, or -errno.
+ */
+typedef int (*ghostfs_iov_fn)(void *arg, const struct iovec *iov, int count);
+
+// inode numbers stay the same across renames while the filesystem is mounted
+#define GHOSTFS_ROOT_INO 1
+
+#define GHOSTFS_NAME_SIZE 56
+
+// ghostfs_fallocate mode, Linux value where fcntl.h lacks it
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+/*
+ * ghostfs_open_ino flag: reads decode straight into the caller's buffer and
+ * writes encode the clusters they cover in full right away, neither keeps
+ * clusters in the cache
+ */
+#define GHOSTFS_O_DIRECT 1
+
+/*
+ * ghostfs_mount flag: clusters that do not match their checksum are taken
+ * as they are and sealed ones that fail authentication zeroed, with a
+ * warning. All are checked at mount and fixed by the next sync.
+ */
+#define GHOSTFS_REPAIR 1
+
+// ghostfs_readdir takes a lookup reference on every entry it returns
+#define GHOSTFS_READDIR_LOOKUP 1
+
+struct ghostfs_dedup_stats {
+	// file clusters stored as links to a cluster with the same data
+	unsigned long linked;
+	// clusters holding those links
+	unsigned long links;
+	// clusters the files would take without links, and how many of them links save
+	unsigned long logical;
+	unsigned long saved;
+	// saved / logical
+	double ratio;
+};
+
+struct ghostfs_dirent {
+	char name[GHOSTFS_NAME_SIZE];
+	struct stat stat;
+	// offset to continue the listing after this entry
+	off_t off;
+};
+
+int ghostfs_mount(struct ghostfs **pgfs, struct stegger *stegger, int flags);
 int ghostfs_umount(struct ghostfs *gfs);
 int ghostfs_create(struct ghostfs *gfs, const char *path);
 int ghostfs_unlink(struct ghostfs *gfs, const char *path);
@@ -25,11 +80,42 @@ int ghostfs_open(struct ghostfs *gfs, const char *filename, struct ghostfs_entry
 void ghostfs_release(struct ghostfs_entry *entry);
 int ghostfs_write(struct ghostfs *gfs, struct ghostfs_entry *gentry, const char *buf, size_t size, off_t offset);
 int ghostfs_read(struct ghostfs *gfs, struct ghostfs_entry *gentry, char *buf, size_t size, off_t offset);
+int ghostfs_write_iov(struct ghostfs *gfs, struct ghostfs_entry *gentry, size_t size, off_t offset,
+		      ghostfs_iov_fn fn, void *arg);
+int ghostfs_read_iov(struct ghostfs *gfs, struct ghostfs_entry *gentry, size_t size, off_t offset,
+		     ghostfs_iov_fn fn, void *arg);
+ssize_t ghostfs_copy_range(struct ghostfs *gfs, struct ghostfs_entry *src, off_t src_offset,
+			   struct ghostfs_entry *dst, off_t dst_offset, size_t size);
+int ghostfs_fallocate(struct ghostfs *gfs, struct ghostfs_entry *gentry, int mode,
+		      off_t offset, off_t length);
+off_t ghostfs_lseek(struct ghostfs *gfs, struct ghostfs_entry *gentry, off_t offset, int whence);
+int ghostfs_flush(struct ghostfs *gfs, struct ghostfs_entry *gentry);
+int ghostfs_fsync(struct ghostfs *gfs, struct ghostfs_entry *gentry);
+int ghostfs_sync(struct ghostfs *gfs);
+int ghostfs_pool_start(struct ghostfs *gfs, int threads);
+int ghostfs_writeback_start(struct ghostfs *gfs, int expire, size_t dirty_limit);
+int ghostfs_compress_start(struct ghostfs *gfs, int level);
+int ghostfs_dedup_start(struct ghostfs *gfs);
+int ghostfs_dedup_stats(struct ghostfs *gfs, struct ghostfs_dedup_stats *stats);
 int ghostfs_opendir(struct ghostfs *gfs, const char *path, struct ghostfs_entry **pentry);
 int ghostfs_next_entry(struct ghostfs *gfs, struct ghostfs_entry *entry);
 void ghostfs_closedir(struct ghostfs_entry *entry);
 const char *ghostfs_entry_name(const struct ghostfs_entry *entry);
 int ghostfs_getattr(struct ghostfs *gfs, const char *filename, struct stat *stat);
+int ghostfs_lookup(struct ghostfs *gfs, ino_t parent, const char *name, struct stat *stat);
+void ghostfs_forget(struct ghostfs *gfs, ino_t ino, uint64_t nlookup);
+int ghostfs_getattr_ino(struct ghostfs *gfs, ino_t ino, struct stat *stat);
+int ghostfs_truncate_ino(struct ghostfs *gfs, ino_t ino, off_t new_size);
+int ghostfs_utime_ino(struct ghostfs *gfs, ino_t ino, time_t mtime);
+int ghostfs_create_at(struct ghostfs *gfs, ino_t parent, const char *name, struct stat *stat);
+int ghostfs_mkdir_at(struct ghostfs *gfs, ino_t parent, const char *name, struct stat *stat);
+int ghostfs_unlink_at(struct ghostfs *gfs, ino_t parent, const char *name);
+int ghostfs_rmdir_at(struct ghostfs *gfs, ino_t parent, const char *name);
+int ghostfs_rename_at(struct ghostfs *gfs, ino_t parent, const char *name,
+		      ino_t newparent, const char *newname);
+int ghostfs_open_ino(struct ghostfs *gfs, ino_t ino, int flags, struct ghostfs_entry **pentry);
+int ghostfs_readdir(struct ghostfs *gfs, ino_t ino, off_t off,
+		    struct ghostfs_dirent *ents, int count, int flags);
 int ghostfs_statvfs(struct ghostfs *gfs, struct statvfs *stat);
 int ghostfs_format(struct stegger *stegger);
 int ghostfs_status(const struct ghostfs *gfs);
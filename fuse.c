@@ -1,14 +1,20 @@
+// for O_DIRECT
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "cipher.h"
 #include "fs.h"
 #include "passwd.h"
 #include "util.h"
@@ -17,131 +23,510 @@ struct gfs_context {
 	struct sampler *sampler;
 	struct stegger *stegger;
 	struct ghostfs *gfs;
+	int dirty_expire;
+	long dirty_limit;
+	int threads;
+	int compress;
+	bool dedup;
+	unsigned int max_write;
+	unsigned int max_read;
+	double attr_timeout;
+	double entry_timeout;
+	bool keep_cache;
+	bool writeback_cache;
 };
 
-static struct ghostfs *get_gfs(void)
+// entries fetched from ghostfs per readdir batch
+#define GFS_DIR_BATCH 64
+
+static long env_long(const char *name, long def)
+{
+	const char *env = getenv(name);
+
+	return env ? atol(env) : def;
+}
+
+static struct gfs_context *get_ctx(fuse_req_t req)
+{
+	return fuse_req_userdata(req);
+}
+
+static struct ghostfs *get_gfs(fuse_req_t req)
+{
+	return get_ctx(req)->gfs;
+}
+
+static void init_entry(fuse_req_t req, struct fuse_entry_param *e)
 {
-	return ((struct gfs_context *)fuse_get_context()->private_data)->gfs;
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = get_ctx(req)->attr_timeout;
+	e->entry_timeout = get_ctx(req)->entry_timeout;
 }
 
-static int gfs_fuse_unlink(const char *path)
+static void reply_entry(fuse_req_t req, const struct stat *stat)
 {
-	return ghostfs_unlink(get_gfs(), path);
+	struct fuse_entry_param e;
+
+	init_entry(req, &e);
+	e.ino = stat->st_ino;
+	e.attr = *stat;
+
+	// the kernel only holds the reference if the reply got through
+	if (fuse_reply_entry(req, &e) != 0)
+		ghostfs_forget(get_gfs(req), e.ino, 1);
 }
 
-static int gfs_fuse_mkdir(const char *path, mode_t mode)
+static void gfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	return ghostfs_mkdir(get_gfs(), path);
+	struct stat stat;
+	int ret;
+
+	ret = ghostfs_lookup(get_gfs(req), parent, name, &stat);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	reply_entry(req, &stat);
 }
 
-static int gfs_fuse_rmdir(const char *path)
+static void gfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-	return ghostfs_rmdir(get_gfs(), path);
+	ghostfs_forget(get_gfs(req), ino, nlookup);
+	fuse_reply_none(req);
 }
 
-static int gfs_fuse_truncate(const char *path, off_t newsize)
+static void gfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-	return ghostfs_truncate(get_gfs(), path, newsize);
+	struct ghostfs *gfs = get_gfs(req);
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		ghostfs_forget(gfs, forgets[i].ino, forgets[i].nlookup);
+
+	fuse_reply_none(req);
 }
 
-static int gfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *info)
+static void gfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
-	struct ghostfs *gfs = get_gfs();
+	struct stat stat;
+	int ret;
+
+	ret = ghostfs_getattr_ino(get_gfs(req), ino, &stat);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_attr(req, &stat, get_ctx(req)->attr_timeout);
+}
+
+static void gfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+			   struct fuse_file_info *info)
+{
+	struct ghostfs *gfs = get_gfs(req);
+	struct stat stat;
+	int ret;
+
+	// mode, owner and access time are not stored, ctime follows every change
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		ret = ghostfs_truncate_ino(gfs, ino, attr->st_size);
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+
+	if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) {
+		ret = ghostfs_utime_ino(gfs, ino, to_set & FUSE_SET_ATTR_MTIME_NOW ?
+					time(NULL) : attr->st_mtime);
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+
+	ret = ghostfs_getattr_ino(gfs, ino, &stat);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_attr(req, &stat, get_ctx(req)->attr_timeout);
+}
+
+static void gfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct stat stat;
+	int ret;
+
+	ret = ghostfs_mkdir_at(get_gfs(req), parent, name, &stat);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	reply_entry(req, &stat);
+}
+
+static void gfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, -ghostfs_unlink_at(get_gfs(req), parent, name));
+}
+
+static void gfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, -ghostfs_rmdir_at(get_gfs(req), parent, name));
+}
+
+static void gfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	// RENAME_NOREPLACE and RENAME_EXCHANGE are not supported
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	fuse_reply_err(req, -ghostfs_rename_at(get_gfs(req), parent, name, newparent, newname));
+}
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+// O_DIRECT handles bypass the cluster cache as well as the page cache
+static int open_flags(const struct fuse_file_info *info)
+{
+	return info->flags & O_DIRECT ? GHOSTFS_O_DIRECT : 0;
+}
+
+static void gfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+			  struct fuse_file_info *info)
+{
+	struct ghostfs *gfs = get_gfs(req);
 	struct ghostfs_entry *entry;
+	struct fuse_entry_param e;
 	int ret;
 
-	ret = ghostfs_create(gfs, path);
-	if (ret < 0)
-		return ret;
+	init_entry(req, &e);
+
+	ret = ghostfs_create_at(gfs, parent, name, &e.attr);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	e.ino = e.attr.st_ino;
 
-	ret = ghostfs_open(gfs, path, &entry);
+	ret = ghostfs_open_ino(gfs, e.ino, open_flags(info), &entry);
 	if (ret < 0) {
-		ghostfs_unlink(gfs, path);
-		return ret;
+		ghostfs_unlink_at(gfs, parent, name);
+		ghostfs_forget(gfs, e.ino, 1);
+		fuse_reply_err(req, -ret);
+		return;
 	}
 
-	info->fh = (intptr_t)entry;
-	return 0;
+	info->fh = (uintptr_t)entry;
+	info->keep_cache = get_ctx(req)->keep_cache;
+	info->direct_io = !!(info->flags & O_DIRECT);
+
+	if (fuse_reply_create(req, &e, info) != 0) {
+		ghostfs_release(entry);
+		ghostfs_forget(gfs, e.ino, 1);
+	}
 }
 
-static int gfs_fuse_open(const char *path, struct fuse_file_info *info)
+static void gfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
-	return ghostfs_open(get_gfs(), path, (struct ghostfs_entry **)&info->fh);
+	struct ghostfs_entry *entry;
+	int ret;
+
+	ret = ghostfs_open_ino(get_gfs(req), ino, open_flags(info), &entry);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	info->fh = (uintptr_t)entry;
+	info->keep_cache = get_ctx(req)->keep_cache;
+	info->direct_io = !!(info->flags & O_DIRECT);
+
+	if (fuse_reply_open(req, info) != 0)
+		ghostfs_release(entry);
 }
 
-static int gfs_fuse_release(const char *path, struct fuse_file_info *info)
+static void gfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
 	ghostfs_release((struct ghostfs_entry *)info->fh);
-	return 0;
+	fuse_reply_err(req, 0);
 }
 
-static int gfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *info)
+struct gfs_read {
+	fuse_req_t req;
+	bool replied;
+};
+
+// reply straight from the cluster cache, the kernel copies it out of there
+static int reply_iov(void *arg, const struct iovec *iov, int count)
 {
-	return ghostfs_write(get_gfs(), (struct ghostfs_entry *)info->fh, buf, size, offset);
+	struct gfs_read *rd = arg;
+
+	rd->replied = true;
+
+	return fuse_reply_iov(rd->req, iov, count);
 }
 
-static int gfs_fuse_read(const char *path, char *buf, size_t size, off_t offset,
-			 struct fuse_file_info *info)
+static void gfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			struct fuse_file_info *info)
 {
-	return ghostfs_read(get_gfs(), (struct ghostfs_entry *)info->fh, buf, size, offset);
+	struct gfs_read rd = { req, false };
+	int ret;
+
+	ret = ghostfs_read_iov(get_gfs(req), (struct ghostfs_entry *)info->fh, size, offset,
+			       reply_iov, &rd);
+	if (ret < 0 && !rd.replied)
+		fuse_reply_err(req, -ret);
 }
 
-static int gfs_fuse_opendir(const char *path, struct fuse_file_info *info)
+// copy the request data, possibly still in a pipe, into the cluster cache
+static int copy_bufvec(void *arg, const struct iovec *iov, int count)
 {
-	return ghostfs_opendir(get_gfs(), path, (struct ghostfs_entry **)&info->fh);
+	struct fuse_bufvec *src = arg;
+	struct fuse_bufvec *dst;
+	ssize_t ret;
+	int i;
+
+	dst = calloc(1, sizeof(*dst) + count * sizeof(struct fuse_buf));
+	if (!dst)
+		return -ENOMEM;
+
+	dst->count = count;
+	for (i = 0; i < count; i++) {
+		dst->buf[i].mem = iov[i].iov_base;
+		dst->buf[i].size = iov[i].iov_len;
+	}
+
+	ret = fuse_buf_copy(dst, src, 0);
+	free(dst);
+
+	return ret;
 }
 
-static int gfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			    off_t offset, struct fuse_file_info *info)
+static void gfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+			     off_t offset, struct fuse_file_info *info)
 {
-	struct ghostfs *gfs = get_gfs();
-	struct ghostfs_entry *dp = (struct ghostfs_entry *)info->fh;
 	int ret;
 
-	while ((ret = ghostfs_next_entry(gfs, dp)) == 0) {
-		if (filler(buf, ghostfs_entry_name(dp), NULL, 0) != 0)
-			return -ENOMEM;
+	ret = ghostfs_write_iov(get_gfs(req), (struct ghostfs_entry *)info->fh,
+				fuse_buf_size(bufv), offset, copy_bufvec, bufv);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void gfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+				   struct fuse_file_info *info_in, fuse_ino_t ino_out,
+				   off_t off_out, struct fuse_file_info *info_out, size_t len,
+				   int flags)
+{
+	ssize_t ret;
+
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
 	}
 
-	if (ret != -ENOENT)
-		return ret;
+	ret = ghostfs_copy_range(get_gfs(req), (struct ghostfs_entry *)info_in->fh, off_in,
+				 (struct ghostfs_entry *)info_out->fh, off_out, len);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void gfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t offset, int whence,
+			 struct fuse_file_info *info)
+{
+	off_t ret;
 
-	return 0;
+	ret = ghostfs_lseek(get_gfs(req), (struct ghostfs_entry *)info->fh, offset, whence);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_lseek(req, ret);
 }
 
-static int gfs_fuse_releasedir(const char *path, struct fuse_file_info *info)
+static void gfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+			     off_t length, struct fuse_file_info *info)
 {
-	ghostfs_closedir((struct ghostfs_entry *)info->fh);
-	return 0;
+	int ret;
+
+	ret = ghostfs_fallocate(get_gfs(req), (struct ghostfs_entry *)info->fh, mode, offset,
+				length);
+	fuse_reply_err(req, -ret);
 }
 
-static int gfs_fuse_getattr(const char *path, struct stat *stat)
+static void gfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
-	return ghostfs_getattr(get_gfs(), path, stat);
+	fuse_reply_err(req, -ghostfs_flush(get_gfs(req), (struct ghostfs_entry *)info->fh));
 }
 
-static int gfs_fuse_rename(const char *path, const char *newpath)
+static void gfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			 struct fuse_file_info *info)
 {
-	return ghostfs_rename(get_gfs(), path, newpath);
+	fuse_reply_err(req, -ghostfs_fsync(get_gfs(req), (struct ghostfs_entry *)info->fh));
 }
 
-static int gfs_fuse_statfs(const char *path, struct statvfs *stat)
+/*
+ * Entries come from ghostfs in batches, with their attributes and the offset
+ * to resume from, the kernel passes that offset back on the next call. With
+ * plus set every entry returned takes a lookup reference, the ones that do
+ * not fit are dropped again.
+ */
+static void gfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus)
 {
-	return ghostfs_statvfs(get_gfs(), stat);
+	struct ghostfs *gfs = get_gfs(req);
+	struct ghostfs_dirent *ents;
+	struct fuse_entry_param e;
+	size_t len = 0, n = 0;
+	char *buf;
+	int ret, i;
+
+	buf = malloc(size);
+	ents = malloc(GFS_DIR_BATCH * sizeof(*ents));
+	if (!buf || !ents) {
+		free(buf);
+		free(ents);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	init_entry(req, &e);
+
+	for (;;) {
+		ret = ghostfs_readdir(gfs, ino, offset, ents, GFS_DIR_BATCH,
+				      plus ? GHOSTFS_READDIR_LOOKUP : 0);
+		if (ret <= 0)
+			break;
+
+		for (i = 0; i < ret; i++) {
+			if (plus) {
+				e.ino = ents[i].stat.st_ino;
+				e.attr = ents[i].stat;
+				n = fuse_add_direntry_plus(req, buf + len, size - len, ents[i].name,
+							   &e, ents[i].off);
+			} else {
+				n = fuse_add_direntry(req, buf + len, size - len, ents[i].name,
+						      &ents[i].stat, ents[i].off);
+			}
+
+			if (n > size - len)
+				break;
+
+			len += n;
+			offset = ents[i].off;
+		}
+
+		if (i < ret) {
+			for (; plus && i < ret; i++)
+				ghostfs_forget(gfs, ents[i].stat.st_ino, 1);
+			break;
+		}
+	}
+
+	if (ret < 0 && len == 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, len);
+
+	free(ents);
+	free(buf);
 }
 
-static int gfs_fuse_chmod(const char *path, mode_t mode)
+static void gfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			   struct fuse_file_info *info)
 {
-	return 0;
+	gfs_readdir(req, ino, size, offset, false);
 }
 
-static int gfs_fuse_chown(const char *path, uid_t uid, gid_t gid)
+static void gfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			       struct fuse_file_info *info)
 {
-	return 0;
+	gfs_readdir(req, ino, size, offset, true);
 }
 
-void destroy(void *user)
+static void gfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+			    struct fuse_file_info *info)
+{
+	// directories are metadata, which any fsync writes
+	fuse_reply_err(req, -ghostfs_fsync(get_gfs(req), NULL));
+}
+
+static void gfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stat;
+	int ret;
+
+	ret = ghostfs_statvfs(get_gfs(req), &stat);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_statfs(req, &stat);
+}
+
+static void gfs_ll_init(void *user, struct fuse_conn_info *conn)
+{
+	struct gfs_context *ctx = user;
+	int ret;
+
+	/*
+	 * Large requests walk each cluster chain once instead of once per
+	 * 4 KiB page, libfuse lowers max_write to fit its buffers if needed.
+	 */
+	conn->max_write = ctx->max_write;
+	conn->max_read = ctx->max_read;
+	conn->max_readahead = ctx->max_read;
+
+	/*
+	 * With the writeback cache the kernel gathers small writes in its page
+	 * cache and sends them as whole pages, in batches. It then owns size and
+	 * mtime and sends them through setattr. It may also read files opened
+	 * write-only to fill partial pages, which open allows anyway.
+	 */
+	if (ctx->writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+	// have write data spliced into a pipe, write_buf copies it from there
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+
+	// started here since fuse_daemonize forks when going to background
+	ret = ghostfs_writeback_start(ctx->gfs, ctx->dirty_expire, ctx->dirty_limit);
+	if (ret < 0)
+		fprintf(stderr, "failed to start writeback: %s\n", strerror(-ret));
+
+	ret = ghostfs_pool_start(ctx->gfs, ctx->threads);
+	if (ret < 0)
+		fprintf(stderr, "failed to start worker threads: %s\n", strerror(-ret));
+
+	if (ctx->compress) {
+		ret = ghostfs_compress_start(ctx->gfs, ctx->compress);
+		if (ret < 0)
+			fprintf(stderr, "failed to start compression: %s\n", strerror(-ret));
+	}
+
+	if (ctx->dedup) {
+		ret = ghostfs_dedup_start(ctx->gfs);
+		if (ret < 0)
+			fprintf(stderr, "failed to start dedup: %s\n", strerror(-ret));
+	}
+}
+
+static void gfs_ll_destroy(void *user)
 {
 	struct gfs_context *ctx = user;
 	int ret;
@@ -159,76 +544,154 @@ void destroy(void *user)
 		fprintf(stderr, "failed to write filesystem: %s\n", strerror(-ret));
 }
 
-struct fuse_operations operations = {
-	.destroy = destroy,
-
-	.unlink = gfs_fuse_unlink,
-	.mkdir = gfs_fuse_mkdir,
-	.rmdir = gfs_fuse_rmdir,
-	.truncate = gfs_fuse_truncate,
-	.create = gfs_fuse_create,
-	.open = gfs_fuse_open,
-	.release = gfs_fuse_release,
-	.write = gfs_fuse_write,
-	.read = gfs_fuse_read,
-	.opendir = gfs_fuse_opendir,
-	.readdir = gfs_fuse_readdir,
-	.releasedir = gfs_fuse_releasedir,
-	.getattr = gfs_fuse_getattr,
-	.rename = gfs_fuse_rename,
-	.statfs = gfs_fuse_statfs,
-	.chmod = gfs_fuse_chmod,
-	.chown = gfs_fuse_chown
+static const struct fuse_lowlevel_ops operations = {
+	.init = gfs_ll_init,
+	.destroy = gfs_ll_destroy,
+
+	.lookup = gfs_ll_lookup,
+	.forget = gfs_ll_forget,
+	.forget_multi = gfs_ll_forget_multi,
+	.getattr = gfs_ll_getattr,
+	.setattr = gfs_ll_setattr,
+	.mkdir = gfs_ll_mkdir,
+	.unlink = gfs_ll_unlink,
+	.rmdir = gfs_ll_rmdir,
+	.rename = gfs_ll_rename,
+	.create = gfs_ll_create,
+	.open = gfs_ll_open,
+	.release = gfs_ll_release,
+	.read = gfs_ll_read,
+	.write_buf = gfs_ll_write_buf,
+	.copy_file_range = gfs_ll_copy_file_range,
+	.lseek = gfs_ll_lseek,
+	.fallocate = gfs_ll_fallocate,
+	.flush = gfs_ll_flush,
+	.fsync = gfs_ll_fsync,
+	.readdir = gfs_ll_readdir,
+	.readdirplus = gfs_ll_readdirplus,
+	.fsyncdir = gfs_ll_fsyncdir,
+	.statfs = gfs_ll_statfs
 };
 
 int main(int argc, char *argv[])
 {
-	char *fuse_argv[4];
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_loop_config config;
+	struct fuse_session *se;
 	int ret;
 	bool debug;
 	struct gfs_context ctx;
-	const char *env;
+	const char *env, *key;
+	char max_read[32];
+	int flags;
 
 	if (argc < 3) {
 		fprintf(stderr, "usage: ghost-fuse file mount_point <password>\n");
 		return 1;
 	}
 
-	ret = open_sampler_by_extension(&ctx.sampler, argv[1]);
+	// GHOSTFS_POPULATE=1 prefaults the whole carrier at mount
+	ret = open_sampler_by_extension(&ctx.sampler, argv[1],
+					env_long("GHOSTFS_POPULATE", 0) ? SAMPLER_POPULATE : 0);
 	if (ret < 0) {
 		fprintf(stderr, "invalid format\n");
 		return 1;
 	}
 
+	// GHOSTFS_KEY encrypts the filesystem with that password
+	key = getenv("GHOSTFS_KEY");
+
+	// GHOSTFS_REPAIR=1 checks every cluster, fixing what it can instead of failing
+	flags = env_long("GHOSTFS_REPAIR", 0) ? GHOSTFS_REPAIR : 0;
+
 	if (argc == 4) {
 		ret = passwd_open(&ctx.stegger, ctx.sampler, argv[3]);
+		if (ret == 0 && key)
+			ret = cipher_open(&ctx.stegger, ctx.stegger, key);
 		if (ret < 0) {
 			fprintf(stderr, "failed to mount: %s\n", strerror(-ret));
 			return 1;
 		}
 
-		ret = ghostfs_mount(&ctx.gfs, ctx.stegger);
+		ret = ghostfs_mount(&ctx.gfs, ctx.stegger, flags);
 		if (ret < 0) {
 			fprintf(stderr, "failed to mount: %s\n", strerror(-ret));
 			return 1;
 		}
 	} else {
-		ret = try_mount_lsb(&ctx.gfs, &ctx.stegger, ctx.sampler);
+		ret = try_mount_lsb(&ctx.gfs, &ctx.stegger, ctx.sampler, key, flags);
 		if (ret < 0) {
 			fprintf(stderr, "failed to mount: %s\n", strerror(-ret));
 			return 1;
 		}
 	}
 
-	fuse_argv[0] = argv[0];
-	fuse_argv[1] = argv[2];
-	// disable multithreading
-	fuse_argv[2] = "-s";
+	// write back clusters dirty for 5 seconds, or once 4 MiB are dirty
+	ctx.dirty_expire = env_long("GHOSTFS_DIRTY_EXPIRE", 5);
+	ctx.dirty_limit = env_long("GHOSTFS_DIRTY_LIMIT", 4096) * 1024;
+
+	// decode and encode large requests on all cores
+	ctx.threads = env_long("GHOSTFS_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+
+	// pack file data compressed at this zlib level, 0 stores it as is
+	ctx.compress = env_long("GHOSTFS_COMPRESS", 0);
+
+	// store runs of clusters already on the carrier as links to them
+	ctx.dedup = env_long("GHOSTFS_DEDUP", 0);
+
+	/*
+	 * All changes go through this mount, so the kernel can cache names,
+	 * attributes and file pages for long, the latter even across opens.
+	 */
+	ctx.attr_timeout = env_long("GHOSTFS_ATTR_TIMEOUT", 1);
+	ctx.entry_timeout = env_long("GHOSTFS_ENTRY_TIMEOUT", 1);
+	ctx.keep_cache = env_long("GHOSTFS_KEEP_CACHE", 1);
+	ctx.writeback_cache = env_long("GHOSTFS_WRITEBACK_CACHE", 1);
+
+	// requests of up to 1 MiB, the kernel splits larger ones
+	ctx.max_write = env_long("GHOSTFS_MAX_WRITE", 1024) * 1024;
+	ctx.max_read = env_long("GHOSTFS_MAX_READ", 1024) * 1024;
+	snprintf(max_read, sizeof(max_read), "max_read=%u", ctx.max_read);
 
 	env = getenv("GHOSTFS_DEBUG");
 	debug = env && atoi(env);
-	if (debug)
-		fuse_argv[3] = "-d";
 
-	return fuse_main(debug ? 4 : 3, fuse_argv, &operations, &ctx);
+	if (fuse_opt_add_arg(&args, argv[0]) < 0 ||
+	    fuse_opt_add_arg(&args, "-o") < 0 || fuse_opt_add_arg(&args, max_read) < 0 ||
+	    (debug && fuse_opt_add_arg(&args, "-d") < 0))
+		goto out_umount;
+
+	se = fuse_session_new(&args, &operations, sizeof(operations), &ctx);
+	if (!se)
+		goto out_umount;
+
+	if (fuse_set_signal_handlers(se) < 0)
+		goto out_destroy;
+
+	if (fuse_session_mount(se, argv[2]) < 0)
+		goto out_signals;
+
+	// like fuse_main, go to background unless debugging
+	fuse_daemonize(debug);
+
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	ret = fuse_session_loop_mt(se, &config);
+
+	// the destroy callback unmounts ghostfs
+	fuse_session_unmount(se);
+	fuse_remove_signal_handlers(se);
+	fuse_session_destroy(se);
+	fuse_opt_free_args(&args);
+
+	return ret ? 1 : 0;
+
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	fuse_session_destroy(se);
+out_umount:
+	gfs_ll_destroy(&ctx);
+	fuse_opt_free_args(&args);
+	return 1;
 }
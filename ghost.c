@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cipher.h"
 #include "fs.h"
 #include "lsb.h"
 #include "passwd.h"
@@ -13,6 +14,11 @@ int main(int argc, char *argv[])
 	struct sampler *sampler = NULL;
 	struct stegger *stegger = NULL;
 	struct ghostfs *gfs = NULL;
+	struct ghostfs_dedup_stats dedup;
+	// GHOSTFS_KEY encrypts the filesystem with that password
+	const char *key = getenv("GHOSTFS_KEY");
+	// GHOSTFS_REPAIR=1 checks every cluster, fixing what it can instead of failing
+	const char *repair = getenv("GHOSTFS_REPAIR");
 	int ret;
 
 	if (argc < 2) {
@@ -20,12 +26,14 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	ret = open_sampler_by_extension(&sampler, argv[1]);
+	ret = open_sampler_by_extension(&sampler, argv[1], 0);
 	if (ret < 0)
 		goto umount;
 
 	if (argc == 4 && strcmp(argv[2], "f") == 0) {
 		ret = lsb_open(&stegger, sampler, atoi(argv[3]));
+		if (ret == 0 && key)
+			ret = cipher_create(&stegger, stegger, key);
 		if (ret < 0)
 			goto umount;
 
@@ -36,6 +44,8 @@ int main(int argc, char *argv[])
 
 	if (argc == 4 && strcmp(argv[2], "fp") == 0) {
 		ret = passwd_open(&stegger, sampler, argv[3]);
+		if (ret == 0 && key)
+			ret = cipher_create(&stegger, stegger, key);
 		if (ret < 0)
 			goto umount;
 
@@ -44,12 +54,18 @@ int main(int argc, char *argv[])
 		goto umount;
 	}
 
-	ret = try_mount_lsb(&gfs, &stegger, sampler);
+	ret = try_mount_lsb(&gfs, &stegger, sampler, key,
+			    repair && atoi(repair) ? GHOSTFS_REPAIR : 0);
 	if (ret < 0)
 		goto umount;
 
 	printf("cluster count = %d\n", ghostfs_cluster_count(gfs));
 
+	ghostfs_dedup_stats(gfs, &dedup);
+	if (dedup.linked)
+		printf("linked clusters = %lu in %lu, saving %lu of %lu (%.1f%%)\n", dedup.linked,
+		       dedup.links, dedup.saved, dedup.logical, dedup.ratio * 100);
+
 	if (argc < 3)
 		return 0;
 
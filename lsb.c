@@ -113,6 +113,35 @@ static int lsb_write(struct stegger *stegger, const void *buf, size_t size, size
 	return 0;
 }
 
+// lsb_samples finds the samples holding bytes offset .. offset+size-1
+static void lsb_samples(struct lsb *lsb, size_t size, size_t offset, long *first, long *count)
+{
+	long last = ((offset + size) * 8 + lsb->bits - 1) / lsb->bits;
+
+	*first = offset * 8 / lsb->bits;
+	*count = last - *first;
+}
+
+static int lsb_sync(struct stegger *stegger, size_t size, size_t offset, int flags)
+{
+	struct lsb *lsb = container_of(stegger, struct lsb, stegger);
+	long first, count;
+
+	lsb_samples(lsb, size, offset, &first, &count);
+
+	return sampler_sync(lsb->sampler, first, count, flags);
+}
+
+static int lsb_advise(struct stegger *stegger, size_t size, size_t offset, int advice)
+{
+	struct lsb *lsb = container_of(stegger, struct lsb, stegger);
+	long first, count;
+
+	lsb_samples(lsb, size, offset, &first, &count);
+
+	return sampler_advise(lsb->sampler, first, count, advice);
+}
+
 static int lsb_close(struct stegger *stegger)
 {
 	struct lsb *lsb = container_of(stegger, struct lsb, stegger);
@@ -136,7 +165,11 @@ int lsb_open(struct stegger **stegger, struct sampler *sampler, int bits)
 	lsb->stegger.capacity = sampler->count * bits / 8;
 	lsb->stegger.read = lsb_read;
 	lsb->stegger.write = lsb_write;
+	lsb->stegger.sync = lsb_sync;
+	lsb->stegger.advise = lsb_advise;
 	lsb->stegger.close = lsb_close;
+	lsb->stegger.seal = NULL;
+	lsb->stegger.unseal = NULL;
 
 	lsb->sampler = sampler;
 	lsb->bits = bits;
@@ -111,6 +111,20 @@ static int passwd_write(struct stegger *stegger, const void *buf, size_t size, s
 	return 0;
 }
 
+static int passwd_sync(struct stegger *stegger, size_t size, size_t offset, int flags)
+{
+	struct passwd *pwd = container_of(stegger, struct passwd, stegger);
+
+	return sampler_sync(pwd->sampler, offset * 8, size * 8, flags);
+}
+
+static int passwd_advise(struct stegger *stegger, size_t size, size_t offset, int advice)
+{
+	struct passwd *pwd = container_of(stegger, struct passwd, stegger);
+
+	return sampler_advise(pwd->sampler, offset * 8, size * 8, advice);
+}
+
 static int passwd_close(struct stegger *stegger)
 {
 	struct passwd *pwd = container_of(stegger, struct passwd, stegger);
@@ -143,7 +157,11 @@ int passwd_open(struct stegger **stegger, struct sampler *sampler, const char *p
 	pwd->stegger.capacity = sampler->count / 8;
 	pwd->stegger.read = passwd_read;
 	pwd->stegger.write = passwd_write;
+	pwd->stegger.sync = passwd_sync;
+	pwd->stegger.advise = passwd_advise;
 	pwd->stegger.close = passwd_close;
+	pwd->stegger.seal = NULL;
+	pwd->stegger.unseal = NULL;
 
 	pwd->sampler = sampler;
 
@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include "poly1305.h"
+
+/*
+ * 130-bit arithmetic on five 26-bit limbs, products fitting in 64 bits, as
+ * in poly1305-donna.
+ */
+static inline uint32_t load32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+void poly1305_init(struct poly1305 *ctx, const unsigned char *key)
+{
+	// r is clamped as the RFC says
+	ctx->r[0] = load32(key + 0) & 0x3ffffff;
+	ctx->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+	ctx->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+	ctx->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+	ctx->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+
+	memset(ctx->h, 0, sizeof(ctx->h));
+
+	ctx->pad[0] = load32(key + 16);
+	ctx->pad[1] = load32(key + 20);
+	ctx->pad[2] = load32(key + 24);
+	ctx->pad[3] = load32(key + 28);
+
+	ctx->used = 0;
+}
+
+// poly1305_block adds the 16-byte block m, with hibit above it, and multiplies by r
+static void poly1305_block(struct poly1305 *ctx, const unsigned char *m, uint32_t hibit)
+{
+	const uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2], r3 = ctx->r[3], r4 = ctx->r[4];
+	const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2], h3 = ctx->h[3], h4 = ctx->h[4];
+	uint64_t d0, d1, d2, d3, d4;
+	uint32_t c;
+
+	h0 += load32(m + 0) & 0x3ffffff;
+	h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+	h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+	h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+	h4 += (load32(m + 12) >> 8) | hibit;
+
+	d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+	     (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+	d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+	     (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+	d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+	     (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+	d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+	     (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+	d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+	     (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+	c = d0 >> 26; h0 = d0 & 0x3ffffff;
+	d1 += c; c = d1 >> 26; h1 = d1 & 0x3ffffff;
+	d2 += c; c = d2 >> 26; h2 = d2 & 0x3ffffff;
+	d3 += c; c = d3 >> 26; h3 = d3 & 0x3ffffff;
+	d4 += c; c = d4 >> 26; h4 = d4 & 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	ctx->h[0] = h0;
+	ctx->h[1] = h1;
+	ctx->h[2] = h2;
+	ctx->h[3] = h3;
+	ctx->h[4] = h4;
+}
+
+void poly1305_update(struct poly1305 *ctx, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	size_t len;
+
+	if (ctx->used) {
+		len = sizeof(ctx->buf) - ctx->used < size ? sizeof(ctx->buf) - ctx->used : size;
+		memcpy(ctx->buf + ctx->used, p, len);
+		ctx->used += len;
+		p += len;
+		size -= len;
+		if (ctx->used < sizeof(ctx->buf))
+			return;
+		poly1305_block(ctx, ctx->buf, 1 << 24);
+		ctx->used = 0;
+	}
+
+	for (; size >= 16; p += 16, size -= 16)
+		poly1305_block(ctx, p, 1 << 24);
+
+	memcpy(ctx->buf, p, size);
+	ctx->used = size;
+}
+
+void poly1305_final(struct poly1305 *ctx, unsigned char *tag)
+{
+	uint32_t h0, h1, h2, h3, h4, g0, g1, g2, g3, g4, c, mask;
+	uint64_t f;
+
+	// the last partial block gets its 1 byte in place of the high bit
+	if (ctx->used) {
+		ctx->buf[ctx->used] = 1;
+		memset(ctx->buf + ctx->used + 1, 0, sizeof(ctx->buf) - ctx->used - 1);
+		poly1305_block(ctx, ctx->buf, 0);
+	}
+
+	h0 = ctx->h[0]; h1 = ctx->h[1]; h2 = ctx->h[2]; h3 = ctx->h[3]; h4 = ctx->h[4];
+
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	// h - p, taken if it does not borrow, without branching on h
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1 << 26);
+
+	mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	// h mod 2^128, plus pad
+	h0 = h0 | h1 << 26;
+	h1 = h1 >> 6 | h2 << 20;
+	h2 = h2 >> 12 | h3 << 14;
+	h3 = h3 >> 18 | h4 << 8;
+
+	f = (uint64_t)h0 + ctx->pad[0];
+	store32(tag + 0, f);
+	f = (uint64_t)h1 + ctx->pad[1] + (f >> 32);
+	store32(tag + 4, f);
+	f = (uint64_t)h2 + ctx->pad[2] + (f >> 32);
+	store32(tag + 8, f);
+	f = (uint64_t)h3 + ctx->pad[3] + (f >> 32);
+	store32(tag + 12, f);
+}
@@ -0,0 +1,23 @@
+#ifndef GHOST_POLY1305_H
+#define GHOST_POLY1305_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POLY1305_KEY_SIZE 32
+#define POLY1305_TAG_SIZE 16
+
+// Poly1305 (RFC 8439), the key must only ever authenticate one message
+struct poly1305 {
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+	unsigned char buf[16];
+	size_t used;
+};
+
+void poly1305_init(struct poly1305 *ctx, const unsigned char *key);
+void poly1305_update(struct poly1305 *ctx, const void *data, size_t size);
+void poly1305_final(struct poly1305 *ctx, unsigned char *tag);
+
+#endif
@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/*
+ * A pool runs fn(arg, 0..count-1) on its threads and the calling thread.
+ * Tasks are handed out through a shared cursor, so a thread that is done
+ * early keeps taking the remaining ones.
+ */
+struct pool {
+	pthread_t *threads;
+	int nr_threads;
+
+	// one job at a time, callers that find the pool busy run inline
+	pthread_mutex_t run_lock;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	unsigned int generation;
+	int busy;
+	bool stop;
+
+	pool_fn fn;
+	void *arg;
+	int count;
+	int next;
+};
+
+static void pool_work(struct pool *pool)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+		pool->fn(pool->arg, i);
+}
+
+static void *pool_thread(void *arg)
+{
+	struct pool *pool = arg;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+		if (pool->stop)
+			break;
+
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int pool_create(struct pool **ppool, int threads)
+{
+	struct pool *pool;
+	int ret;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	pool->threads = calloc(threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (; pool->nr_threads < threads; pool->nr_threads++) {
+		ret = pthread_create(&pool->threads[pool->nr_threads], NULL, pool_thread, pool);
+		if (ret) {
+			pool_destroy(pool);
+			return -ret;
+		}
+	}
+
+	*ppool = pool;
+
+	return 0;
+}
+
+void pool_run(struct pool *pool, int count, pool_fn fn, void *arg)
+{
+	int i;
+
+	if (!pool || count < 2 || pthread_mutex_trylock(&pool->run_lock)) {
+		for (i = 0; i < count; i++)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->count = count;
+	pool->next = 0;
+	pool->busy = pool->nr_threads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+}
+
+void pool_destroy(struct pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run_lock);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,12 @@
+#ifndef GHOST_POOL_H
+#define GHOST_POOL_H
+
+struct pool;
+
+typedef void (*pool_fn)(void *arg, int index);
+
+int pool_create(struct pool **ppool, int threads);
+void pool_run(struct pool *pool, int count, pool_fn fn, void *arg);
+void pool_destroy(struct pool *pool);
+
+#endif
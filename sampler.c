@@ -7,9 +7,10 @@
 
 #include "sampler.h"
 
-int sampler_init(struct sampler *sampler, const char *filename)
+int sampler_init(struct sampler *sampler, const char *filename, int flags)
 {
 	struct stat st;
+	int mmap_flags = MAP_SHARED;
 	int fd;
 	int ret;
 
@@ -23,7 +24,10 @@ int sampler_init(struct sampler *sampler, const char *filename)
 		return ret;
 	}
 
-	sampler->map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (flags & SAMPLER_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+
+	sampler->map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, mmap_flags, fd, 0);
 	if (sampler->map == MAP_FAILED) {
 		ret = -errno;
 		close(fd);
@@ -36,6 +40,49 @@ int sampler_init(struct sampler *sampler, const char *filename)
 	return 0;
 }
 
+// sampler_pages finds the page aligned part of the map holding samples nr .. nr+count-1
+static void sampler_pages(struct sampler *sampler, long nr, long count, long *start, long *len)
+{
+	const long page_size = sysconf(_SC_PAGESIZE);
+	const int sample_size = sampler->bits / 8;
+	long end;
+
+	*start = sampler->ptr - sampler->map + nr * sample_size;
+	end = *start + count * sample_size;
+
+	*start -= *start % page_size;
+	if (end > sampler->size)
+		end = sampler->size;
+
+	*len = end - *start;
+}
+
+// sampler_sync msyncs the samples nr .. nr+count-1 (MS_SYNC or MS_ASYNC)
+int sampler_sync(struct sampler *sampler, long nr, long count, int flags)
+{
+	long start, len;
+
+	sampler_pages(sampler, nr, count, &start, &len);
+
+	if (msync(sampler->map + start, len, flags) < 0)
+		return -errno;
+
+	return 0;
+}
+
+// sampler_advise applies madvise advice to the samples nr .. nr+count-1
+int sampler_advise(struct sampler *sampler, long nr, long count, int advice)
+{
+	long start, len;
+
+	sampler_pages(sampler, nr, count, &start, &len);
+
+	if (madvise(sampler->map + start, len, advice) < 0)
+		return -errno;
+
+	return 0;
+}
+
 int sampler_close(struct sampler *sampler)
 {
 	if (munmap(sampler->map, sampler->size) < 0) {
@@ -49,7 +49,12 @@ static inline void sampler_write(struct sampler *self, long nr, sample_t sample)
 	}
 }
 
-int sampler_init(struct sampler *sampler, const char *filename);
+// prefault the whole carrier when mapping it
+#define SAMPLER_POPULATE 1
+
+int sampler_init(struct sampler *sampler, const char *filename, int flags);
+int sampler_sync(struct sampler *sampler, long nr, long count, int flags);
+int sampler_advise(struct sampler *sampler, long nr, long count, int advice);
 int sampler_close(struct sampler *sampler);
 
 #endif
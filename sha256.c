@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+
+static inline uint32_t load32_be(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void store32_be(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void sha256_block(uint32_t *state, const unsigned char *block)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = load32_be(block + i * 4);
+
+	for (; i < 64; i++) {
+		t1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+		     sha256_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, iv, sizeof(iv));
+	ctx->len = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	size_t used = ctx->len % SHA256_BLOCK, len;
+
+	ctx->len += size;
+
+	if (used) {
+		len = SHA256_BLOCK - used < size ? SHA256_BLOCK - used : size;
+		memcpy(ctx->buf + used, p, len);
+		p += len;
+		size -= len;
+		if (used + len < SHA256_BLOCK)
+			return;
+		sha256_block(ctx->h, ctx->buf);
+	}
+
+	for (; size >= SHA256_BLOCK; p += SHA256_BLOCK, size -= SHA256_BLOCK)
+		sha256_block(ctx->h, p);
+
+	memcpy(ctx->buf, p, size);
+}
+
+void sha256_final(struct sha256 *ctx, unsigned char *out)
+{
+	size_t used = ctx->len % SHA256_BLOCK;
+	uint64_t bits = ctx->len * 8;
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > SHA256_BLOCK - 8) {
+		memset(ctx->buf + used, 0, SHA256_BLOCK - used);
+		sha256_block(ctx->h, ctx->buf);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, SHA256_BLOCK - 8 - used);
+
+	store32_be(ctx->buf + SHA256_BLOCK - 8, bits >> 32);
+	store32_be(ctx->buf + SHA256_BLOCK - 4, bits);
+	sha256_block(ctx->h, ctx->buf);
+
+	for (i = 0; i < 8; i++)
+		store32_be(out + i * 4, ctx->h[i]);
+}
+
+/*
+ * The HMAC inner and outer states after the padded key are computed once,
+ * each iteration then costs two blocks, the digest fitting in one.
+ */
+struct hmac_sha256 {
+	struct sha256 inner;
+	struct sha256 outer;
+};
+
+static void hmac_sha256_init(struct hmac_sha256 *hmac, const void *key, size_t size)
+{
+	unsigned char pad[SHA256_BLOCK] = { 0 };
+	int i;
+
+	if (size > SHA256_BLOCK) {
+		sha256_init(&hmac->inner);
+		sha256_update(&hmac->inner, key, size);
+		sha256_final(&hmac->inner, pad);
+	} else {
+		memcpy(pad, key, size);
+	}
+
+	for (i = 0; i < SHA256_BLOCK; i++)
+		pad[i] ^= 0x36;
+	sha256_init(&hmac->inner);
+	sha256_update(&hmac->inner, pad, sizeof(pad));
+
+	for (i = 0; i < SHA256_BLOCK; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	sha256_init(&hmac->outer);
+	sha256_update(&hmac->outer, pad, sizeof(pad));
+}
+
+// hmac_sha256_final finishes ctx, a copy of hmac->inner fed with the message
+static void hmac_sha256_final(const struct hmac_sha256 *hmac, struct sha256 *ctx,
+			      unsigned char *out)
+{
+	sha256_final(ctx, out);
+
+	*ctx = hmac->outer;
+	sha256_update(ctx, out, SHA256_SIZE);
+	sha256_final(ctx, out);
+}
+
+void pbkdf2_sha256(const void *password, size_t password_size, const void *salt,
+		   size_t salt_size, unsigned long iterations, unsigned char *out, size_t size)
+{
+	unsigned char u[SHA256_SIZE], t[SHA256_SIZE], index[4];
+	struct hmac_sha256 hmac;
+	struct sha256 ctx;
+	unsigned long n;
+	uint32_t block;
+	size_t len;
+	int i;
+
+	hmac_sha256_init(&hmac, password, password_size);
+
+	for (block = 1; size; block++, out += len, size -= len) {
+		store32_be(index, block);
+
+		ctx = hmac.inner;
+		sha256_update(&ctx, salt, salt_size);
+		sha256_update(&ctx, index, sizeof(index));
+		hmac_sha256_final(&hmac, &ctx, u);
+		memcpy(t, u, sizeof(t));
+
+		for (n = 1; n < iterations; n++) {
+			ctx = hmac.inner;
+			sha256_update(&ctx, u, sizeof(u));
+			hmac_sha256_final(&hmac, &ctx, u);
+			for (i = 0; i < SHA256_SIZE; i++)
+				t[i] ^= u[i];
+		}
+
+		len = size < sizeof(t) ? size : sizeof(t);
+		memcpy(out, t, len);
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef GHOST_SHA256_H
+#define GHOST_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+#define SHA256_BLOCK 64
+
+struct sha256 {
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char buf[SHA256_BLOCK];
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t size);
+void sha256_final(struct sha256 *ctx, unsigned char *out);
+
+// pbkdf2_sha256 derives size bytes into out with PBKDF2-HMAC-SHA256 (RFC 8018)
+void pbkdf2_sha256(const void *password, size_t password_size, const void *salt,
+		   size_t salt_size, unsigned long iterations, unsigned char *out, size_t size);
+
+#endif
@@ -1,15 +1,27 @@
 #ifndef GHOST_STEGGER_H
 #define GHOST_STEGGER_H
 
+#include <stdint.h>
+
 #include "sampler.h"
 #include "util.h"
 
+#define STEGGER_TAG_SIZE 16
+
 struct stegger {
 	long capacity;
 
 	int (*read)(struct stegger *stegger, void *buf, size_t size, size_t offset);
 	int (*write)(struct stegger *stegger, const void *buf, size_t size, size_t offset);
+	int (*sync)(struct stegger *stegger, size_t size, size_t offset, int flags);
+	int (*advise)(struct stegger *stegger, size_t size, size_t offset, int advice);
 	int (*close)(struct stegger *stegger);
+
+	// NULL but for steggers that encrypt, see stegger_seal
+	int (*seal)(struct stegger *stegger, const void *buf, size_t size, size_t offset,
+		    uint64_t nonce, const void *aad, size_t aad_size, unsigned char *tag);
+	int (*unseal)(struct stegger *stegger, void *buf, size_t size, size_t offset,
+		      uint64_t nonce, const void *aad, size_t aad_size, const unsigned char *tag);
 };
 
 static inline int stegger_read(struct stegger *stegger, void *buf, size_t size, size_t offset)
@@ -22,6 +34,39 @@ static inline int stegger_write(struct stegger *stegger, const void *buf, size_t
 	return stegger->write(stegger, buf, size, offset);
 }
 
+// stegger_sync msyncs the carrier holding the given range (MS_SYNC or MS_ASYNC)
+static inline int stegger_sync(struct stegger *stegger, size_t size, size_t offset, int flags)
+{
+	return stegger->sync(stegger, size, offset, flags);
+}
+
+// stegger_advise passes madvise advice for the carrier holding the given range
+static inline int stegger_advise(struct stegger *stegger, size_t size, size_t offset, int advice)
+{
+	return stegger->advise(stegger, size, offset, advice);
+}
+
+/*
+ * stegger_seal encrypts buf into the range with a keystream of its own,
+ * nonce never being used twice, and sets tag to authenticate the range,
+ * where it is and aad, which is not stored. stegger_unseal fails with
+ * -EBADMSG if tag does not match the range and the same aad, or decrypts a
+ * prefix of the range without checking it when tag is NULL.
+ */
+static inline int stegger_seal(struct stegger *stegger, const void *buf, size_t size,
+			       size_t offset, uint64_t nonce, const void *aad, size_t aad_size,
+			       unsigned char *tag)
+{
+	return stegger->seal(stegger, buf, size, offset, nonce, aad, aad_size, tag);
+}
+
+static inline int stegger_unseal(struct stegger *stegger, void *buf, size_t size,
+				 size_t offset, uint64_t nonce, const void *aad, size_t aad_size,
+				 const unsigned char *tag)
+{
+	return stegger->unseal(stegger, buf, size, offset, nonce, aad, aad_size, tag);
+}
+
 static inline int stegger_close(struct stegger *stegger)
 {
 	return stegger->close(stegger);
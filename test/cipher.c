@@ -0,0 +1,266 @@
+/*
+ * cipher formats with a key, remounts and reads back, then checks that a
+ * wrong key does not mount, that rewriting the same data changes every
+ * cluster it lands in, and that a changed cluster fails to read until
+ * repaired. Then that a cluster whose generations are cleared from the
+ * table, or whose header is changed, fails to read too, and that the
+ * generation reserve cannot be changed. PBKDF2 and Poly1305 are checked
+ * against the RFC vectors first.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cipher.h"
+#include "common.h"
+#include "poly1305.h"
+#include "sha256.h"
+
+#define CLUSTERS 8
+#define SCANNED 64
+// the cipher keeps its salt before the filesystem
+#define SALT 16
+// struct sealed_sum, its generations follow the checksum
+#define ENTRY_SIZE 52
+#define ENTRIES (CLUSTER_DATA / ENTRY_SIZE)
+// set_gens cluster for the generation reserve
+#define RESERVE -1
+
+static void check_vectors(void)
+{
+	// RFC 7914 section 11, first vector
+	static const unsigned char dk[64] = {
+		0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f,
+		0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+		0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65,
+		0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+		0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45,
+		0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+		0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5,
+		0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83,
+	};
+	// RFC 8439 section 2.5.2
+	static const unsigned char key[POLY1305_KEY_SIZE] = {
+		0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+		0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+		0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+		0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b,
+	};
+	static const unsigned char tag[POLY1305_TAG_SIZE] = {
+		0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+		0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9,
+	};
+	const char *msg = "Cryptographic Forum Research Group";
+	unsigned char out[64];
+	struct poly1305 ctx;
+
+	pbkdf2_sha256("passwd", 6, "salt", 4, 1, out, sizeof(dk));
+	if (memcmp(out, dk, sizeof(dk)) != 0)
+		errx(1, "pbkdf2_sha256 does not match RFC 7914");
+
+	// in two pieces, not on a block boundary
+	poly1305_init(&ctx, key);
+	poly1305_update(&ctx, msg, 5);
+	poly1305_update(&ctx, msg + 5, strlen(msg) - 5);
+	poly1305_final(&ctx, out);
+	if (memcmp(out, tag, sizeof(tag)) != 0)
+		errx(1, "poly1305 does not match RFC 8439");
+}
+
+// snapshot reads SCANNED clusters from 2 on, after the root directory and its times
+static void snapshot(struct test_fs *t, unsigned char *buf)
+{
+	struct stegger *raw = test_raw(t);
+
+	CHECK(stegger_read(raw, buf, SCANNED * 4096, SALT + TEST_C0_OFFSET + 2 * 4096));
+	test_raw_close(t, raw);
+}
+
+/*
+ * set_gens sets both generations cluster nr has in the table to gen,
+ * through the cipher, leaving the checksums as they are
+ */
+static void set_gens(struct test_fs *t, int nr, uint64_t gen)
+{
+	struct stegger *s = test_raw(t);
+	uint16_t sums;
+	size_t entry;
+
+	CHECK(cipher_open(&s, s, t->key));
+	CHECK(stegger_read(s, &sums, sizeof(sums), 8));
+
+	// the reserve is the entry of the first table cluster
+	if (nr == RESERVE)
+		nr = sums;
+
+	entry = TEST_C0_OFFSET + (size_t)(sums + nr / ENTRIES) * 4096 + nr % ENTRIES * ENTRY_SIZE;
+	CHECK(stegger_write(s, &gen, sizeof(gen), entry + 4));
+	CHECK(stegger_write(s, &gen, sizeof(gen), entry + 4 + 8 + 16));
+	test_raw_close(t, s);
+}
+
+// xor_byte xors the byte at offset in cluster nr as stored in the carrier with x
+static void xor_byte(struct test_fs *t, int nr, size_t offset, unsigned char x)
+{
+	struct stegger *raw = test_raw(t);
+	unsigned char c;
+
+	offset += SALT + TEST_C0_OFFSET + (size_t)nr * 4096;
+	CHECK(stegger_read(raw, &c, 1, offset));
+	c ^= x;
+	CHECK(stegger_write(raw, &c, 1, offset));
+	test_raw_close(t, raw);
+}
+
+// check_repaired checks that data reads back with one of its clusters zeroed
+static void check_repaired(struct test_fs *t, const char *path, const char *data, size_t size)
+{
+	struct ghostfs_entry *entry;
+	char *buf, zeros[CLUSTER_DATA] = { 0 };
+	size_t i;
+	int zeroed = 0;
+
+	buf = malloc(size);
+	if (!buf)
+		errx(1, "out of memory");
+
+	CHECK(ghostfs_open(t->gfs, path, &entry));
+	if (ghostfs_read(t->gfs, entry, buf, size, 0) != (int)size)
+		errx(1, "short read of %s after repair", path);
+	ghostfs_release(entry);
+
+	for (i = 0; i < size; i += CLUSTER_DATA) {
+		if (memcmp(buf + i, data + i, CLUSTER_DATA) == 0)
+			continue;
+		if (memcmp(buf + i, zeros, CLUSTER_DATA) != 0)
+			errx(1, "repaired %s holds other data", path);
+		zeroed++;
+	}
+	if (zeroed != 1)
+		errx(1, "repair zeroed %d clusters of %s", zeroed, path);
+
+	free(buf);
+}
+
+int main(void)
+{
+	unsigned char *before, *after;
+	struct test_fs t;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	char *data, *text;
+	int changed = 0, first = 0, nr = 0, i, ret;
+
+	check_vectors();
+
+	data = malloc(size);
+	text = malloc(size + CLUSTER_DATA);
+	before = malloc(SCANNED * 4096);
+	after = malloc(SCANNED * 4096);
+	if (!data || !text || !before || !after)
+		errx(1, "out of memory");
+
+	test_fill(data, size, 1, 0);
+	test_fill(text, size + CLUSTER_DATA, 2, 1);
+
+	test_format(&t, 256, "secret");
+	test_write(&t, "/data", data, size, 0);
+	test_write(&t, "/text", text, size, 0);
+	test_remount(&t);
+
+	test_read(&t, "/data", data, size);
+	test_read(&t, "/text", text, size);
+	test_umount(&t);
+
+	snapshot(&t, before);
+	if (memmem(before, SCANNED * 4096, text, 64))
+		errx(1, "text stored in the clear");
+
+	t.key = "wrong";
+	if (test_try_mount(&t) >= 0)
+		errx(1, "mounted with the wrong key");
+	t.key = "secret";
+
+	// the same data again, under new nonces
+	test_mount(&t);
+	test_write(&t, "/data", data, size, 0);
+	test_umount(&t);
+
+	snapshot(&t, after);
+	for (i = 0; i < SCANNED; i++) {
+		if (memcmp(before + i * 4096, after + i * 4096, 4096) != 0) {
+			first = first ? first : i + 2;
+			changed++;
+			nr = i + 2;
+		}
+	}
+	if (changed < CLUSTERS)
+		errx(1, "rewrite changed %d clusters of %d", changed, CLUSTERS);
+
+	// flip a bit in the data of the last one, which /data holds
+	xor_byte(&t, nr, 100, 0x10);
+
+	test_mount(&t);
+	ret = test_read(&t, "/data", data, size);
+	if (ret != -EIO)
+		errx(1, "read of a changed cluster returned %d", ret);
+	test_read(&t, "/text", text, size);
+	test_umount(&t);
+
+	// repair zeroes it for good
+	t.flags = GHOSTFS_REPAIR;
+	test_mount(&t);
+	check_repaired(&t, "/data", data, size);
+	test_umount(&t);
+	t.flags = 0;
+	test_mount(&t);
+	check_repaired(&t, "/data", data, size);
+	test_read(&t, "/text", text, size);
+	test_umount(&t);
+
+	// a cluster never sealed reads as nothing
+	set_gens(&t, nr, 0);
+	test_mount(&t);
+	ret = test_read(&t, "/data", data, size);
+	if (ret != -EIO)
+		errx(1, "read of a cluster without generation returned %d", ret);
+	test_write(&t, "/data", data, size, 0);
+	test_remount(&t);
+	test_read(&t, "/data", data, size);
+	test_umount(&t);
+
+	// an older reserve would have generations used again
+	set_gens(&t, RESERVE, 1);
+	if (test_try_mount(&t) != -EIO)
+		errx(1, "mounted with a changed generation reserve");
+	t.flags = GHOSTFS_REPAIR;
+	test_mount(&t);
+	test_umount(&t);
+	t.flags = 0;
+	test_mount(&t);
+	test_read(&t, "/data", data, size);
+	test_umount(&t);
+
+	// appending changes the header of the last cluster alone, it is sealed again with it
+	test_mount(&t);
+	test_write(&t, "/text", text + size, CLUSTER_DATA, size);
+	test_remount(&t);
+	test_read(&t, "/text", text, size + CLUSTER_DATA);
+	test_umount(&t);
+
+	// the header is sealed along: have the first cluster of /data skip the second
+	xor_byte(&t, first, CLUSTER_DATA, (first + 1) ^ (first + 2));
+	test_mount(&t);
+	ret = test_read(&t, "/data", data, size);
+	if (ret != -EIO)
+		errx(1, "read of a cluster with a changed header returned %d", ret);
+	test_read(&t, "/text", text, size + CLUSTER_DATA);
+
+	test_remove(&t);
+	free(data);
+	free(text);
+	free(before);
+	free(after);
+
+	return 0;
+}
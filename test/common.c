@@ -0,0 +1,227 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cipher.h"
+#include "common.h"
+#include "lsb.h"
+#include "util.h"
+
+#define TEST_BITS 4
+#define TEST_WIDTH 1024
+
+static void write_bmp(const char *path, int fd, long width, long height)
+{
+	unsigned char hdr[54] = { 'B', 'M' };
+	long size = width * height * 3;
+	unsigned char *pixels;
+	FILE *f;
+	long i;
+
+	*(uint32_t *)(hdr + 2) = sizeof(hdr) + size;
+	*(uint32_t *)(hdr + 10) = sizeof(hdr);
+	*(uint32_t *)(hdr + 14) = 40;
+	*(uint32_t *)(hdr + 18) = width;
+	*(uint32_t *)(hdr + 22) = height;
+	*(uint16_t *)(hdr + 26) = 1;
+	*(uint16_t *)(hdr + 28) = 24;
+
+	pixels = malloc(size);
+	if (!pixels)
+		errx(1, "out of memory");
+	for (i = 0; i < size; i++)
+		pixels[i] = rand();
+
+	f = fdopen(fd, "w");
+	if (!f || fwrite(hdr, sizeof(hdr), 1, f) != 1 || fwrite(pixels, size, 1, f) != 1 ||
+	    fclose(f) != 0)
+		err(1, "%s", path);
+
+	free(pixels);
+}
+
+static void open_carrier(struct test_fs *t, bool format)
+{
+	CHECK(open_sampler_by_extension(&t->sampler, t->path, 0));
+	CHECK(lsb_open(&t->stegger, t->sampler, TEST_BITS));
+
+	if (t->key && format)
+		CHECK(cipher_create(&t->stegger, t->stegger, t->key));
+	else if (t->key)
+		CHECK(cipher_open(&t->stegger, t->stegger, t->key));
+}
+
+void test_format(struct test_fs *t, int clusters, const char *key)
+{
+	// the cipher takes a little room for its salt
+	long samples = ((long)clusters * 4096 + TEST_C0_OFFSET + 64) * 8 / TEST_BITS;
+	int fd;
+
+	memset(t, 0, sizeof(*t));
+	t->key = key;
+
+	strcpy(t->path, "/tmp/ghost-test-XXXXXX.bmp");
+	fd = mkstemps(t->path, 4);
+	if (fd < 0)
+		err(1, "mkstemps");
+
+	write_bmp(t->path, fd, TEST_WIDTH, (samples / 3 + TEST_WIDTH - 1) / TEST_WIDTH);
+
+	open_carrier(t, true);
+	CHECK(ghostfs_format(t->stegger));
+	stegger_close(t->stegger);
+	sampler_close(t->sampler);
+
+	test_mount(t);
+}
+
+void test_mount(struct test_fs *t)
+{
+	CHECK(test_try_mount(t));
+}
+
+int test_try_mount(struct test_fs *t)
+{
+	int ret;
+
+	open_carrier(t, false);
+	ret = ghostfs_mount(&t->gfs, t->stegger, t->flags);
+	if (ret < 0) {
+		stegger_close(t->stegger);
+		sampler_close(t->sampler);
+		t->gfs = NULL;
+	}
+
+	return ret;
+}
+
+void test_umount(struct test_fs *t)
+{
+	CHECK(ghostfs_umount(t->gfs));
+	stegger_close(t->stegger);
+	sampler_close(t->sampler);
+	t->gfs = NULL;
+}
+
+void test_remount(struct test_fs *t)
+{
+	test_umount(t);
+	test_mount(t);
+}
+
+void test_remove(struct test_fs *t)
+{
+	if (t->gfs)
+		test_umount(t);
+	unlink(t->path);
+}
+
+struct stegger *test_raw(struct test_fs *t)
+{
+	struct stegger *raw;
+
+	CHECK(open_sampler_by_extension(&t->raw_sampler, t->path, 0));
+	CHECK(lsb_open(&raw, t->raw_sampler, TEST_BITS));
+
+	return raw;
+}
+
+void test_raw_close(struct test_fs *t, struct stegger *raw)
+{
+	stegger_close(raw);
+	sampler_close(t->raw_sampler);
+}
+
+void test_chains(struct test_fs *t, int *next, int count)
+{
+	struct stegger *raw = test_raw(t);
+	unsigned char hdr[4];
+	int nr;
+
+	for (nr = 0; nr < count; nr++) {
+		CHECK(stegger_read(raw, hdr, sizeof(hdr),
+				   TEST_C0_OFFSET + (size_t)nr * 4096 + CLUSTER_DATA));
+		next[nr] = hdr[2] ? hdr[0] | hdr[1] << 8 : -1;
+	}
+
+	test_raw_close(t, raw);
+}
+
+int test_runs(const int *before, const int *after, int count)
+{
+	int nr, runs = 0;
+
+	for (nr = 0; nr < count; nr++) {
+		if (before[nr] >= 0 || after[nr] < 0)
+			continue;
+		if (!nr || before[nr - 1] >= 0 || after[nr - 1] != nr)
+			runs++;
+	}
+
+	return runs;
+}
+
+void test_fill(void *buf, size_t size, unsigned int seed, int text)
+{
+	static const char *const words[] = {
+		"ghost ", "carrier ", "cluster ", "bitmap ", "noise ",
+	};
+	unsigned char *p = buf;
+	size_t i, len;
+
+	srand(seed);
+
+	for (i = 0; i < size; i += len) {
+		const char *w = words[rand() % 5];
+
+		if (!text) {
+			p[i] = rand();
+			len = 1;
+			continue;
+		}
+
+		len = strlen(w) < size - i ? strlen(w) : size - i;
+		memcpy(p + i, w, len);
+	}
+}
+
+void test_write(struct test_fs *t, const char *path, const void *buf, size_t size, off_t offset)
+{
+	struct ghostfs_entry *entry;
+	int ret;
+
+	ret = ghostfs_create(t->gfs, path);
+	if (ret < 0 && ret != -EEXIST)
+		CHECK(ret);
+
+	CHECK(ghostfs_open(t->gfs, path, &entry));
+	ret = ghostfs_write(t->gfs, entry, buf, size, offset);
+	if (ret != (int)size)
+		errx(1, "write %s: %d of %zu bytes", path, ret, size);
+	ghostfs_release(entry);
+}
+
+int test_read(struct test_fs *t, const char *path, const void *buf, size_t size)
+{
+	struct ghostfs_entry *entry;
+	char *data;
+	int ret;
+
+	data = malloc(size + 1);
+	if (!data)
+		errx(1, "out of memory");
+
+	CHECK(ghostfs_open(t->gfs, path, &entry));
+	ret = ghostfs_read(t->gfs, entry, data, size + 1, 0);
+	ghostfs_release(entry);
+
+	if (ret >= 0 && (ret != (int)size || memcmp(data, buf, size) != 0))
+		errx(1, "read %s: %d bytes, %zu expected, or other data", path, ret, size);
+
+	free(data);
+
+	return ret;
+}
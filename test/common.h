@@ -0,0 +1,73 @@
+#ifndef GHOST_TEST_COMMON_H
+#define GHOST_TEST_COMMON_H
+
+#include <err.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fs.h"
+
+// CHECK exits naming the call if it returns a negative errno
+#define CHECK(x)								\
+	do {									\
+		long _ret = (x);						\
+		if (_ret < 0)							\
+			errx(1, "%s:%d: %s: %s", __FILE__, __LINE__, #x,	\
+			     strerror(-_ret));					\
+	} while (0)
+
+#define CLUSTER_DATA 4092
+// bytes before cluster 0 in the stegger: superblock and header
+#define TEST_C0_OFFSET 18
+
+struct test_fs {
+	char path[32];
+	// GHOSTFS_KEY, NULL for none
+	const char *key;
+	// ghostfs_mount flags, 0 after test_format
+	int flags;
+	struct sampler *sampler;
+	struct stegger *stegger;
+	struct ghostfs *gfs;
+	// sampler below test_raw
+	struct sampler *raw_sampler;
+};
+
+// test_format creates a random BMP carrier of clusters clusters in /tmp and formats it
+void test_format(struct test_fs *t, int clusters, const char *key);
+void test_mount(struct test_fs *t);
+// test_try_mount returns what ghostfs_mount returned, for carriers that must not mount
+int test_try_mount(struct test_fs *t);
+void test_umount(struct test_fs *t);
+// test_remount unmounts and mounts again, as a new process would
+void test_remount(struct test_fs *t);
+void test_remove(struct test_fs *t);
+
+/*
+ * test_raw opens the carrier below the cipher, if any, to look at or damage
+ * clusters behind the filesystem's back while it is unmounted. Offsets are
+ * those ghostfs_format got, TEST_C0_OFFSET included, plus the salt with a key.
+ */
+struct stegger *test_raw(struct test_fs *t);
+void test_raw_close(struct test_fs *t, struct stegger *raw);
+
+/*
+ * test_chains reads from the carrier headers where the chain goes after
+ * each of the first count clusters into next, -1 for free clusters. The
+ * filesystem must be unmounted and have no key.
+ */
+void test_chains(struct test_fs *t, int *next, int count);
+/*
+ * test_runs counts the runs of clusters that are used in after but were free
+ * in before, where each one leads to the next
+ */
+int test_runs(const int *before, const int *after, int count);
+
+// test_fill fills buf with bytes from seed, compressible ones if text
+void test_fill(void *buf, size_t size, unsigned int seed, int text);
+
+void test_write(struct test_fs *t, const char *path, const void *buf, size_t size, off_t offset);
+// test_read returns what ghostfs_read returned, data and size are compared if it is not negative
+int test_read(struct test_fs *t, const char *path, const void *buf, size_t size);
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * crc32c checks the table fallback, and whatever crc32c picks on this CPU,
+ * against a bit at a time reference over sizes and alignments that cover
+ * the tails and the lane boundaries of the hardware versions.
+ */
+#include <err.h>
+#include <stdlib.h>
+
+// for crc32c_sw, which the hardware versions keep from being called
+#include "../crc32c.c"
+
+#define MAX_SIZE (4 * 3 * CRC32C_LANE)
+
+static uint32_t reference(uint32_t crc, const unsigned char *p, size_t size)
+{
+	int bit;
+
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+	}
+
+	return ~crc;
+}
+
+static void check(const unsigned char *p, size_t size, uint32_t start)
+{
+	uint32_t want = reference(start, p, size);
+	uint32_t sw = ~crc32c_sw(~start, p, size);
+	uint32_t got = crc32c(start, p, size);
+	size_t half = size / 3;
+
+	if (sw != want || got != want)
+		errx(1, "%zu bytes at %p: %08x and %08x, %08x expected", size, (void *)p, sw, got,
+		     want);
+
+	// continuing a checksum gives the one of the whole
+	if (crc32c(crc32c(start, p, half), p + half, size - half) != want)
+		errx(1, "%zu bytes continued after %zu: not %08x", size, half, want);
+}
+
+int main(void)
+{
+	// cluster data, around the three lanes and past them
+	static const size_t sizes[] = {
+		4092, 3 * CRC32C_LANE - 1, 3 * CRC32C_LANE, 3 * CRC32C_LANE + 1,
+		3 * CRC32C_LANE + 7, 6 * CRC32C_LANE, 6 * CRC32C_LANE + 9, MAX_SIZE - 8,
+	};
+	unsigned char *buf;
+	size_t size, i;
+	int offset;
+
+	if (crc32c(0, "123456789", 9) != 0xE3069283)
+		errx(1, "check value of \"123456789\" is %08x", crc32c(0, "123456789", 9));
+
+	buf = malloc(MAX_SIZE);
+	if (!buf)
+		errx(1, "out of memory");
+
+	srand(1);
+	for (i = 0; i < MAX_SIZE; i++)
+		buf[i] = rand();
+
+	for (offset = 0; offset < 8; offset++) {
+		for (size = 0; size <= 64; size++)
+			check(buf + offset, size, 0);
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+			check(buf + offset, sizes[i], 0x12345678);
+	}
+
+	free(buf);
+
+	return 0;
+}
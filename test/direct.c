@@ -0,0 +1,147 @@
+/*
+ * direct reads files through handles opened with GHOSTFS_O_DIRECT and
+ * checks that they see what cached handles wrote but did not write back,
+ * that direct writes of part of a cluster and of whole ones read back
+ * after a remount, and that packed, linked and sealed clusters read back
+ * directly as well.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define CLUSTERS 12
+
+static struct ghostfs_entry *open_direct(struct test_fs *t, const char *name)
+{
+	struct ghostfs_entry *entry;
+	struct stat st;
+
+	CHECK(ghostfs_lookup(t->gfs, GHOSTFS_ROOT_INO, name, &st));
+	CHECK(ghostfs_open_ino(t->gfs, st.st_ino, GHOSTFS_O_DIRECT, &entry));
+
+	return entry;
+}
+
+// read_direct compares size bytes at offset of the file with data at offset
+static void read_direct(struct test_fs *t, const char *name, const char *data, size_t size,
+			off_t offset)
+{
+	struct ghostfs_entry *entry = open_direct(t, name);
+	char *buf;
+	int ret;
+
+	buf = malloc(size);
+	if (!buf)
+		errx(1, "out of memory");
+
+	ret = ghostfs_read(t->gfs, entry, buf, size, offset);
+	if (ret != (int)size || memcmp(buf, data + offset, size) != 0)
+		errx(1, "direct read of %s at %lld: %d bytes, %zu expected, or other data", name,
+		     (long long)offset, ret, size);
+
+	ghostfs_release(entry);
+	free(buf);
+}
+
+static void write_direct(struct test_fs *t, const char *name, const char *data, size_t size,
+			 off_t offset)
+{
+	struct ghostfs_entry *entry = open_direct(t, name);
+
+	if (ghostfs_write(t->gfs, entry, data + offset, size, offset) != (int)size)
+		errx(1, "direct write of %s at %lld", name, (long long)offset);
+
+	ghostfs_release(entry);
+}
+
+// plain checks the direct path on clusters written as they are, with or without key
+static void plain(const char *key)
+{
+	struct test_fs t;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	char *data;
+
+	data = malloc(size);
+	if (!data)
+		errx(1, "out of memory");
+	test_fill(data, size, 1, 0);
+
+	test_format(&t, 256, key);
+	test_write(&t, "/f", data, size, 0);
+	test_remount(&t);
+
+	read_direct(&t, "f", data, size, 0);
+	read_direct(&t, "f", data, 100, 3 * CLUSTER_DATA - 50);
+
+	// a cached write across clusters 2 and 3, not written back yet
+	test_fill(data + 3 * CLUSTER_DATA - 100, 200, 2, 0);
+	test_write(&t, "/f", data + 3 * CLUSTER_DATA - 100, 200, 3 * CLUSTER_DATA - 100);
+	read_direct(&t, "f", data, 3 * CLUSTER_DATA, 2 * CLUSTER_DATA);
+
+	// part of cluster 5, and clusters 7 and 8 whole
+	test_fill(data + 5 * CLUSTER_DATA + 1000, 300, 3, 0);
+	write_direct(&t, "f", data, 300, 5 * CLUSTER_DATA + 1000);
+	test_fill(data + 7 * CLUSTER_DATA, 2 * CLUSTER_DATA, 4, 0);
+	write_direct(&t, "f", data, 2 * CLUSTER_DATA, 7 * CLUSTER_DATA);
+	read_direct(&t, "f", data, size, 0);
+	test_read(&t, "/f", data, size);
+	test_remount(&t);
+
+	read_direct(&t, "f", data, size, 0);
+	test_read(&t, "/f", data, size);
+
+	test_remove(&t);
+	free(data);
+}
+
+int main(void)
+{
+	struct ghostfs_dedup_stats stats;
+	struct test_fs t;
+	struct stat st;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	char *text;
+
+	plain(NULL);
+
+	text = malloc(size);
+	if (!text)
+		errx(1, "out of memory");
+	test_fill(text, size, 5, 1);
+
+	// packed clusters are unpacked, the ranges start and end inside them
+	test_format(&t, 256, NULL);
+	CHECK(ghostfs_compress_start(t.gfs, 6));
+	test_write(&t, "/text", text, size, 0);
+	test_remount(&t);
+
+	CHECK(ghostfs_getattr(t.gfs, "/text", &st));
+	if (st.st_blocks >= CLUSTERS / 2 * 4096 / 512)
+		errx(1, "text takes %lld blocks", (long long)st.st_blocks);
+	read_direct(&t, "text", text, size, 0);
+	read_direct(&t, "text", text, 3 * CLUSTER_DATA, 4 * CLUSTER_DATA + 10);
+	test_remove(&t);
+
+	// links are followed to the clusters they point to
+	test_format(&t, 256, NULL);
+	CHECK(ghostfs_dedup_start(t.gfs));
+	test_write(&t, "/a", text, size, 0);
+	CHECK(ghostfs_sync(t.gfs));
+	test_write(&t, "/b", text, size, 0);
+	test_remount(&t);
+
+	CHECK(ghostfs_dedup_stats(t.gfs, &stats));
+	if (stats.linked < CLUSTERS)
+		errx(1, "%lu clusters linked", stats.linked);
+	read_direct(&t, "b", text, size, 0);
+	read_direct(&t, "b", text, CLUSTER_DATA, 2 * CLUSTER_DATA + 10);
+	test_remove(&t);
+
+	// sealed clusters are unsealed in full, even for a few bytes
+	plain("secret");
+
+	free(text);
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * fallocate reserves clusters for a file once free space is fragmented and
+ * checks that they take a single run, that FALLOC_FL_KEEP_SIZE counts the
+ * blocks past the end without changing the size, and that it fills holes
+ * of a sparse file, which still read as zeros, but does not punch any.
+ */
+// for SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define COUNT 256
+#define SMALL 16
+#define RESERVED 20
+
+static void reserve(struct test_fs *t, const char *path, int mode, off_t offset, off_t length)
+{
+	struct ghostfs_entry *entry;
+	int ret;
+
+	ret = ghostfs_create(t->gfs, path);
+	if (ret < 0 && ret != -EEXIST)
+		CHECK(ret);
+
+	CHECK(ghostfs_open(t->gfs, path, &entry));
+	CHECK(ghostfs_fallocate(t->gfs, entry, mode, offset, length));
+	ghostfs_release(entry);
+}
+
+static void check_stat(struct test_fs *t, const char *path, off_t size, int clusters)
+{
+	struct stat st;
+
+	CHECK(ghostfs_getattr(t->gfs, path, &st));
+	if (st.st_size != size || st.st_blocks != clusters * 4096 / 512)
+		errx(1, "%s: size %lld, %lld blocks", path, (long long)st.st_size,
+		     (long long)st.st_blocks);
+}
+
+int main(void)
+{
+	static int before[COUNT], after[COUNT];
+	struct ghostfs_entry *entry;
+	struct test_fs t;
+	size_t size = 10 * CLUSTER_DATA;
+	char path[32];
+	char *buf;
+	int i;
+
+	buf = calloc(1, size);
+	if (!buf)
+		errx(1, "out of memory");
+	test_fill(buf, CLUSTER_DATA, 1, 0);
+
+	// every other small file goes, leaving free clusters in between
+	test_format(&t, COUNT, NULL);
+	for (i = 0; i < SMALL; i++) {
+		snprintf(path, sizeof(path), "/s%02d", i);
+		test_write(&t, path, buf, CLUSTER_DATA, 0);
+	}
+	CHECK(ghostfs_sync(t.gfs));
+	for (i = 0; i < SMALL; i += 2) {
+		snprintf(path, sizeof(path), "/s%02d", i);
+		CHECK(ghostfs_unlink(t.gfs, path));
+	}
+	test_umount(&t);
+	test_chains(&t, before, COUNT);
+	test_mount(&t);
+
+	reserve(&t, "/reserved", 0, 0, RESERVED * CLUSTER_DATA);
+	check_stat(&t, "/reserved", RESERVED * CLUSTER_DATA, RESERVED);
+	test_umount(&t);
+	test_chains(&t, after, COUNT);
+	test_mount(&t);
+
+	if (test_runs(before, after, COUNT) != 1)
+		errx(1, "reserved clusters in %d runs", test_runs(before, after, COUNT));
+
+	// blocks past the end count, and stay when the file grows into them
+	reserve(&t, "/keep", FALLOC_FL_KEEP_SIZE, 0, 4 * CLUSTER_DATA);
+	check_stat(&t, "/keep", 0, 4);
+	test_remount(&t);
+	check_stat(&t, "/keep", 0, 4);
+	test_write(&t, "/keep", buf, 100, 0);
+	check_stat(&t, "/keep", 100, 4);
+	test_read(&t, "/keep", buf, 100);
+
+	// data at 0 and 9, fallocate fills 2 to 4 and leaves 1 and 5 to 8 holes
+	memcpy(buf + 9 * CLUSTER_DATA, buf, CLUSTER_DATA);
+	test_write(&t, "/sparse", buf, CLUSTER_DATA, 0);
+	test_write(&t, "/sparse", buf, CLUSTER_DATA, 9 * CLUSTER_DATA);
+	check_stat(&t, "/sparse", size, 2);
+	reserve(&t, "/sparse", FALLOC_FL_KEEP_SIZE, 2 * CLUSTER_DATA, 3 * CLUSTER_DATA);
+	test_remount(&t);
+
+	check_stat(&t, "/sparse", size, 5);
+	test_read(&t, "/sparse", buf, size);
+
+	CHECK(ghostfs_open(t.gfs, "/sparse", &entry));
+	if (ghostfs_lseek(t.gfs, entry, 0, SEEK_HOLE) != CLUSTER_DATA ||
+	    ghostfs_lseek(t.gfs, entry, CLUSTER_DATA, SEEK_DATA) != 2 * CLUSTER_DATA ||
+	    ghostfs_lseek(t.gfs, entry, 2 * CLUSTER_DATA, SEEK_HOLE) != 5 * CLUSTER_DATA)
+		errx(1, "fallocate did not fill the holes it covers");
+
+	// holes come from writes and truncate, punching them is not supported
+	if (ghostfs_fallocate(t.gfs, entry, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      0, size) != -EOPNOTSUPP)
+		errx(1, "hole punched");
+	ghostfs_release(entry);
+	check_stat(&t, "/sparse", size, 5);
+	test_read(&t, "/sparse", buf, size);
+
+	test_remove(&t);
+	free(buf);
+
+	return 0;
+}
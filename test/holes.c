@@ -0,0 +1,54 @@
+/*
+ * holes writes a file with explicit zero clusters and a gap, remounts and
+ * checks that both read back as zeros without taking carrier clusters.
+ */
+// for SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "common.h"
+
+#define CLUSTERS 12
+
+int main(void)
+{
+	struct ghostfs_entry *entry;
+	struct test_fs t;
+	struct stat st;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	char *buf;
+
+	buf = calloc(1, size);
+	if (!buf)
+		errx(1, "out of memory");
+
+	// data in clusters 0 and 4, zeros written to 1 to 3, nothing written to 5 to 10
+	test_fill(buf, CLUSTER_DATA, 1, 0);
+	test_fill(buf + 4 * CLUSTER_DATA, CLUSTER_DATA, 2, 0);
+	test_fill(buf + 11 * CLUSTER_DATA, CLUSTER_DATA, 3, 0);
+
+	test_format(&t, 256, NULL);
+	test_write(&t, "/sparse", buf, 5 * CLUSTER_DATA, 0);
+	test_write(&t, "/sparse", buf + 11 * CLUSTER_DATA, CLUSTER_DATA, 11 * CLUSTER_DATA);
+	test_remount(&t);
+
+	test_read(&t, "/sparse", buf, size);
+
+	CHECK(ghostfs_getattr(t.gfs, "/sparse", &st));
+	if (st.st_size != (off_t)size || st.st_blocks != 3 * 4096 / 512)
+		errx(1, "size %lld, %lld blocks", (long long)st.st_size, (long long)st.st_blocks);
+
+	CHECK(ghostfs_open(t.gfs, "/sparse", &entry));
+	if (ghostfs_lseek(t.gfs, entry, 0, SEEK_HOLE) != CLUSTER_DATA ||
+	    ghostfs_lseek(t.gfs, entry, CLUSTER_DATA, SEEK_DATA) != 4 * CLUSTER_DATA ||
+	    ghostfs_lseek(t.gfs, entry, 4 * CLUSTER_DATA, SEEK_HOLE) != 5 * CLUSTER_DATA ||
+	    ghostfs_lseek(t.gfs, entry, 5 * CLUSTER_DATA, SEEK_DATA) != 11 * CLUSTER_DATA)
+		errx(1, "holes and data not where they were written");
+	ghostfs_release(entry);
+
+	test_remove(&t);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * links writes copies of a file with dedup on, remounts and checks that the
+ * copies became links that read back, then changes the file linked to and a
+ * copy and checks that the others keep their data.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define CLUSTERS 20
+
+static void stats(struct test_fs *t, struct ghostfs_dedup_stats *st)
+{
+	CHECK(ghostfs_dedup_stats(t->gfs, st));
+}
+
+static void copy(struct test_fs *t, const char *from, const char *to, size_t size)
+{
+	struct ghostfs_entry *src, *dst;
+
+	CHECK(ghostfs_create(t->gfs, to));
+	CHECK(ghostfs_open(t->gfs, from, &src));
+	CHECK(ghostfs_open(t->gfs, to, &dst));
+	if (ghostfs_copy_range(t->gfs, src, 0, dst, 0, size) != (ssize_t)size)
+		errx(1, "copy %s to %s", from, to);
+	ghostfs_release(src);
+	ghostfs_release(dst);
+}
+
+int main(void)
+{
+	struct ghostfs_dedup_stats st;
+	struct test_fs t;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	char *data, *changed;
+
+	data = malloc(size);
+	changed = malloc(size);
+	if (!data || !changed)
+		errx(1, "out of memory");
+
+	test_fill(data, size, 1, 0);
+
+	test_format(&t, 256, NULL);
+	CHECK(ghostfs_dedup_start(t.gfs));
+	test_write(&t, "/a", data, size, 0);
+	CHECK(ghostfs_sync(t.gfs));
+	test_write(&t, "/b", data, size, 0);
+	test_remount(&t);
+
+	stats(&t, &st);
+	if (st.linked < CLUSTERS || st.saved == 0)
+		errx(1, "%lu clusters linked, %lu saved", st.linked, st.saved);
+	test_read(&t, "/a", data, size);
+	test_read(&t, "/b", data, size);
+
+	// the table is seeded with what links point to at mount
+	CHECK(ghostfs_dedup_start(t.gfs));
+	test_write(&t, "/c", data, size, 0);
+	test_remount(&t);
+
+	stats(&t, &st);
+	if (st.linked < 2 * CLUSTERS)
+		errx(1, "%lu clusters linked after another copy", st.linked);
+
+	// copies share clusters without dedup
+	copy(&t, "/a", "/d", size);
+	test_remount(&t);
+
+	stats(&t, &st);
+	if (st.linked < 3 * CLUSTERS)
+		errx(1, "%lu clusters linked after copy_file_range", st.linked);
+	test_read(&t, "/d", data, size);
+
+	// a change to the file linked to is not seen through the links, nor is one to a copy
+	memcpy(changed, data, size);
+	test_fill(changed + 5 * CLUSTER_DATA, 2 * CLUSTER_DATA, 2, 0);
+	test_write(&t, "/a", changed + 5 * CLUSTER_DATA, 2 * CLUSTER_DATA, 5 * CLUSTER_DATA);
+	test_write(&t, "/c", changed + 5 * CLUSTER_DATA, 2 * CLUSTER_DATA, 5 * CLUSTER_DATA);
+	test_remount(&t);
+
+	test_read(&t, "/a", changed, size);
+	test_read(&t, "/b", data, size);
+	test_read(&t, "/c", changed, size);
+	test_read(&t, "/d", data, size);
+
+	test_remove(&t);
+	free(data);
+	free(changed);
+
+	return 0;
+}
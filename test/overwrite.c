@@ -0,0 +1,103 @@
+/*
+ * overwrite rewrites parts of several files from as many threads, while
+ * another one grows a file and the filesystem is synced, and checks that
+ * every file holds what was last written to it, before and after a remount.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define THREADS 4
+#define SIZE (8 * CLUSTER_DATA)
+#define ROUNDS 300
+#define GROW (CLUSTER_DATA / 2)
+
+struct writer {
+	struct test_fs *t;
+	char path[32];
+	unsigned int seed;
+	char data[SIZE];
+};
+
+static void *overwrite(void *arg)
+{
+	struct writer *w = arg;
+	struct ghostfs_entry *entry;
+	char chunk[2 * CLUSTER_DATA];
+	size_t size;
+	off_t offset;
+	int i;
+
+	CHECK(ghostfs_open(w->t->gfs, w->path, &entry));
+	for (i = 0; i < ROUNDS; i++) {
+		size = 1 + rand_r(&w->seed) % sizeof(chunk);
+		offset = rand_r(&w->seed) % (SIZE - size + 1);
+		test_fill(chunk, size, rand_r(&w->seed), i % 2);
+
+		if (ghostfs_write(w->t->gfs, entry, chunk, size, offset) != (int)size)
+			errx(1, "%s: write at %lld", w->path, (long long)offset);
+		memcpy(w->data + offset, chunk, size);
+	}
+	ghostfs_release(entry);
+
+	return NULL;
+}
+
+static void *grow(void *arg)
+{
+	struct writer *w = arg;
+	int i;
+
+	for (i = 0; i < SIZE / GROW; i++)
+		test_write(w->t, w->path, w->data + i * GROW, GROW, i * GROW);
+
+	return NULL;
+}
+
+static void check(struct writer *w, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		CHECK(test_read(w[i].t, w[i].path, w[i].data, SIZE));
+}
+
+int main(void)
+{
+	static struct writer w[THREADS + 1];
+	pthread_t threads[THREADS + 1];
+	struct test_fs t;
+	int i;
+
+	test_format(&t, 256, NULL);
+
+	for (i = 0; i <= THREADS; i++) {
+		w[i].t = &t;
+		w[i].seed = i + 1;
+		snprintf(w[i].path, sizeof(w[i].path), "/f%d", i);
+		test_fill(w[i].data, SIZE, i + 1, i % 2);
+		if (i < THREADS)
+			test_write(&t, w[i].path, w[i].data, SIZE, 0);
+	}
+	CHECK(ghostfs_sync(t.gfs));
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, overwrite, &w[i]);
+	pthread_create(&threads[THREADS], NULL, grow, &w[THREADS]);
+
+	for (i = 0; i < 20; i++)
+		CHECK(ghostfs_sync(t.gfs));
+
+	for (i = 0; i <= THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	check(w, THREADS + 1);
+	test_remount(&t);
+	check(w, THREADS + 1);
+
+	test_remove(&t);
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * pack writes text with compression on, remounts without it and checks that
+ * the packed clusters read back and take fewer carrier clusters, then
+ * rewrites part of the file so that its clusters are unpacked.
+ */
+#include <stdlib.h>
+
+#include "common.h"
+
+#define CLUSTERS 40
+
+static unsigned long used(struct test_fs *t)
+{
+	struct statvfs st;
+
+	CHECK(ghostfs_statvfs(t->gfs, &st));
+
+	return st.f_blocks - st.f_bfree;
+}
+
+int main(void)
+{
+	struct test_fs t;
+	struct stat st;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	unsigned long before, after;
+	char *text, *noise;
+
+	text = malloc(size);
+	noise = malloc(size);
+	if (!text || !noise)
+		errx(1, "out of memory");
+
+	test_fill(text, size, 1, 1);
+	test_fill(noise, size, 2, 0);
+
+	test_format(&t, 256, NULL);
+	CHECK(ghostfs_compress_start(t.gfs, 6));
+	before = used(&t);
+	test_write(&t, "/text", text, size, 0);
+	test_write(&t, "/noise", noise, size, 0);
+	test_remount(&t);
+
+	test_read(&t, "/text", text, size);
+	test_read(&t, "/noise", noise, size);
+
+	// noise does not compress and stays plain
+	after = used(&t);
+	if (after - before >= CLUSTERS + CLUSTERS / 4)
+		errx(1, "%lu clusters used for %d of data", after - before, 2 * CLUSTERS);
+
+	CHECK(ghostfs_getattr(t.gfs, "/text", &st));
+	if (st.st_blocks >= CLUSTERS / 2 * 4096 / 512)
+		errx(1, "text takes %lld blocks", (long long)st.st_blocks);
+
+	// a write into packed clusters, with compression off
+	test_fill(text + 10 * CLUSTER_DATA + 100, 3 * CLUSTER_DATA, 3, 0);
+	test_write(&t, "/text", text + 10 * CLUSTER_DATA + 100, 3 * CLUSTER_DATA,
+		   10 * CLUSTER_DATA + 100);
+	test_remount(&t);
+
+	test_read(&t, "/text", text, size);
+	test_read(&t, "/noise", noise, size);
+
+	test_remove(&t);
+	free(text);
+	free(noise);
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * place appends to two files in turns and checks that once written back
+ * each takes a single run of clusters, that a file removed before it was
+ * written back leaves the carrier as it was, and that a file placed by a
+ * flush reads back after a remount, along with what was appended to it.
+ */
+#include <stdlib.h>
+
+#include "common.h"
+
+#define COUNT 256
+#define CLUSTERS 10
+
+// carrier reads what the clusters of the unmounted filesystem hold
+static unsigned char *carrier(struct test_fs *t)
+{
+	struct stegger *raw = test_raw(t);
+	unsigned char *data;
+
+	data = malloc((size_t)COUNT * 4096);
+	if (!data)
+		errx(1, "out of memory");
+	CHECK(stegger_read(raw, data, (size_t)COUNT * 4096, TEST_C0_OFFSET));
+	test_raw_close(t, raw);
+
+	return data;
+}
+
+int main(void)
+{
+	static int before[COUNT], after[COUNT];
+	struct ghostfs_entry *entry;
+	struct test_fs t;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	unsigned char *old, *now;
+	char *a, *b;
+	int i;
+
+	a = malloc(2 * size);
+	b = malloc(size);
+	if (!a || !b)
+		errx(1, "out of memory");
+	test_fill(a, 2 * size, 1, 0);
+	test_fill(b, size, 2, 0);
+
+	// the root directory gets its times cluster along with the files
+	test_format(&t, COUNT, NULL);
+	CHECK(ghostfs_create(t.gfs, "/a"));
+	CHECK(ghostfs_create(t.gfs, "/b"));
+	test_umount(&t);
+	test_chains(&t, before, COUNT);
+	test_mount(&t);
+
+	for (i = 0; i < CLUSTERS; i++) {
+		test_write(&t, "/a", a + i * CLUSTER_DATA, CLUSTER_DATA, i * CLUSTER_DATA);
+		test_write(&t, "/b", b + i * CLUSTER_DATA, CLUSTER_DATA, i * CLUSTER_DATA);
+	}
+	test_umount(&t);
+	test_chains(&t, after, COUNT);
+
+	if (test_runs(before, after, COUNT) != 2)
+		errx(1, "two files appended in turns take %d runs", test_runs(before, after, COUNT));
+
+	// nothing of a file removed before sync reaches the clusters that were free
+	old = carrier(&t);
+	test_mount(&t);
+	test_write(&t, "/tmp", b, size, 0);
+	CHECK(ghostfs_unlink(t.gfs, "/tmp"));
+	test_umount(&t);
+	now = carrier(&t);
+
+	for (i = 0; i < COUNT; i++) {
+		if (after[i] < 0 && memcmp(old + i * 4096, now + i * 4096, 4096) != 0)
+			errx(1, "free cluster %d written for a removed file", i);
+	}
+
+	test_mount(&t);
+	test_read(&t, "/a", a, size);
+	test_read(&t, "/b", b, size);
+
+	// flush places the file it is called on, appends after it get clusters of their own
+	test_write(&t, "/c", b, size / 2, 0);
+	CHECK(ghostfs_open(t.gfs, "/c", &entry));
+	CHECK(ghostfs_flush(t.gfs, entry));
+	ghostfs_release(entry);
+	test_write(&t, "/c", b + size / 2, size - size / 2, size / 2);
+	test_write(&t, "/a", a + size, size, size);
+	test_remount(&t);
+
+	test_read(&t, "/a", a, 2 * size);
+	test_read(&t, "/b", b, size);
+	test_read(&t, "/c", b, size);
+
+	test_remove(&t);
+	free(a);
+	free(b);
+	free(old);
+	free(now);
+
+	return 0;
+}
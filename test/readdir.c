@@ -0,0 +1,87 @@
+/*
+ * readdir lists a directory spanning several clusters in small batches,
+ * removing and creating entries between them, and checks that the listing
+ * resumed at the returned offsets holds every entry that stayed exactly
+ * once and none removed before they were reached.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "common.h"
+
+#define FILES 200
+#define BATCH 16
+
+static void create(struct test_fs *t, const char *fmt, int i)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), fmt, i);
+	CHECK(ghostfs_create(t->gfs, path));
+}
+
+int main(void)
+{
+	struct ghostfs_dirent ents[BATCH];
+	bool removed[FILES] = { false };
+	int seen[FILES] = { 0 }, seen_new[FILES] = { 0 };
+	struct test_fs t;
+	struct stat st;
+	char path[32];
+	int batches = 0, victim = FILES - 1;
+	off_t off = 0;
+	int i, n;
+
+	test_format(&t, 256, NULL);
+	CHECK(ghostfs_mkdir(t.gfs, "/dir"));
+	for (i = 0; i < FILES; i++)
+		create(&t, "/dir/f%03d", i);
+	// readdir takes the inode number a lookup returned
+	CHECK(ghostfs_lookup(t.gfs, GHOSTFS_ROOT_INO, "dir", &st));
+
+	while ((n = ghostfs_readdir(t.gfs, st.st_ino, off, ents, BATCH, 0)) > 0) {
+		for (i = 0; i < n; i++) {
+			int k;
+
+			if (sscanf(ents[i].name, "f%d", &k) == 1 && k >= 0 && k < FILES)
+				seen[k]++;
+			else if (sscanf(ents[i].name, "n%d", &k) == 1 && k >= 0 && k < FILES)
+				seen_new[k]++;
+			else
+				errx(1, "unexpected entry %s", ents[i].name);
+
+			if (ents[i].off <= off)
+				errx(1, "offset %lld after %lld", (long long)ents[i].off,
+				     (long long)off);
+			off = ents[i].off;
+		}
+
+		// one entry already listed and one not reached yet go, a new one comes
+		if (sscanf(ents[0].name, "f%d", &i) == 1) {
+			snprintf(path, sizeof(path), "/dir/f%03d", i);
+			CHECK(ghostfs_unlink(t.gfs, path));
+		}
+		while (victim >= 0 && (seen[victim] || removed[victim]))
+			victim--;
+		if (victim >= 0) {
+			snprintf(path, sizeof(path), "/dir/f%03d", victim);
+			CHECK(ghostfs_unlink(t.gfs, path));
+			removed[victim] = true;
+		}
+		create(&t, "/dir/n%03d", batches++);
+	}
+	CHECK(n);
+
+	for (i = 0; i < FILES; i++) {
+		if (removed[i] ? seen[i] != 0 : seen[i] != 1)
+			errx(1, "f%03d listed %d times", i, seen[i]);
+		if (seen_new[i] > 1)
+			errx(1, "n%03d listed %d times", i, seen_new[i]);
+	}
+	if (batches < FILES / BATCH / 2)
+		errx(1, "listed in %d batches", batches);
+
+	test_remove(&t);
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * sums writes a file, remounts and reads it back, then damages the carrier
+ * behind the filesystem's back and checks that each change is caught: a
+ * bit of file data or of a cluster header fails the read, a bit of the
+ * superblock fails the mount. The carrier reads back once repaired, and
+ * once damaged again mounts with GHOSTFS_REPAIR, which takes it as it is.
+ */
+#include <stdlib.h>
+
+#include "common.h"
+
+#define CLUSTERS 8
+
+// flip changes a bit at offset in the carrier, twice puts it back
+static void flip(struct test_fs *t, size_t offset)
+{
+	struct stegger *raw = test_raw(t);
+	unsigned char c;
+
+	CHECK(stegger_read(raw, &c, 1, offset));
+	c ^= 0x04;
+	CHECK(stegger_write(raw, &c, 1, offset));
+	test_raw_close(t, raw);
+}
+
+static size_t cluster_offset(int nr)
+{
+	return TEST_C0_OFFSET + (size_t)nr * 4096;
+}
+
+// damaged expects the file not to mount or not to read after flipping offset
+static void damaged(struct test_fs *t, const char *path, const void *buf, size_t size,
+		    size_t offset, const char *what)
+{
+	int ret;
+
+	flip(t, offset);
+
+	ret = test_try_mount(t);
+	if (ret >= 0) {
+		ret = test_read(t, path, buf, size);
+		test_umount(t);
+	}
+	if (ret >= 0)
+		errx(1, "%s damage not detected", what);
+
+	flip(t, offset);
+}
+
+int main(void)
+{
+	struct test_fs t;
+	size_t size = CLUSTERS * CLUSTER_DATA;
+	char *data;
+
+	data = malloc(size);
+	if (!data)
+		errx(1, "out of memory");
+
+	test_fill(data, size, 1, 0);
+
+	test_format(&t, 256, NULL);
+	test_write(&t, "/data", data, size, 0);
+	test_remount(&t);
+
+	test_read(&t, "/data", data, size);
+	test_umount(&t);
+
+	// the file takes the clusters after the root directory and its times
+	damaged(&t, "/data", data, size, cluster_offset(2) + 1000, "data");
+	damaged(&t, "/data", data, size, cluster_offset(CLUSTERS), "data");
+	// next, in the header after the data
+	damaged(&t, "/data", data, size, cluster_offset(3) + CLUSTER_DATA, "header");
+
+	// a damaged superblock does not mount at all
+	flip(&t, 4);
+	if (test_try_mount(&t) >= 0)
+		errx(1, "superblock damage not detected");
+	flip(&t, 4);
+
+	test_mount(&t);
+	test_read(&t, "/data", data, size);
+	test_umount(&t);
+
+	// repair takes the flipped bit as data, and a new checksum of the superblock
+	flip(&t, cluster_offset(3) + 1000);
+	flip(&t, 0);
+	data[CLUSTER_DATA + 1000] ^= 0x04;
+
+	t.flags = GHOSTFS_REPAIR;
+	test_mount(&t);
+	test_read(&t, "/data", data, size);
+	test_umount(&t);
+
+	t.flags = 0;
+	test_mount(&t);
+	test_read(&t, "/data", data, size);
+
+	test_remove(&t);
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * times fills a directory past its first cluster with files whose names
+ * take the full FILENAME_MAX_LEN characters, sets their modification times
+ * and checks that they read back after a remount, also across a rename.
+ * Removing the directory gives back every cluster it took, its times
+ * clusters included.
+ */
+#include <stdio.h>
+#include <sys/statvfs.h>
+
+#include "common.h"
+
+#define FILES 80
+#define NAME_MAX_LEN (GHOSTFS_NAME_SIZE - 1)
+#define MTIME 1000000000
+
+// name_of sets path to /dir/ and a name of len characters for file i
+static void name_of(char *path, int i, int len)
+{
+	int n;
+
+	n = sprintf(path, "/dir/%03d", i);
+	memset(path + n, 'x', len - 3);
+	path[5 + len] = '\0';
+}
+
+static void check_mtime(struct test_fs *t, const char *path, time_t mtime)
+{
+	struct stat st;
+
+	CHECK(ghostfs_getattr(t->gfs, path, &st));
+	if (st.st_mtime != mtime || st.st_ctime < mtime)
+		errx(1, "%s: mtime %lld, ctime %lld, %lld expected", path,
+		     (long long)st.st_mtime, (long long)st.st_ctime, (long long)mtime);
+}
+
+int main(void)
+{
+	char path[8 + NAME_MAX_LEN], newpath[8 + NAME_MAX_LEN];
+	struct statvfs before, after;
+	struct test_fs t;
+	struct stat dir, st;
+	int i;
+
+	test_format(&t, 256, NULL);
+
+	// the root directory gets its times cluster first
+	CHECK(ghostfs_create(t.gfs, "/file"));
+	CHECK(ghostfs_statvfs(t.gfs, &before));
+	if (before.f_namemax != NAME_MAX_LEN)
+		errx(1, "f_namemax %lu", before.f_namemax);
+
+	CHECK(ghostfs_mkdir(t.gfs, "/dir"));
+	// ghostfs_utime_ino takes the inode number a lookup returned
+	CHECK(ghostfs_lookup(t.gfs, GHOSTFS_ROOT_INO, "dir", &dir));
+	name_of(path, 0, NAME_MAX_LEN + 1);
+	if (ghostfs_create(t.gfs, path) != -ENAMETOOLONG)
+		errx(1, "name of %d characters taken", NAME_MAX_LEN + 1);
+
+	for (i = 0; i < FILES; i++) {
+		name_of(path, i, NAME_MAX_LEN);
+		CHECK(ghostfs_create(t.gfs, path));
+		CHECK(ghostfs_lookup(t.gfs, dir.st_ino, path + 5, &st));
+		CHECK(ghostfs_utime_ino(t.gfs, st.st_ino, MTIME + i));
+	}
+
+	// rename keeps the modification time
+	name_of(path, 0, NAME_MAX_LEN);
+	name_of(newpath, FILES, NAME_MAX_LEN);
+	CHECK(ghostfs_rename(t.gfs, path, newpath));
+	test_remount(&t);
+
+	check_mtime(&t, newpath, MTIME);
+	for (i = 1; i < FILES; i++) {
+		name_of(path, i, NAME_MAX_LEN);
+		check_mtime(&t, path, MTIME + i);
+	}
+
+	CHECK(ghostfs_unlink(t.gfs, newpath));
+	for (i = 1; i < FILES; i++) {
+		name_of(path, i, NAME_MAX_LEN);
+		CHECK(ghostfs_unlink(t.gfs, path));
+	}
+	CHECK(ghostfs_rmdir(t.gfs, "/dir"));
+	test_remount(&t);
+
+	CHECK(ghostfs_statvfs(t.gfs, &after));
+	if (after.f_bfree != before.f_bfree)
+		errx(1, "%lu free clusters after rmdir, %lu before", (unsigned long)after.f_bfree,
+		     (unsigned long)before.f_bfree);
+
+	test_remove(&t);
+
+	return 0;
+}
@@ -3,12 +3,13 @@
 #include <string.h>
 
 #include "bmp.h"
+#include "cipher.h"
 #include "fs.h"
 #include "lsb.h"
 #include "util.h"
 #include "wav.h"
 
-int open_sampler_by_extension(struct sampler **sampler, const char *filename)
+int open_sampler_by_extension(struct sampler **sampler, const char *filename, int flags)
 {
 	size_t len;
 
@@ -17,15 +18,16 @@ int open_sampler_by_extension(struct sampler **sampler, const char *filename)
 		return -EIO;
 
 	if (memcmp(&filename[len-4], ".bmp", 4) == 0)
-		return bmp_open(sampler, filename);
+		return bmp_open(sampler, filename, flags);
 
 	if (memcmp(&filename[len-4], ".wav", 4) == 0)
-		return wav_open(sampler, filename);
+		return wav_open(sampler, filename, flags);
 
 	return -EIO;
 }
 
-int try_mount_lsb(struct ghostfs **pgfs, struct stegger **plsb, struct sampler *sampler)
+int try_mount_lsb(struct ghostfs **pgfs, struct stegger **plsb, struct sampler *sampler,
+		  const char *password, int flags)
 {
 	struct stegger *lsb;
 	struct ghostfs *gfs;
@@ -36,7 +38,15 @@ int try_mount_lsb(struct ghostfs **pgfs, struct stegger **plsb, struct sampler *
 		if (ret < 0)
 			return ret;
 
-		ret = ghostfs_mount(&gfs, lsb);
+		if (password) {
+			ret = cipher_open(&lsb, lsb, password);
+			if (ret < 0) {
+				stegger_close(lsb);
+				return ret;
+			}
+		}
+
+		ret = ghostfs_mount(&gfs, lsb, flags);
 		if (ret == 0) {
 			*pgfs = gfs;
 			*plsb = lsb;
@@ -9,7 +9,9 @@ struct ghostfs;
 struct stegger;
 struct sampler;
 
-int open_sampler_by_extension(struct sampler **sampler, const char *filename);
-int try_mount_lsb(struct ghostfs **pgfs, struct stegger **plsb, struct sampler *sampler);
+int open_sampler_by_extension(struct sampler **sampler, const char *filename, int flags);
+// try_mount_lsb encrypts through cipher_open when password is not NULL
+int try_mount_lsb(struct ghostfs **pgfs, struct stegger **plsb, struct sampler *sampler,
+		  const char *password, int flags);
 
 #endif
@@ -63,7 +63,7 @@ int wav_close(struct sampler *sampler)
 	return 0;
 }
 
-int wav_open(struct sampler **sampler, const char *filename)
+int wav_open(struct sampler **sampler, const char *filename, int flags)
 {
 	struct sampler *s;
 	int ret;
@@ -72,7 +72,7 @@ int wav_open(struct sampler **sampler, const char *filename)
 	if (!s)
 		return -ENOMEM;
 
-	ret = sampler_init(s, filename);
+	ret = sampler_init(s, filename, flags);
 	if (ret < 0) {
 		free(s);
 		return ret;
@@ -3,6 +3,6 @@
 
 #include "sampler.h"
 
-int wav_open(struct sampler **sampler, const char *filename);
+int wav_open(struct sampler **sampler, const char *filename, int flags);
 
 #endif